@@ -7,7 +7,8 @@ layout(location = 1) flat in int materialId;
 
 layout(location = 0) out vec4 outColor;
 
-layout(binding = 15) uniform sampler2D tex[];
+// TextureSystem's bindless table, indexed by texture handle
+layout(set = 1, binding = 0) uniform sampler2D tex[];
 
 void main() {
     outColor = vec4(texture(tex[nonuniformEXT(materialId)], uv).rgb, 1.0);
@@ -5,6 +5,9 @@
 #include "buffer.hpp"
 #include "texture_system.hpp"
 #include "mesh_system.hpp"
+#include "descriptor_cache.hpp"
+#include "uniform_ring.hpp"
+#include "worker_pool.hpp"
 
 #include <string>
 #include <fstream>
@@ -66,7 +69,6 @@ int main(int, char**)
 
   // Our GPU buffers holding the vertices and the indices
   std::shared_ptr<Buffer> vertexBuffer, indexBuffer;
-  Buffer* uniformBuffer;
 
   BG::VertexBufferBinding vertexBinding;
 
@@ -168,6 +170,10 @@ int main(int, char**)
       // Add an attachment for the pipeline to render to
       pipeline->AddAttachment(r.getSwapChainFormat(), vk::ImageLayout::eUndefined, vk::ImageLayout::ePresentSrcKHR);
       pipeline->AddDepthAttachment();
+      // The constants are written to the renderer's uniform ring every frame, at a different offset
+      pipeline->SetDynamicUniformBuffer(0);
+      // Textures are read from the texture system's bindless table, at descriptor set 1
+      pipeline->SetExternalDescSetLayout(1, r.getTextureSystem().GetDescSetLayout());
       // Build the pipeline
       pipeline->BuildPipeline();
     },
@@ -187,43 +193,47 @@ int main(int, char**)
       projMtx = glm::perspective(glm::radians(45.0f), float(width) / float(height), 0.01f, 1000.0f);
       projMtx[1][1] *= -1.0;
 
-      // Map & upload the constants
-      uniformBuffer = r.getMemoryAllocator().AllocTransient(sizeof(ShaderUniform) * r.getSwapchainImageViews().size(), vk::BufferUsageFlagBits::eUniformBuffer);
-      ShaderUniform* uniformBufferGPU = uniformBuffer->Map<ShaderUniform>();
-      uniformBufferGPU->viewProjMtx = projMtx * viewMtx;
-      uniformBuffer->UnMap();
+      // Upload the constants, this only bumps a pointer in the uniform ring
+      ShaderUniform uniform;
+      uniform.viewProjMtx = projMtx * viewMtx;
+      uint32_t uniformOffset = r.getUniformRing().Push(uniform);
 
-      // Allocate descriptor sets & bind uniforms
-      auto descSet = pipeline->AllocDescSet(ctx.descPool, r.getTextureSystem().GetNumImageViews() + 1);
-      pipeline->BindGraphicsUniformBuffer(*pipeline, descSet, *uniformBuffer, 0, sizeof(ShaderUniform), 0);
-
-      for (int i = 0; i < r.getTextureSystem().GetNumImageViews(); i++)
-      {
-        pipeline->BindGraphicsImageView(*pipeline, descSet, r.getTextureSystem().GetImageView({ i }), vk::ImageLayout::eShaderReadOnlyOptimal, r.getTextureSystem().GetSampler(), 15, i);
-      }
+      // The descriptor set only points at the ring buffer, so it's cached
+      auto descSet = r.getDescriptorCache().Get(*pipeline, DescriptorCache::Bindings()
+        .UniformBufferDynamic(0, r.getUniformRing().GetBuffer(), sizeof(ShaderUniform)));
+      // The texture table is persistent, nothing to write per frame
+      auto textureSet = r.getTextureSystem().GetDescSet(ctx.currentFrame);
 
       // Begin & resets the command buffer
       ctx.cmdBuffer.Begin();
       // Use the RenderPass from the pipeline we built
       std::vector<vk::ImageView> renderTarget{ ctx.imageView, ctx.depthImageView };
-      ctx.cmdBuffer.WithRenderPass(*pipeline, renderTarget, glm::uvec2(width, height), [&](){
+      // Flatten the scene into a draw list, so that it can be split across recording threads
+      std::vector<std::pair<const DrawCmd*, glm::mat4>> drawList;
+      rootNode->ForEach(globalTransform, [&](const MeshSystem::Node& n, glm::mat4 transform) {
+        if (n.HasMesh()) drawList.push_back({ &drawObjects.at(&n), transform });
+        });
+
+      uint32_t numJobs = std::min(uint32_t(drawList.size()) / 64 + 1, r.getWorkerPool().GetNumThreads() + 1);
+      // Each job records its slice of the draw list into its own secondary command buffer
+      ctx.cmdBuffer.WithRenderPassParallel(*pipeline, renderTarget, glm::uvec2(width, height), numJobs, [&](CommandBuffer& cmdBuf, uint32_t job) {
         // Bind the pipeline to use
-        ctx.cmdBuffer.BindPipeline(*pipeline);
+        cmdBuf.BindPipeline(*pipeline);
         // Bind the vertex buffer
-        ctx.cmdBuffer.BindVertexBuffer(vertexBinding, *vertexBuffer, 0);
+        cmdBuf.BindVertexBuffer(vertexBinding, *vertexBuffer, 0);
         // Bind the index buffer
-        ctx.cmdBuffer.BindIndexBuffer(*indexBuffer, 0);
+        cmdBuf.BindIndexBuffer(*indexBuffer, 0);
         // Bind the descriptor sets (uniform buffer, texture, etc.)
-        ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet);
+        cmdBuf.BindGraphicsDescSets(*pipeline, descSet, { uniformOffset });
+        cmdBuf.BindGraphicsDescSets(*pipeline, textureSet, 1);
         // Draw objects
-        rootNode->ForEach(globalTransform, [&](const MeshSystem::Node& n, glm::mat4 transform) {
-          if (n.HasMesh())
-          {
-            auto& drawCmd = drawObjects[&n];
-            ctx.cmdBuffer.PushConstants(*pipeline, vk::ShaderStageFlagBits::eVertex, 0, transform);
-            ctx.cmdBuffer.DrawIndexed(drawCmd.indexCount, drawCmd.firstIndex, drawCmd.vertexOffset);
-          }
-          });
+        size_t begin = drawList.size() * job / numJobs, end = drawList.size() * (job + 1) / numJobs;
+        for (size_t i = begin; i < end; i++)
+        {
+          auto& drawCmd = *drawList[i].first;
+          cmdBuf.PushConstants(*pipeline, vk::ShaderStageFlagBits::eVertex, 0, drawList[i].second);
+          cmdBuf.DrawIndexed(drawCmd.indexCount, drawCmd.firstIndex, drawCmd.vertexOffset);
+        }
         });
       // End the recording of command buffer
       ctx.cmdBuffer.End();
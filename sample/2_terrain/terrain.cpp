@@ -4,6 +4,9 @@
 #include "command_buffer.hpp"
 #include "buffer.hpp"
 #include "texture_system.hpp"
+#include "descriptor_cache.hpp"
+#include "uniform_ring.hpp"
+#include "sampler_cache.hpp"
 
 #include <string>
 #include <fstream>
@@ -94,7 +97,6 @@ int main(int, char**)
 
   // Our GPU buffers holding the vertices and the indices
   std::unique_ptr<Buffer> vertexBuffer, indexBuffer;
-  Buffer* uniformBuffer;
 
   BG::VertexBufferBinding vertexBinding;
 
@@ -130,9 +132,6 @@ int main(int, char**)
       std::copy(indicies.begin(), indicies.end(), indexBufferGPU);
       indexBuffer->UnMap();
 
-      // Allocate a constants buffer
-      //uniformBuffer = r.getMemoryAllocator().AllocCPU2GPU(sizeof(ShaderUniform) * r.getSwapchainImageViews().size(), vk::BufferUsageFlagBits::eUniformBuffer);
-
       // Create a empty pipline
       pipeline = r.CreatePipeline();
       // Add a vertex binding
@@ -147,6 +146,12 @@ int main(int, char**)
       // Add an attachment for the pipeline to render to
       pipeline->AddAttachment(r.getSwapChainFormat(), vk::ImageLayout::eUndefined, vk::ImageLayout::ePresentSrcKHR);
       pipeline->AddDepthAttachment();
+      // The constants are written to the renderer's uniform ring every frame, at a different offset
+      pipeline->SetDynamicUniformBuffer(0);
+      // The height map sampler is baked into the layout, clamped at the edges of the terrain
+      SamplerDesc heightmapSampler;
+      heightmapSampler.addressU = heightmapSampler.addressV = vk::SamplerAddressMode::eClampToEdge;
+      pipeline->SetImmutableSampler(1, r.getSamplerCache().Get(heightmapSampler));
       // Build the pipeline
       pipeline->BuildPipeline();
     },
@@ -159,16 +164,15 @@ int main(int, char**)
       glm::mat4 projMtx = glm::perspective(glm::radians(45.0f), float(width) / float(height), 0.1f, 256.0f);
       projMtx[1][1] *= -1.0;
 
-      // Map & upload the constants
-      uniformBuffer = r.getMemoryAllocator().AllocTransient(sizeof(ShaderUniform), vk::BufferUsageFlagBits::eUniformBuffer);
-      ShaderUniform* uniformBufferGPU = uniformBuffer->Map<ShaderUniform>();
-      uniformBufferGPU->viewProjMtx = projMtx * viewMtx;
-      uniformBuffer->UnMap();
+      // Upload the constants, this only bumps a pointer in the uniform ring
+      ShaderUniform uniform;
+      uniform.viewProjMtx = projMtx * viewMtx;
+      uint32_t uniformOffset = r.getUniformRing().Push(uniform);
 
-      // Allocate descriptor sets & bind uniforms
-      auto descSet = pipeline->AllocDescSet(ctx.descPool);
-      pipeline->BindGraphicsUniformBuffer(*pipeline, descSet, *uniformBuffer, 0, sizeof(ShaderUniform), 0);
-      pipeline->BindGraphicsImageView(*pipeline, descSet, r.getTextureSystem().GetImageView({ 0 }), vk::ImageLayout::eShaderReadOnlyOptimal, r.getTextureSystem().GetSampler(), 1);
+      // The descriptor set is the same every frame (the ring buffer & the height map), so it's cached
+      auto descSet = r.getDescriptorCache().Get(*pipeline, DescriptorCache::Bindings()
+        .UniformBufferDynamic(0, r.getUniformRing().GetBuffer(), sizeof(ShaderUniform))
+        .ImageView(1, r.getTextureSystem().GetImageView({ 0 }), vk::ImageLayout::eShaderReadOnlyOptimal, r.getTextureSystem().GetSampler()));
 
       // Begin & resets the command buffer
       ctx.cmdBuffer.Begin();
@@ -182,7 +186,7 @@ int main(int, char**)
         // Bind the index buffer
         ctx.cmdBuffer.BindIndexBuffer(*indexBuffer, 0);
         // Bind the descriptor sets (uniform buffer, texture, etc.)
-        ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet);
+        ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet, { uniformOffset });
         // Draw terrain
         ctx.cmdBuffer.PushConstants(*pipeline, vk::ShaderStageFlagBits::eVertex, 0, terrainTransform);
         ctx.cmdBuffer.DrawIndexed(uint32_t(indicies.size()), 0, 0);
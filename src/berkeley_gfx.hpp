@@ -14,12 +14,31 @@ namespace BG
 {
   class Buffer;
   class CommandBuffer;
+  class DescriptorAllocator;
+  class DescriptorCache;
+  class FencePool;
+  class FramebufferCache;
+  class FrameStats;
+  class GpuProfiler;
   class Image;
+  struct Ktx2Texture;
   class MemoryAllocator;
   class Pipeline;
+  class PipelineCache;
+  class PipelineObjectCache;
   class Renderer;
+  class SamplerCache;
+  struct SamplerDesc;
+  class ShaderCache;
+  class StagingPool;
+  class StreamingUploader;
+  class TextureResidency;
   class TextureSystem;
+  class UniformRing;
+  class UploadBatch;
   class Tracker;
+  class ThreadCommandPools;
+  class WorkerPool;
   class BBox;
 
   namespace MeshSystem
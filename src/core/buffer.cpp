@@ -3,10 +3,20 @@
 #define VMA_IMPLEMENTATION
 #include "vk_mem_alloc.h"
 
-BG::MemoryAllocator::MemoryAllocator(vk::PhysicalDevice pDevice, vk::Device device, vk::Instance instance, uint32_t maxFramesInFlight)
+#include "imgui.h"
+
+#include <fstream>
+
+BG::MemoryAllocator::MemoryAllocator(vk::PhysicalDevice pDevice, vk::Device device, vk::Instance instance, uint32_t maxFramesInFlight, bool memoryBudget)
 {
   VmaAllocatorCreateInfo allocatorInfo = {};
   allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_0;
+  if (memoryBudget)
+  {
+    // The budget query goes through vkGetPhysicalDeviceMemoryProperties2, core in 1.1
+    allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_1;
+    allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+  }
   allocatorInfo.physicalDevice = pDevice;
   allocatorInfo.device = device;
   allocatorInfo.instance = instance;
@@ -45,39 +55,77 @@ BG::MemoryAllocator::~MemoryAllocator()
   vmaDestroyAllocator(allocator);
 }
 
-void BG::MemoryAllocator::NewFrame()
+void BG::MemoryAllocator::NewFrame(uint32_t frameIndex)
 {
-  m_currentFrame = (m_currentFrame + 1) % m_buffers.size();
+  m_currentFrame = frameIndex % m_buffers.size();
   m_buffers[m_currentFrame].clear();
 }
 
-std::unique_ptr<BG::Buffer> BG::MemoryAllocator::Alloc(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage)
+BG::MemoryAllocator::Budget BG::MemoryAllocator::GetDeviceLocalBudget()
+{
+  const VkPhysicalDeviceMemoryProperties* memoryProperties;
+  vmaGetMemoryProperties(allocator, &memoryProperties);
+
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetBudget(allocator, budgets);
+
+  Budget total;
+  for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; i++)
+  {
+    if (!(memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)) continue;
+
+    total.usage += budgets[i].usage;
+    total.budget += budgets[i].budget;
+  }
+
+  return total;
+}
+
+std::unique_ptr<BG::Buffer> BG::MemoryAllocator::Alloc(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage, VmaAllocationCreateFlags flags)
 {
   VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
   bufferInfo.size = size;
   bufferInfo.usage = VkBufferUsageFlags(usage);
 
+  Category category = BufferCategory(usage, memoryUsage);
+
+  // Named by category in the vmaBuildStatsString dump
   VmaAllocationCreateInfo allocInfo = {};
   allocInfo.usage = memoryUsage;
+  allocInfo.flags = flags | VMA_ALLOCATION_CREATE_USER_DATA_COPY_STRING_BIT;
+  allocInfo.pUserData = (void*)GetCategoryName(category);
 
   VkBuffer buffer;
   VmaAllocation allocation;
-  vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, nullptr);
+  VmaAllocationInfo info;
+  VkResult result = vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, &info);
+  if (result != VK_SUCCESS)
+  {
+    spdlog::error("Failed to allocate a {} byte buffer: {}", size, vk::to_string(vk::Result(result)));
+    throw std::runtime_error("Buffer allocation failed");
+  }
 
-  return std::make_unique<BG::Buffer>(allocator, buffer, allocation);
+  auto ptr = std::make_unique<BG::Buffer>(allocator, buffer, allocation);
+  Track(ptr->m_tag, category, info.size);
+
+  return ptr;
 }
 
 BG::Buffer::Buffer(VmaAllocator& allocator, vk::Buffer buffer, VmaAllocation allocation)
-  : allocator(allocator), buffer(buffer), allocation(allocation)
+  : allocator(allocator), buffer(buffer), allocation(allocation), uid(GetUID())
 {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(allocator, allocation, &info);
+  m_persistentData = info.pMappedData;
 }
 
 BG::Buffer::~Buffer()
 {
+  if (m_tag.owner) m_tag.owner->Untrack(m_tag);
   vmaDestroyBuffer(allocator, buffer, allocation);
 }
 
-std::unique_ptr<BG::Image> BG::MemoryAllocator::AllocImage2D(glm::uvec2 extent, int mipLevels, vk::Format format, vk::ImageUsageFlags usage, vk::ImageLayout layout, VmaMemoryUsage memoryUsage)
+std::unique_ptr<BG::Image> BG::MemoryAllocator::AllocImage2D(glm::uvec2 extent, int mipLevels, vk::Format format, vk::ImageUsageFlags usage, vk::ImageLayout layout, VmaMemoryUsage memoryUsage, VmaAllocationCreateFlags flags)
 {
   vk::ImageCreateInfo imageInfo;
   imageInfo.extent.width = extent.x;
@@ -95,14 +143,35 @@ std::unique_ptr<BG::Image> BG::MemoryAllocator::AllocImage2D(glm::uvec2 extent,
 
   VkImageCreateInfo _imageInfo = imageInfo;
 
+  Category category = ImageCategory(usage);
+
   VmaAllocationCreateInfo allocInfo = {};
   allocInfo.usage = memoryUsage;
+  allocInfo.flags = flags | VMA_ALLOCATION_CREATE_USER_DATA_COPY_STRING_BIT;
+  allocInfo.pUserData = (void*)GetCategoryName(category);
 
   VkImage image;
   VmaAllocation allocation;
-  vmaCreateImage(allocator, &_imageInfo, &allocInfo, &image, &allocation, nullptr);
+  VmaAllocationInfo info;
+  VkResult result = vmaCreateImage(allocator, &_imageInfo, &allocInfo, &image, &allocation, &info);
+  if (result != VK_SUCCESS)
+  {
+    // Running out of budget is expected when the caller asked to stay within it, and handled there
+    if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY && (flags & VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT))
+    {
+      spdlog::debug("Allocating a {}x{} {} image would exceed the memory budget", extent.x, extent.y, vk::to_string(format));
+    }
+    else
+    {
+      spdlog::error("Failed to allocate a {}x{} {} image: {}", extent.x, extent.y, vk::to_string(format), vk::to_string(vk::Result(result)));
+    }
+    throw std::runtime_error("Image allocation failed");
+  }
 
-  return std::make_unique<BG::Image>(allocator, image, allocation);
+  auto ptr = std::make_unique<BG::Image>(allocator, image, allocation);
+  Track(ptr->m_tag, category, info.size);
+
+  return ptr;
 }
 
 BG::Buffer* BG::MemoryAllocator::AllocTransient(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage)
@@ -114,12 +183,20 @@ BG::Buffer* BG::MemoryAllocator::AllocTransient(size_t size, vk::BufferUsageFlag
   VmaAllocationCreateInfo allocInfo = {};
   allocInfo.usage = memoryUsage;
   allocInfo.pool = transientPool;
+  allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
 
   VkBuffer buffer;
   VmaAllocation allocation;
-  vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, nullptr);
+  VmaAllocationInfo info;
+  VkResult result = vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, &info);
+  if (result != VK_SUCCESS)
+  {
+    spdlog::error("Failed to allocate a {} byte transient buffer: {}", size, vk::to_string(vk::Result(result)));
+    throw std::runtime_error("Transient buffer allocation failed");
+  }
 
   auto ptr = std::make_unique<BG::Buffer>(allocator, buffer, allocation);
+  Track(ptr->m_tag, Category::Transient, info.size);
 
   Buffer* retVal = ptr.get();
 
@@ -137,12 +214,189 @@ BG::Image::Image(VmaAllocator& allocator, vk::Image image)
 BG::Image::Image(VmaAllocator& allocator, vk::Image image, VmaAllocation allocation, bool color, bool depth)
   : allocator(allocator), image(image), allocation(allocation), colorPlane(color), depthPlane(depth)
 {
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo(allocator, allocation, &info);
+  m_persistentData = info.pMappedData;
 }
 
 BG::Image::~Image()
 {
   if (allocated)
   {
+    if (m_tag.owner) m_tag.owner->Untrack(m_tag);
     vmaDestroyImage(allocator, image, allocation);
   }
 }
+
+BG::MemoryAllocator::Category BG::MemoryAllocator::BufferCategory(vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage)
+{
+  if (usage & (vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eIndexBuffer)) return Category::Geometry;
+  if (usage & vk::BufferUsageFlagBits::eUniformBuffer) return Category::Uniforms;
+
+  bool hostVisible = memoryUsage == VMA_MEMORY_USAGE_CPU_ONLY || memoryUsage == VMA_MEMORY_USAGE_CPU_TO_GPU;
+  if (hostVisible && (usage & vk::BufferUsageFlagBits::eTransferSrc)) return Category::Staging;
+
+  return Category::Other;
+}
+
+BG::MemoryAllocator::Category BG::MemoryAllocator::ImageCategory(vk::ImageUsageFlags usage)
+{
+  if (usage & (vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eDepthStencilAttachment)) return Category::RenderTargets;
+  if (usage & vk::ImageUsageFlagBits::eSampled) return Category::Textures;
+
+  return Category::Other;
+}
+
+void BG::MemoryAllocator::Track(Tag& tag, Category category, vk::DeviceSize size)
+{
+  tag.owner = this;
+  tag.category = category;
+  tag.size = size;
+
+  auto& counter = m_categories[size_t(category)];
+  counter.bytes += tag.size;
+  counter.allocations++;
+}
+
+void BG::MemoryAllocator::Untrack(const Tag& tag)
+{
+  auto& counter = m_categories[size_t(tag.category)];
+  counter.bytes -= tag.size;
+  counter.allocations--;
+}
+
+BG::MemoryAllocator::CategoryStats BG::MemoryAllocator::GetCategoryStats(Category category) const
+{
+  auto& counter = m_categories[size_t(category)];
+
+  CategoryStats stats;
+  stats.bytes = counter.bytes.load();
+  stats.allocations = counter.allocations.load();
+
+  return stats;
+}
+
+const char* BG::MemoryAllocator::GetCategoryName(Category category)
+{
+  switch (category)
+  {
+  case Category::Textures: return "Textures";
+  case Category::RenderTargets: return "RenderTargets";
+  case Category::Geometry: return "Geometry";
+  case Category::Uniforms: return "Uniforms";
+  case Category::Transient: return "Transient";
+  case Category::Staging: return "Staging";
+  default: return "Other";
+  }
+}
+
+std::vector<BG::MemoryAllocator::HeapStats> BG::MemoryAllocator::GetHeapStats()
+{
+  const VkPhysicalDeviceMemoryProperties* memoryProperties;
+  vmaGetMemoryProperties(allocator, &memoryProperties);
+
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetBudget(allocator, budgets);
+
+  VmaStats stats;
+  vmaCalculateStats(allocator, &stats);
+
+  std::vector<HeapStats> heaps(memoryProperties->memoryHeapCount);
+  for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; i++)
+  {
+    const VmaStatInfo& info = stats.memoryHeap[i];
+
+    auto& heap = heaps[i];
+    heap.deviceLocal = (memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    heap.size = memoryProperties->memoryHeaps[i].size;
+    heap.usage = budgets[i].usage;
+    heap.budget = budgets[i].budget;
+    heap.blockBytes = budgets[i].blockBytes;
+    heap.usedBytes = info.usedBytes;
+    heap.blocks = info.blockCount;
+    heap.allocations = info.allocationCount;
+    heap.freeRanges = info.unusedRangeCount;
+    heap.largestFreeRange = info.unusedRangeCount > 0 ? info.unusedRangeSizeMax : 0;
+  }
+
+  return heaps;
+}
+
+std::string BG::MemoryAllocator::BuildStatsJson(bool detailed)
+{
+  char* json;
+  vmaBuildStatsString(allocator, &json, detailed ? VK_TRUE : VK_FALSE);
+
+  std::string result(json);
+  vmaFreeStatsString(allocator, json);
+
+  return result;
+}
+
+bool BG::MemoryAllocator::DumpStatsJson(const std::string& path, bool detailed)
+{
+  std::ofstream f(path);
+  if (!f) return false;
+
+  f << BuildStatsJson(detailed);
+
+  return bool(f);
+}
+
+void BG::MemoryAllocator::RenderGUI()
+{
+  if (m_guiFrame++ % 30 == 0) m_guiHeaps = GetHeapStats();
+
+  const double MiB = 1024.0 * 1024.0;
+
+  if (ImGui::BeginTable("MemoryHeapsTable", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+  {
+    ImGui::TableSetupColumn("Heap");
+    ImGui::TableSetupColumn("Usage MiB");
+    ImGui::TableSetupColumn("Budget MiB");
+    ImGui::TableSetupColumn("Blocks MiB");
+    ImGui::TableSetupColumn("Used MiB");
+    ImGui::TableSetupColumn("Free ranges");
+    ImGui::TableSetupColumn("Largest free MiB");
+    ImGui::TableHeadersRow();
+
+    for (size_t i = 0; i < m_guiHeaps.size(); i++)
+    {
+      auto& heap = m_guiHeaps[i];
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn(); ImGui::Text("%d%s", int(i), heap.deviceLocal ? " (device)" : "");
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", heap.usage / MiB);
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", heap.budget / MiB);
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", heap.blockBytes / MiB);
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", heap.usedBytes / MiB);
+      ImGui::TableNextColumn(); ImGui::Text("%u", heap.freeRanges);
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", heap.largestFreeRange / MiB);
+    }
+
+    ImGui::EndTable();
+  }
+
+  if (ImGui::BeginTable("MemoryCategoriesTable", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+  {
+    ImGui::TableSetupColumn("Category");
+    ImGui::TableSetupColumn("Allocations");
+    ImGui::TableSetupColumn("MiB");
+    ImGui::TableHeadersRow();
+
+    for (size_t i = 0; i < size_t(Category::Count); i++)
+    {
+      auto stats = GetCategoryStats(Category(i));
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn(); ImGui::TextUnformatted(GetCategoryName(Category(i)));
+      ImGui::TableNextColumn(); ImGui::Text("%u", stats.allocations);
+      ImGui::TableNextColumn(); ImGui::Text("%.1f", stats.bytes / MiB);
+    }
+
+    ImGui::EndTable();
+  }
+
+  if (ImGui::Button("Dump JSON"))
+  {
+    if (DumpStatsJson("memory_stats.json")) spdlog::info("Memory stats written to memory_stats.json");
+  }
+}
@@ -5,38 +5,136 @@
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan.hpp>
 
+#include <array>
+#include <atomic>
+
 namespace BG
 {
 
   class MemoryAllocator
   {
+  public:
+    // What an allocation is for, inferred from its usage flags
+    enum class Category
+    {
+      Textures,      // Sampled images
+      RenderTargets, // Color / depth attachments
+      Geometry,      // Vertex & index buffers
+      Uniforms,      // Uniform buffers, including the uniform ring
+      Transient,     // AllocTransient, freed every frame
+      Staging,       // Host visible transfer sources
+      Other,
+      Count,
+    };
+
+    struct CategoryStats
+    {
+      vk::DeviceSize bytes = 0;
+      uint32_t allocations = 0;
+    };
+
+    struct HeapStats
+    {
+      bool deviceLocal = false;
+      vk::DeviceSize size = 0;
+      // Of the whole process, from vmaGetBudget
+      vk::DeviceSize usage = 0;
+      vk::DeviceSize budget = 0;
+      // VMA's own memory blocks, from vmaCalculateStats
+      vk::DeviceSize blockBytes = 0;
+      vk::DeviceSize usedBytes = 0;
+      uint32_t blocks = 0;
+      uint32_t allocations = 0;
+      uint32_t freeRanges = 0;
+      vk::DeviceSize largestFreeRange = 0;
+    };
+
+    struct Budget
+    {
+      vk::DeviceSize usage = 0;
+      vk::DeviceSize budget = 0;
+    };
+
+    // Set on the buffers & images the allocator created, counted out of their category when destroyed
+    struct Tag
+    {
+      MemoryAllocator* owner = nullptr;
+      Category category = Category::Other;
+      vk::DeviceSize size = 0;
+    };
+
   private:
     VmaAllocator allocator;
 
-    uint32_t m_currentFrame;
+    uint32_t m_currentFrame = 0;
 
     std::vector<std::vector<std::unique_ptr<Buffer>>> m_buffers;
 
     VmaPool transientPool;
 
+    struct CategoryCounter
+    {
+      std::atomic<uint64_t> bytes{ 0 };
+      std::atomic<uint32_t> allocations{ 0 };
+    };
+    std::array<CategoryCounter, size_t(Category::Count)> m_categories;
+
+    // GUI thread only
+    std::vector<HeapStats> m_guiHeaps;
+    uint32_t m_guiFrame = 0;
+
+    static Category BufferCategory(vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+    static Category ImageCategory(vk::ImageUsageFlags usage);
+    // Only for allocations that succeeded, with the size VMA reported on creation
+    void Track(Tag& tag, Category category, vk::DeviceSize size);
+
+    friend class Buffer;
+    friend class Image;
+    void Untrack(const Tag& tag);
+
   public:
 
-    MemoryAllocator(vk::PhysicalDevice pDevice, vk::Device device, vk::Instance instance, uint32_t maxFramesInFlight);
+    // With `memoryBudget`, VK_EXT_memory_budget must be enabled on the device
+    MemoryAllocator(vk::PhysicalDevice pDevice, vk::Device device, vk::Instance instance, uint32_t maxFramesInFlight, bool memoryBudget = false);
     ~MemoryAllocator();
 
-    void NewFrame();
+    // Frees the transient buffers allocated the last time `frameIndex` was recorded
+    void NewFrame(uint32_t frameIndex);
+
+    // Summed over the device local heaps, from vmaGetBudget. Estimated by VMA without VK_EXT_memory_budget.
+    Budget GetDeviceLocalBudget();
 
-    // Static allocation
-    std::unique_ptr<Buffer> Alloc(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+    // Static allocation. With VMA_ALLOCATION_CREATE_MAPPED_BIT in `flags` the memory stays mapped for its
+    // whole lifetime, and Map / UnMap don't call into the driver.
+    std::unique_ptr<Buffer> Alloc(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage, VmaAllocationCreateFlags flags = 0);
     inline std::unique_ptr<Buffer> Alloc(size_t size, vk::BufferUsageFlags usage) { return Alloc(size, usage, VMA_MEMORY_USAGE_GPU_ONLY); }
     inline std::unique_ptr<Buffer> AllocCPU2GPU(size_t size, vk::BufferUsageFlags usage) { return Alloc(size, usage, VMA_MEMORY_USAGE_CPU_TO_GPU); }
     inline std::unique_ptr<Buffer> AllocGPU2CPU(size_t size, vk::BufferUsageFlags usage) { return Alloc(size, usage, VMA_MEMORY_USAGE_GPU_TO_CPU); }
+    // Persistently mapped, for buffers written (or read) by the CPU every frame
+    inline std::unique_ptr<Buffer> AllocMapped(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_CPU_TO_GPU) { return Alloc(size, usage, memoryUsage, VMA_ALLOCATION_CREATE_MAPPED_BIT); }
 
+    // Throws when the allocation fails. With VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT, going over budget is only logged at debug level.
     std::unique_ptr<Image> AllocImage2D(
       glm::uvec2 extent, int mipLevels, vk::Format format, vk::ImageUsageFlags usage,
-      vk::ImageLayout layout = vk::ImageLayout::eUndefined, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY);
+      vk::ImageLayout layout = vk::ImageLayout::eUndefined, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+      VmaAllocationCreateFlags flags = 0);
 
+    // Persistently mapped
     Buffer* AllocTransient(size_t size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_CPU_TO_GPU);
+
+    // Thread safe and cheap, kept up to date on every allocation
+    CategoryStats GetCategoryStats(Category category) const;
+    static const char* GetCategoryName(Category category);
+
+    // Per heap budget and fragmentation. vmaCalculateStats walks every block, don't call it every frame.
+    std::vector<HeapStats> GetHeapStats();
+
+    // vmaBuildStatsString. The detailed map lists every allocation, named by its category.
+    std::string BuildStatsJson(bool detailed = true);
+    bool DumpStatsJson(const std::string& path, bool detailed = true);
+
+    // Heap & category tables with a JSON dump button, refreshed every 30 GUI frames
+    void RenderGUI();
   };
 
   class Buffer
@@ -44,15 +142,33 @@ namespace BG
   private:
     VmaAllocator& allocator;
 
+    friend class MemoryAllocator;
+    MemoryAllocator::Tag m_tag;
+
+    void* m_persistentData = nullptr; // Allocated with VMA_ALLOCATION_CREATE_MAPPED_BIT
+
   public:
     vk::Buffer buffer;
     VmaAllocation allocation;
+    // Unique for the process lifetime, unlike the handle which may be reused after destruction
+    uint64_t uid;
 
     Buffer(VmaAllocator& allocator, vk::Buffer buffer, VmaAllocation allocation);
     ~Buffer();
 
-    template <class T> T* Map() { void* pData; vmaMapMemory(allocator, allocation, &pData); return (T*)(pData); }
-    inline void UnMap() { vmaUnmapMemory(allocator, allocation); };
+    template <class T> T* Map()
+    {
+      if (m_persistentData) return (T*)(m_persistentData);
+      void* pData; vmaMapMemory(allocator, allocation, &pData); return (T*)(pData);
+    }
+    // Flushes the CPU writes, and unmaps unless persistently mapped
+    inline void UnMap() { Flush(); if (!m_persistentData) vmaUnmapMemory(allocator, allocation); };
+
+    inline bool IsPersistentlyMapped() const { return m_persistentData != nullptr; }
+
+    // No-ops on host coherent memory. Flush after CPU writes, invalidate before CPU reads of GPU writes.
+    inline void Flush(vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) { vmaFlushAllocation(allocator, allocation, offset, size); }
+    inline void Invalidate(vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) { vmaInvalidateAllocation(allocator, allocation, offset, size); }
   };
 
   class Image
@@ -65,6 +181,11 @@ namespace BG
 
     bool allocated = true;
 
+    friend class MemoryAllocator;
+    MemoryAllocator::Tag m_tag;
+
+    void* m_persistentData = nullptr; // Allocated with VMA_ALLOCATION_CREATE_MAPPED_BIT
+
   public:
     vk::Image image;
     VmaAllocation allocation;
@@ -76,8 +197,17 @@ namespace BG
     inline bool HasColorPlane() const { return colorPlane; }
     inline bool HasDepthPlane() const { return depthPlane; }
 
-    template <class T> T* Map() { void* pData; vmaMapMemory(allocator, allocation, &pData); return (T*)(pData); }
-    inline void UnMap() { vmaUnmapMemory(allocator, allocation); };
+    // Only for linear, host visible images
+    template <class T> T* Map()
+    {
+      if (m_persistentData) return (T*)(m_persistentData);
+      void* pData; vmaMapMemory(allocator, allocation, &pData); return (T*)(pData);
+    }
+    inline void UnMap() { Flush(); if (!m_persistentData) vmaUnmapMemory(allocator, allocation); };
+
+    inline bool IsPersistentlyMapped() const { return m_persistentData != nullptr; }
 
+    inline void Flush(vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) { vmaFlushAllocation(allocator, allocation, offset, size); }
+    inline void Invalidate(vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) { vmaInvalidateAllocation(allocator, allocation, offset, size); }
   };
 }
\ No newline at end of file
@@ -2,10 +2,30 @@
 #include "buffer.hpp"
 #include "pipelines.hpp"
 #include "lifetime_tracker.hpp"
+#include "renderer.hpp"
+#include "worker_pool.hpp"
+#include "command_pools.hpp"
+#include "framebuffer_cache.hpp"
 
 void BG::CommandBuffer::Begin()
 {
   m_buf.begin(vk::CommandBufferBeginInfo{ {}, nullptr });
+  m_begun = true;
+
+  if (m_profiler) m_profiler->ResetQueries(m_buf);
+}
+
+void BG::CommandBuffer::BeginSecondary(vk::RenderPass renderPass, vk::Framebuffer frameBuffer)
+{
+  vk::CommandBufferInheritanceInfo inheritance;
+  inheritance.renderPass = renderPass;
+  inheritance.subpass = 0;
+  inheritance.framebuffer = frameBuffer;
+
+  m_buf.begin(vk::CommandBufferBeginInfo{
+    vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+    &inheritance });
+  m_begun = true;
 }
 
 void BG::CommandBuffer::End()
@@ -13,14 +33,25 @@ void BG::CommandBuffer::End()
   m_buf.end();
 }
 
-void BG::CommandBuffer::BeginRenderPass(Pipeline& p, vk::Framebuffer& frameBuffer, glm::uvec2 extent, glm::vec4 clearColor, glm::ivec2 offset)
+void BG::CommandBuffer::BeginRenderPass(Pipeline& p, vk::Framebuffer& frameBuffer, glm::uvec2 extent, glm::vec4 clearColor, glm::ivec2 offset, vk::SubpassContents contents)
 {
-  p.BindRenderPass(m_buf, frameBuffer, extent, clearColor, offset);
+  p.BindRenderPass(m_buf, frameBuffer, extent, clearColor, offset, contents);
+
+  if (contents == vk::SubpassContents::eInline) m_skipDraws = !p.GetBindablePipeline();
 }
 
-void BG::CommandBuffer::BindPipeline(Pipeline& p)
+bool BG::CommandBuffer::BindPipeline(Pipeline& p)
 {
-  m_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, p.GetPipeline());
+  vk::Pipeline pipeline = p.GetBindablePipeline();
+
+  if (p.IsCompute()) m_skipDispatches = !pipeline;
+  else m_skipDraws = !pipeline;
+
+  if (!pipeline) return false;
+
+  m_buf.bindPipeline(p.IsCompute() ? vk::PipelineBindPoint::eCompute : vk::PipelineBindPoint::eGraphics, pipeline);
+
+  return true;
 }
 
 void BG::CommandBuffer::EndRenderPass()
@@ -30,11 +61,13 @@ void BG::CommandBuffer::EndRenderPass()
 
 void BG::CommandBuffer::Draw(uint32_t vertexCount, uint32_t firstVertex, uint32_t instanceCount, uint32_t firstInstance)
 {
+  if (m_skipDraws) return;
   m_buf.draw(vertexCount, instanceCount, firstVertex, firstInstance);
 }
 
 void BG::CommandBuffer::DrawIndexed(uint32_t indexCount, uint32_t firstIndex, uint32_t vertexOffset, uint32_t instanceCount, uint32_t firstInstance)
 {
+  if (m_skipDraws) return;
   m_buf.drawIndexed(indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
 }
 
@@ -60,6 +93,48 @@ void BG::CommandBuffer::BindGraphicsDescSets(Pipeline& p, vk::DescriptorSet desc
   m_buf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, p.GetLayout(), set, 1, &descSet, 0, nullptr);
 }
 
+void BG::CommandBuffer::BindGraphicsDescSets(Pipeline& p, vk::DescriptorSet descSet, const std::vector<uint32_t>& dynamicOffsets, int set)
+{
+  m_buf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, p.GetLayout(), set, descSet, dynamicOffsets);
+}
+
+void BG::CommandBuffer::BindComputeDescSets(Pipeline& p, vk::DescriptorSet descSet, int set)
+{
+  m_buf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, p.GetLayout(), set, 1, &descSet, 0, nullptr);
+}
+
+void BG::CommandBuffer::Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ)
+{
+  if (m_skipDispatches) return;
+  m_buf.dispatch(groupCountX, groupCountY, groupCountZ);
+}
+
+void BG::CommandBuffer::BufferBarrier(
+  const BG::Buffer& buffer,
+  vk::PipelineStageFlags fromStage, vk::PipelineStageFlags toStage,
+  vk::AccessFlags fromAccess, vk::AccessFlags toAccess,
+  uint32_t fromQueueFamily, uint32_t toQueueFamily,
+  vk::DeviceSize offset, vk::DeviceSize size) const
+{
+  vk::BufferMemoryBarrier barrier;
+  barrier.srcAccessMask = fromAccess;
+  barrier.dstAccessMask = toAccess;
+  barrier.srcQueueFamilyIndex = fromQueueFamily;
+  barrier.dstQueueFamilyIndex = toQueueFamily;
+  barrier.buffer = buffer.buffer;
+  barrier.offset = offset;
+  barrier.size = size;
+
+  m_buf.pipelineBarrier(fromStage, toStage, vk::DependencyFlags(0), 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void BG::CommandBuffer::ExecuteCommands(const std::vector<vk::CommandBuffer>& secondaries)
+{
+  if (secondaries.empty()) return;
+
+  m_buf.executeCommands(secondaries);
+}
+
 vk::AccessFlags getAccessFlags(vk::ImageLayout layout, bool read)
 {
   switch (layout)
@@ -143,6 +218,8 @@ void BG::CommandBuffer::ImageTransition(
 
 void BG::CommandBuffer::WithRenderPass(Pipeline& p, vk::Framebuffer& frameBuffer, glm::uvec2 extent, glm::vec4 clearColor, glm::ivec2 offset, std::function<void()> func)
 {
+  auto zone = ProfileZone(p.GetName().empty() ? "Render pass" : p.GetName(), true);
+
   this->BeginRenderPass(p, frameBuffer, extent, clearColor, offset);
   func();
   this->EndRenderPass();
@@ -153,8 +230,11 @@ void BG::CommandBuffer::WithRenderPass(Pipeline& p, vk::Framebuffer& frameBuffer
   WithRenderPass(p, frameBuffer, extent, glm::vec4(0.0), glm::ivec2(0), func);
 }
 
-void BG::CommandBuffer::WithRenderPass(Pipeline& p, std::vector<vk::ImageView> renderTargets, glm::uvec2 extent, glm::vec4 clearColor, glm::ivec2 offset, std::function<void()> func)
+vk::Framebuffer BG::CommandBuffer::GetFramebuffer(Pipeline& p, const std::vector<vk::ImageView>& renderTargets, glm::uvec2 extent)
 {
+  if (m_renderer) return m_renderer->getFramebufferCache().Get(p.GetRenderPass(), renderTargets, extent);
+
+  // No cache without a renderer, the framebuffer lives for this frame
   vk::FramebufferCreateInfo framebufferInfo;
   framebufferInfo.setRenderPass(p.GetRenderPass());
   framebufferInfo.setAttachments(renderTargets);
@@ -163,10 +243,18 @@ void BG::CommandBuffer::WithRenderPass(Pipeline& p, std::vector<vk::ImageView> r
   framebufferInfo.setLayers(1);
 
   auto fb = m_device.createFramebufferUnique(framebufferInfo);
-
-  WithRenderPass(p, fb.get(), extent, glm::vec4(0.0), glm::ivec2(0), func);
+  vk::Framebuffer framebuffer = fb.get();
 
   m_tracker.DisposeFramebuffer(std::move(fb));
+
+  return framebuffer;
+}
+
+void BG::CommandBuffer::WithRenderPass(Pipeline& p, std::vector<vk::ImageView> renderTargets, glm::uvec2 extent, glm::vec4 clearColor, glm::ivec2 offset, std::function<void()> func)
+{
+  vk::Framebuffer fb = GetFramebuffer(p, renderTargets, extent);
+
+  WithRenderPass(p, fb, extent, glm::vec4(0.0), glm::ivec2(0), func);
 }
 
 void BG::CommandBuffer::WithRenderPass(Pipeline& p, std::vector<vk::ImageView> renderTargets, glm::uvec2 extent, std::function<void()> func)
@@ -174,7 +262,59 @@ void BG::CommandBuffer::WithRenderPass(Pipeline& p, std::vector<vk::ImageView> r
   WithRenderPass(p, renderTargets, extent, glm::vec4(0.0), glm::ivec2(0), func);
 }
 
+void BG::CommandBuffer::WithRenderPassParallel(Pipeline& p, vk::Framebuffer& frameBuffer, glm::uvec2 extent, uint32_t numJobs, std::function<void(CommandBuffer&, uint32_t)> func)
+{
+  if (m_renderer == nullptr)
+  {
+    spdlog::error("Parallel recording needs a command buffer created from the Renderer");
+    throw std::runtime_error("No renderer attached to command buffer");
+  }
+
+  numJobs = std::max(numJobs, 1u);
+
+  // Queries can not stay active across vkCmdExecuteCommands without inheritedQueries, timestamps only
+  auto zone = ProfileZone(p.GetName().empty() ? "Render pass (parallel)" : p.GetName() + " (parallel)");
+
+  this->BeginRenderPass(p, frameBuffer, extent, glm::vec4(0.0), glm::ivec2(0), vk::SubpassContents::eSecondaryCommandBuffers);
+
+  vk::RenderPass renderPass = p.GetRenderPass();
+  vk::Framebuffer fb = frameBuffer;
+  std::vector<vk::CommandBuffer> secondaries(numJobs);
+
+  m_renderer->getWorkerPool().ParallelFor(numJobs, [&](uint32_t job) {
+    CommandBuffer secondary(*m_renderer, m_renderer->getThreadCommandPools().AllocSecondary());
+    secondary.BeginSecondary(renderPass, fb);
+    func(secondary, job);
+    secondary.End();
+
+    secondaries[job] = secondary.GetVkCmdBuf();
+    });
+
+  ExecuteCommands(secondaries);
+
+  this->EndRenderPass();
+}
+
+void BG::CommandBuffer::WithRenderPassParallel(Pipeline& p, std::vector<vk::ImageView> renderTargets, glm::uvec2 extent, uint32_t numJobs, std::function<void(CommandBuffer&, uint32_t)> func)
+{
+  vk::Framebuffer fb = GetFramebuffer(p, renderTargets, extent);
+
+  WithRenderPassParallel(p, fb, extent, numJobs, func);
+}
+
+BG::GpuProfiler::Zone BG::CommandBuffer::ProfileZone(std::string name, bool pipelineStatistics)
+{
+  if (m_profiler == nullptr) return GpuProfiler::Zone();
+
+  return m_profiler->OpenZone(m_zoneState, m_buf, name, pipelineStatistics);
+}
+
 BG::CommandBuffer::CommandBuffer(vk::Device device, vk::CommandBuffer buf, BG::Tracker& tracker)
   : m_device(device), m_buf(buf), m_tracker(tracker)
 {
 }
+
+BG::CommandBuffer::CommandBuffer(Renderer& r, vk::CommandBuffer buf)
+  : m_device(r.getDevice()), m_buf(buf), m_tracker(r.getTracker()), m_renderer(&r), m_profiler(&r.getGpuProfiler())
+{
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "berkeley_gfx.hpp"
+#include "gpu_profiler.hpp"
 
 #include <vulkan/vulkan.hpp>
 
@@ -14,8 +15,22 @@ namespace BG
     vk::Device m_device;
     Tracker& m_tracker;
 
+    Renderer* m_renderer = nullptr;
+    GpuProfiler* m_profiler = nullptr;
+    GpuProfiler::RecordState m_zoneState;
+
+    bool m_begun = false;
+    // The bound pipeline is still building asynchronously and has no fallback
+    bool m_skipDraws = false;
+    bool m_skipDispatches = false;
+
+    // From the renderer's FramebufferCache, or a per-frame one without a renderer
+    vk::Framebuffer GetFramebuffer(Pipeline& p, const std::vector<vk::ImageView>& renderTargets, glm::uvec2 extent);
+
   public:
     void Begin();
+    // Begin as a secondary command buffer continuing the given render pass
+    void BeginSecondary(vk::RenderPass renderPass, vk::Framebuffer frameBuffer = nullptr);
     void End();
 
     void BeginRenderPass(
@@ -23,8 +38,11 @@ namespace BG
       vk::Framebuffer& frameBuffer,
       glm::uvec2 extent,
       glm::vec4 clearColor = glm::vec4(1.0),
-      glm::ivec2 offset = glm::ivec2(0));
-    void BindPipeline(Pipeline& p);
+      glm::ivec2 offset = glm::ivec2(0),
+      vk::SubpassContents contents = vk::SubpassContents::eInline);
+    // Binds the fallback while `p` is building asynchronously, false (and later draws / dispatches are
+    // skipped) if there is nothing to bind yet
+    bool BindPipeline(Pipeline& p);
     void EndRenderPass();
     void Draw(uint32_t vertexCount, uint32_t firstVertex = 0, uint32_t instanceCount = 1, uint32_t firstInstance = 0);
     void DrawIndexed(uint32_t indexCount, uint32_t firstIndex = 0, uint32_t vertexOffset = 0, uint32_t instanceCount = 1, uint32_t firstInstance = 0);
@@ -37,6 +55,22 @@ namespace BG
     }
 
     void BindGraphicsDescSets(Pipeline& p, vk::DescriptorSet descSet, int set = 0);
+    // One offset per dynamic binding in the set, in binding order
+    void BindGraphicsDescSets(Pipeline& p, vk::DescriptorSet descSet, const std::vector<uint32_t>& dynamicOffsets, int set = 0);
+    void BindComputeDescSets(Pipeline& p, vk::DescriptorSet descSet, int set = 0);
+
+    void Dispatch(uint32_t groupCountX, uint32_t groupCountY = 1, uint32_t groupCountZ = 1);
+
+    // Memory barrier on a buffer range. With different queue families this is the release (recorded on
+    // the source queue) or acquire (recorded on the destination queue) half of an ownership transfer.
+    void BufferBarrier(
+      const BG::Buffer& buffer,
+      vk::PipelineStageFlags fromStage, vk::PipelineStageFlags toStage,
+      vk::AccessFlags fromAccess, vk::AccessFlags toAccess,
+      uint32_t fromQueueFamily = VK_QUEUE_FAMILY_IGNORED, uint32_t toQueueFamily = VK_QUEUE_FAMILY_IGNORED,
+      vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE) const;
+
+    void ExecuteCommands(const std::vector<vk::CommandBuffer>& secondaries);
 
     void ImageTransition(
       const BG::Image& image,
@@ -79,9 +113,32 @@ namespace BG
       glm::uvec2 extent,
       std::function<void()> func);
 
+    // Splits the render pass into `numJobs` secondary command buffers recorded on the renderer's
+    // worker pool, then executes them in job order. Pipeline & bindings are not inherited, each job
+    // has to bind them on the command buffer it is given.
+    void WithRenderPassParallel(
+      Pipeline& p,
+      vk::Framebuffer& frameBuffer,
+      glm::uvec2 extent,
+      uint32_t numJobs,
+      std::function<void(CommandBuffer&, uint32_t)> func);
+
+    void WithRenderPassParallel(
+      Pipeline& p,
+      std::vector<vk::ImageView> renderTargets,
+      glm::uvec2 extent,
+      uint32_t numJobs,
+      std::function<void(CommandBuffer&, uint32_t)> func);
+
+    // Times the commands recorded while the returned zone is alive, no-op without a profiler
+    GpuProfiler::Zone ProfileZone(std::string name, bool pipelineStatistics = false);
+
     CommandBuffer(vk::Device device, vk::CommandBuffer buf, BG::Tracker& tracker);
+    // Frame command buffer, with access to the renderer's profiler & worker threads
+    CommandBuffer(Renderer& r, vk::CommandBuffer buf);
 
     inline vk::CommandBuffer GetVkCmdBuf() const { return m_buf; }
+    inline bool HasBegun() const { return m_begun; }
   };
 
 }
\ No newline at end of file
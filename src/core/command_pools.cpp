@@ -0,0 +1,57 @@
+#include "command_pools.hpp"
+
+using namespace BG;
+
+vk::CommandBuffer BG::ThreadCommandPools::AllocSecondary()
+{
+  ThreadPools* threadPools;
+  int frameIndex;
+
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    auto& entry = m_threads[std::this_thread::get_id()];
+    if (!entry)
+    {
+      entry = std::make_unique<ThreadPools>();
+      entry->frames.resize(m_numFrames);
+      for (auto& frame : entry->frames)
+      {
+        frame.pool = m_device.createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eTransient, m_queueFamily });
+      }
+    }
+
+    threadPools = entry.get();
+    frameIndex = m_currentFrame;
+  }
+
+  // Only the owning thread touches its pools from here on
+  auto& frame = threadPools->frames[frameIndex];
+
+  if (frame.used == frame.buffers.size())
+  {
+    auto buffers = m_device.allocateCommandBuffersUnique({ frame.pool.get(), vk::CommandBufferLevel::eSecondary, 1 });
+    frame.buffers.push_back(std::move(buffers[0]));
+  }
+
+  return frame.buffers[frame.used++].get();
+}
+
+void BG::ThreadCommandPools::NewFrame(int frameIndex)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_currentFrame = frameIndex;
+
+  for (auto& pair : m_threads)
+  {
+    auto& frame = pair.second->frames[frameIndex];
+    m_device.resetCommandPool(frame.pool.get(), {});
+    frame.used = 0;
+  }
+}
+
+BG::ThreadCommandPools::ThreadCommandPools(vk::Device device, uint32_t queueFamily, int numFrames)
+  : m_device(device), m_queueFamily(queueFamily), m_numFrames(numFrames)
+{
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Secondary command buffers from one command pool per (thread, frame), so that
+  // recording threads never share a pool
+  class ThreadCommandPools
+  {
+  private:
+    struct FramePool
+    {
+      vk::UniqueCommandPool pool;
+      std::vector<vk::UniqueCommandBuffer> buffers;
+      size_t used = 0;
+    };
+
+    struct ThreadPools
+    {
+      std::vector<FramePool> frames;
+    };
+
+    vk::Device m_device;
+    uint32_t m_queueFamily;
+    int m_numFrames;
+    int m_currentFrame = 0;
+
+    std::unordered_map<std::thread::id, std::unique_ptr<ThreadPools>> m_threads;
+    std::mutex m_mutex;
+
+  public:
+    // Secondary command buffer owned by the calling thread, valid until this frame slot comes around again
+    vk::CommandBuffer AllocSecondary();
+
+    // Recycle every thread's buffers of `frameIndex`, the GPU must be done with that frame
+    void NewFrame(int frameIndex);
+
+    ThreadCommandPools(vk::Device device, uint32_t queueFamily, int numFrames);
+  };
+
+}
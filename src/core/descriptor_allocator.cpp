@@ -0,0 +1,163 @@
+#include "descriptor_allocator.hpp"
+#include "pipelines.hpp"
+
+#include <algorithm>
+
+using namespace BG;
+
+void BG::DescriptorAllocator::Counts::Add(const Counts& other)
+{
+  for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++) descriptors[i] += other.descriptors[i];
+  sets += other.sets;
+}
+
+void BG::DescriptorAllocator::Counts::Max(const Counts& other)
+{
+  for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++) descriptors[i] = std::max(descriptors[i], other.descriptors[i]);
+  sets = std::max(sets, other.sets);
+}
+
+bool BG::DescriptorAllocator::Counts::Covers(const Counts& other) const
+{
+  for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+  {
+    if (descriptors[i] < other.descriptors[i]) return false;
+  }
+  return sets >= other.sets;
+}
+
+DescriptorAllocator::Pool BG::DescriptorAllocator::CreatePool(const Counts& request)
+{
+  // Room for the largest frame so far, or twice this frame's usage when it's growing. The minimum is
+  // enough for small scenes to never chain.
+  Counts size;
+  size.sets = 64;
+  size.descriptors[uint32_t(vk::DescriptorType::eCombinedImageSampler)] = 64;
+  size.descriptors[uint32_t(vk::DescriptorType::eUniformBuffer)] = 64;
+  size.descriptors[uint32_t(vk::DescriptorType::eStorageBuffer)] = 16;
+  size.descriptors[uint32_t(vk::DescriptorType::eStorageImage)] = 16;
+
+  Counts growing = m_frameUsage;
+  growing.Add(m_frameUsage);
+
+  size.Max(m_peakUsage);
+  size.Max(growing);
+  size.Max(request);
+
+  std::vector<vk::DescriptorPoolSize> poolSizes;
+  for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+  {
+    if (size.descriptors[i] > 0) poolSizes.push_back({ vk::DescriptorType(i), size.descriptors[i] });
+  }
+
+  vk::DescriptorPoolCreateInfo info;
+  info.setPoolSizes(poolSizes);
+  info.maxSets = size.sets;
+
+  m_poolsCreated++;
+
+  return Pool{ m_device.createDescriptorPoolUnique(info), size };
+}
+
+DescriptorAllocator::Pool& BG::DescriptorAllocator::NextPool(const Counts& request)
+{
+  auto& pools = m_framePools[m_currentFrame];
+
+  auto it = std::find_if(m_freePools.begin(), m_freePools.end(), [&](const Pool& p) { return p.capacity.Covers(request); });
+  if (it != m_freePools.end())
+  {
+    pools.push_back(std::move(*it));
+    m_freePools.erase(it);
+  }
+  else
+  {
+    pools.push_back(CreatePool(request));
+  }
+
+  return pools.back();
+}
+
+vk::DescriptorSet BG::DescriptorAllocator::Allocate(Pipeline& pipeline, uint32_t variableDescriptorCount)
+{
+  auto& bindings = pipeline.GetDescSetLayoutBindings();
+  auto& flags = pipeline.GetDescSetLayoutBindingFlags();
+
+  Counts request;
+  request.sets = 1;
+  for (size_t i = 0; i < bindings.size(); i++)
+  {
+    uint32_t type = uint32_t(bindings[i].descriptorType);
+    if (type >= NUM_DESCRIPTOR_TYPES) continue;
+
+    bool variable = bool(flags[i] & vk::DescriptorBindingFlagBits::eVariableDescriptorCount);
+    request.descriptors[type] += variable ? variableDescriptorCount : bindings[i].descriptorCount;
+  }
+
+  VkDescriptorSetLayout layout = pipeline.GetDescSetLayout();
+
+  VkDescriptorSetVariableDescriptorCountAllocateInfo variableCount = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO };
+  variableCount.descriptorSetCount = 1;
+  variableCount.pDescriptorCounts = &variableDescriptorCount;
+
+  VkDescriptorSetAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &layout;
+  if (variableDescriptorCount != 0) allocInfo.pNext = &variableCount;
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_frameUsage.Add(request);
+
+  VkDescriptorSet set;
+  VkResult result = VK_ERROR_OUT_OF_POOL_MEMORY;
+
+  auto& pools = m_framePools[m_currentFrame];
+  if (!pools.empty())
+  {
+    allocInfo.descriptorPool = pools.back().pool.get();
+    result = vkAllocateDescriptorSets(m_device, &allocInfo, &set);
+  }
+
+  // Chain a new pool
+  if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+  {
+    allocInfo.descriptorPool = NextPool(request).pool.get();
+    result = vkAllocateDescriptorSets(m_device, &allocInfo, &set);
+  }
+
+  if (result != VK_SUCCESS)
+  {
+    spdlog::error("Failed to allocate descriptor set: {}", vk::to_string(vk::Result(result)));
+    throw std::runtime_error("Failed to allocate descriptor set");
+  }
+
+  return set;
+}
+
+void BG::DescriptorAllocator::NewFrame(uint32_t frameIndex)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_peakUsage.Max(m_frameUsage);
+  m_frameUsage = Counts();
+
+  m_currentFrame = frameIndex % m_framePools.size();
+
+  // Pools too small for a whole frame are dropped, replaced by one pool sized from the peak
+  for (auto& p : m_framePools[m_currentFrame])
+  {
+    m_device.resetDescriptorPool(p.pool.get());
+    if (p.capacity.Covers(m_peakUsage)) m_freePools.push_back(std::move(p));
+  }
+  m_framePools[m_currentFrame].clear();
+
+  m_freePools.erase(
+    std::remove_if(m_freePools.begin(), m_freePools.end(), [&](const Pool& p) { return !p.capacity.Covers(m_peakUsage); }),
+    m_freePools.end());
+}
+
+BG::DescriptorAllocator::DescriptorAllocator(vk::Device device, uint32_t framesInFlight)
+  : m_device(device)
+{
+  m_framePools.resize(framesInFlight);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <array>
+#include <mutex>
+
+namespace BG
+{
+
+  // Per-frame descriptor sets. Each frame slot allocates from a chain of pools, a new pool is chained when the
+  // current one runs out. Pools are sized from the largest per-frame usage seen so far, so the chain converges
+  // to one pool per frame. A slot's pools are reset when the slot is reused, and recycled by any slot.
+  class DescriptorAllocator
+  {
+  public:
+    // Core descriptor types, eSampler .. eInputAttachment
+    static const uint32_t NUM_DESCRIPTOR_TYPES = 11;
+
+    struct Counts
+    {
+      std::array<uint32_t, NUM_DESCRIPTOR_TYPES> descriptors{};
+      uint32_t sets = 0;
+
+      void Add(const Counts& other);
+      void Max(const Counts& other);
+      bool Covers(const Counts& other) const;
+    };
+
+  private:
+    struct Pool
+    {
+      vk::UniqueDescriptorPool pool;
+      Counts capacity;
+    };
+
+    vk::Device m_device;
+
+    std::vector<std::vector<Pool>> m_framePools; // Per frame slot, the last one is being allocated from
+    std::vector<Pool> m_freePools;
+
+    uint32_t m_currentFrame = 0;
+
+    Counts m_frameUsage; // Since the last NewFrame
+    Counts m_peakUsage;  // Largest frame so far
+
+    uint32_t m_poolsCreated = 0;
+
+    std::mutex m_mutex;
+
+    Pool CreatePool(const Counts& request);
+    Pool& NextPool(const Counts& request);
+
+  public:
+    // Thread safe. Throws if the set doesn't fit an empty pool sized for it.
+    vk::DescriptorSet Allocate(Pipeline& pipeline, uint32_t variableDescriptorCount = 0);
+
+    // Resets the pools used the last time `frameIndex` was recorded. Call once the frame slot is free.
+    void NewFrame(uint32_t frameIndex);
+
+    inline uint32_t GetNumPoolsCreated() const { return m_poolsCreated; }
+    inline const Counts& GetPeakUsage() const { return m_peakUsage; }
+
+    DescriptorAllocator(vk::Device device, uint32_t framesInFlight);
+  };
+
+}
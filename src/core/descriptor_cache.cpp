@@ -0,0 +1,320 @@
+#include "descriptor_cache.hpp"
+#include "pipelines.hpp"
+#include "buffer.hpp"
+#include "pipeline_object_cache.hpp"
+
+#include <algorithm>
+#include <cstddef>
+
+using namespace BG;
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::AddBuffer(vk::DescriptorType type, int binding, int arrayElement, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range)
+{
+  Write w;
+  w.binding = uint32_t(binding);
+  w.arrayElement = uint32_t(arrayElement);
+  w.type = type;
+  w.resource = buffer.uid;
+  w.info.buffer = { VkBuffer(buffer.buffer), offset, range };
+  m_writes.push_back(w);
+  return *this;
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::AddImage(vk::DescriptorType type, int binding, int arrayElement, vk::ImageView view, vk::ImageLayout layout, vk::Sampler sampler)
+{
+  Write w;
+  w.binding = uint32_t(binding);
+  w.arrayElement = uint32_t(arrayElement);
+  w.type = type;
+  w.resource = (uint64_t)VkImageView(view);
+  w.info.image = { VkSampler(sampler), VkImageView(view), VkImageLayout(layout) };
+  m_writes.push_back(w);
+  return *this;
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::UniformBuffer(int binding, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int arrayElement)
+{
+  return AddBuffer(vk::DescriptorType::eUniformBuffer, binding, arrayElement, buffer, offset, range);
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::UniformBufferDynamic(int binding, const Buffer& buffer, vk::DeviceSize range, int arrayElement)
+{
+  return AddBuffer(vk::DescriptorType::eUniformBufferDynamic, binding, arrayElement, buffer, 0, range);
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::StorageBuffer(int binding, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int arrayElement)
+{
+  return AddBuffer(vk::DescriptorType::eStorageBuffer, binding, arrayElement, buffer, offset, range);
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::ImageView(int binding, vk::ImageView view, vk::ImageLayout layout, vk::Sampler sampler, int arrayElement)
+{
+  return AddImage(vk::DescriptorType::eCombinedImageSampler, binding, arrayElement, view, layout, sampler);
+}
+
+DescriptorCache::Bindings& BG::DescriptorCache::Bindings::StorageImage(int binding, vk::ImageView view, int arrayElement)
+{
+  return AddImage(vk::DescriptorType::eStorageImage, binding, arrayElement, view, vk::ImageLayout::eGeneral, {});
+}
+
+void BG::DescriptorCache::CreatePool()
+{
+  std::vector<vk::DescriptorPoolSize> poolSizes = {
+      { vk::DescriptorType::eCombinedImageSampler, 1024 },
+      { vk::DescriptorType::eStorageImage, 256 },
+      { vk::DescriptorType::eUniformBuffer, 512 },
+      { vk::DescriptorType::eUniformBufferDynamic, 128 },
+      { vk::DescriptorType::eStorageBuffer, 256 }
+  };
+
+  vk::DescriptorPoolCreateInfo info;
+  info.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+  info.setPoolSizes(poolSizes);
+  info.maxSets = 256;
+
+  m_pools.push_back(m_device.createDescriptorPoolUnique(info));
+}
+
+vk::DescriptorSet BG::DescriptorCache::Allocate(vk::DescriptorSetLayout layout, uint32_t& pool)
+{
+  vk::DescriptorSetAllocateInfo allocInfo;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &layout;
+
+  // Newest pool first, older ones only have room where sets were freed
+  for (int i = int(m_pools.size()) - 1; i >= 0; i--)
+  {
+    allocInfo.descriptorPool = m_pools[i].get();
+
+    VkDescriptorSet set;
+    VkDescriptorSetAllocateInfo vkAllocInfo = allocInfo;
+    if (vkAllocateDescriptorSets(m_device, &vkAllocInfo, &set) == VK_SUCCESS)
+    {
+      pool = uint32_t(i);
+      return set;
+    }
+  }
+
+  CreatePool();
+
+  pool = uint32_t(m_pools.size() - 1);
+  allocInfo.descriptorPool = m_pools.back().get();
+
+  return m_device.allocateDescriptorSets(allocInfo)[0];
+}
+
+vk::DescriptorUpdateTemplate BG::DescriptorCache::GetTemplate(Pipeline& pipeline, const std::vector<Bindings::Write>& writes)
+{
+  VkDescriptorSetLayout layout = pipeline.GetDescSetLayout();
+
+  PipelineObjectCache::Key key;
+  key.Add(layout);
+  for (auto& w : writes) key.Add(w.binding).Add(w.arrayElement).Add(w.type);
+
+  auto it = m_templates.find(key.Bytes());
+  if (it != m_templates.end()) return it->second.updateTemplate.get();
+
+  // Validate the writes against the reflected layout, and merge consecutive array elements into one entry
+  auto& layoutBindings = pipeline.GetDescSetLayoutBindings();
+  auto& layoutBindingFlags = pipeline.GetDescSetLayoutBindingFlags();
+
+  std::vector<vk::DescriptorUpdateTemplateEntry> entries;
+
+  for (size_t i = 0; i < writes.size(); i++)
+  {
+    auto& w = writes[i];
+
+    auto layoutBinding = std::find_if(layoutBindings.begin(), layoutBindings.end(), [&](auto& b) { return b.binding == w.binding; });
+    if (layoutBinding == layoutBindings.end())
+    {
+      spdlog::error("Descriptor cache: binding {} is not in the pipeline's layout", w.binding);
+      throw std::runtime_error("Invalid descriptor binding");
+    }
+
+    if (layoutBinding->descriptorType != w.type || w.arrayElement >= layoutBinding->descriptorCount)
+    {
+      spdlog::error("Descriptor cache: binding {}[{}] does not match the pipeline's layout", w.binding, w.arrayElement);
+      throw std::runtime_error("Invalid descriptor binding");
+    }
+
+    if (layoutBindingFlags[layoutBinding - layoutBindings.begin()] & vk::DescriptorBindingFlagBits::eVariableDescriptorCount)
+    {
+      spdlog::error("Descriptor cache: binding {} has a variable count, allocate its set with Pipeline::AllocDescSet", w.binding);
+      throw std::runtime_error("Invalid descriptor binding");
+    }
+
+    if (i > 0 && writes[i - 1].binding == w.binding && writes[i - 1].arrayElement == w.arrayElement)
+    {
+      spdlog::error("Descriptor cache: binding {}[{}] is bound twice", w.binding, w.arrayElement);
+      throw std::runtime_error("Invalid descriptor binding");
+    }
+
+    if (!entries.empty() && writes[i - 1].binding == w.binding && writes[i - 1].arrayElement + 1 == w.arrayElement)
+    {
+      entries.back().descriptorCount++;
+      continue;
+    }
+
+    vk::DescriptorUpdateTemplateEntry entry;
+    entry.dstBinding = w.binding;
+    entry.dstArrayElement = w.arrayElement;
+    entry.descriptorCount = 1;
+    entry.descriptorType = w.type;
+    entry.offset = i * sizeof(Bindings::Write) + offsetof(Bindings::Write, info);
+    entry.stride = sizeof(Bindings::Write);
+    entries.push_back(entry);
+  }
+
+  vk::DescriptorUpdateTemplateCreateInfo info;
+  info.setDescriptorUpdateEntries(entries);
+  info.templateType = vk::DescriptorUpdateTemplateType::eDescriptorSet;
+  info.descriptorSetLayout = layout;
+
+  auto& t = m_templates[key.Bytes()];
+  t.updateTemplate = m_device.createDescriptorUpdateTemplateUnique(info);
+  t.layout = layout;
+
+  return t.updateTemplate.get();
+}
+
+vk::DescriptorSet BG::DescriptorCache::Get(Pipeline& pipeline, const Bindings& bindings)
+{
+  // Canonical order, so the same resources bound in a different order share a set
+  auto writes = bindings.m_writes;
+  std::sort(writes.begin(), writes.end(), [](auto& a, auto& b) {
+    return a.binding < b.binding || (a.binding == b.binding && a.arrayElement < b.arrayElement);
+    });
+
+  VkDescriptorSetLayout layout = pipeline.GetDescSetLayout();
+
+  PipelineObjectCache::Key key;
+  key.Add(layout);
+  for (auto& w : writes)
+  {
+    key.Add(w.binding).Add(w.arrayElement).Add(w.type).Add(w.resource);
+    if (w.type == vk::DescriptorType::eUniformBuffer || w.type == vk::DescriptorType::eUniformBufferDynamic || w.type == vk::DescriptorType::eStorageBuffer)
+      key.Add(w.info.buffer.offset).Add(w.info.buffer.range);
+    else
+      key.Add(w.info.image.sampler).Add(w.info.image.imageLayout);
+  }
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  auto it = m_sets.find(key.Bytes());
+  if (it != m_sets.end())
+  {
+    m_stats.hits++;
+    it->second.lastUsed = m_frame;
+    return it->second.set;
+  }
+
+  m_stats.misses++;
+
+  auto updateTemplate = GetTemplate(pipeline, writes);
+
+  Entry entry;
+  entry.set = Allocate(layout, entry.pool);
+  entry.layout = layout;
+  entry.lastUsed = m_frame;
+
+  for (auto& w : writes)
+  {
+    if (w.type == vk::DescriptorType::eCombinedImageSampler || w.type == vk::DescriptorType::eStorageImage)
+      entry.views.push_back(w.info.image.imageView);
+  }
+
+  m_device.updateDescriptorSetWithTemplate(entry.set, updateTemplate, writes.data());
+
+  m_sets[key.Bytes()] = entry;
+
+  return entry.set;
+}
+
+void BG::DescriptorCache::Free(const Entry& entry, bool deferred)
+{
+  if (deferred)
+    m_pendingFree.push_back({ entry.set, entry.pool, m_frame });
+  else
+    m_device.freeDescriptorSets(m_pools[entry.pool].get(), entry.set);
+}
+
+void BG::DescriptorCache::InvalidateImageView(vk::ImageView view)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  VkImageView vkView = view;
+
+  for (auto it = m_sets.begin(); it != m_sets.end();)
+  {
+    if (std::find(it->second.views.begin(), it->second.views.end(), vkView) != it->second.views.end())
+    {
+      Free(it->second, true);
+      it = m_sets.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+void BG::DescriptorCache::InvalidateSetLayout(vk::DescriptorSetLayout layout)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  VkDescriptorSetLayout vkLayout = layout;
+
+  for (auto it = m_sets.begin(); it != m_sets.end();)
+  {
+    if (it->second.layout == vkLayout)
+    {
+      Free(it->second, true);
+      it = m_sets.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  // Templates are only used on the host, they can go right away
+  for (auto it = m_templates.begin(); it != m_templates.end();)
+  {
+    if (it->second.layout == vkLayout) it = m_templates.erase(it);
+    else it++;
+  }
+}
+
+void BG::DescriptorCache::NewFrame()
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_frame++;
+
+  // Frame `frame` has completed once `m_framesInFlight` more frames have begun
+  auto done = std::remove_if(m_pendingFree.begin(), m_pendingFree.end(), [&](const PendingFree& p) {
+    if (p.frame + m_framesInFlight > m_frame) return false;
+    m_device.freeDescriptorSets(m_pools[p.pool].get(), p.set);
+    return true;
+    });
+  m_pendingFree.erase(done, m_pendingFree.end());
+
+  for (auto it = m_sets.begin(); it != m_sets.end();)
+  {
+    if (it->second.lastUsed + m_maxUnusedFrames < m_frame)
+    {
+      Free(it->second, false);
+      it = m_sets.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+BG::DescriptorCache::DescriptorCache(vk::Device device, uint32_t framesInFlight, uint64_t maxUnusedFrames)
+  : m_device(device), m_framesInFlight(framesInFlight), m_maxUnusedFrames(std::max<uint64_t>(maxUnusedFrames, framesInFlight))
+{
+  CreatePool();
+}
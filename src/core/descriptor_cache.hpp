@@ -0,0 +1,129 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Descriptor sets by (set layout, bound resources), so a draw binding the same resources as an earlier
+  // frame reuses its set instead of allocating and writing a new one. Sets are written once, through an
+  // update template built from the pipeline's reflected layout, and are never updated afterwards.
+  class DescriptorCache
+  {
+  public:
+    // Resources bound to one descriptor set, in any order. Bindings not mentioned are left unwritten.
+    class Bindings
+    {
+    private:
+      friend class DescriptorCache;
+
+      struct Write
+      {
+        uint32_t binding;
+        uint32_t arrayElement;
+        vk::DescriptorType type;
+        uint64_t resource; // Buffer uid or image view, identifies the resource in the key
+        union
+        {
+          VkDescriptorBufferInfo buffer;
+          VkDescriptorImageInfo image;
+        } info;
+      };
+
+      std::vector<Write> m_writes;
+
+      Bindings& AddBuffer(vk::DescriptorType type, int binding, int arrayElement, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range);
+      Bindings& AddImage(vk::DescriptorType type, int binding, int arrayElement, vk::ImageView view, vk::ImageLayout layout, vk::Sampler sampler);
+
+    public:
+      Bindings& UniformBuffer(int binding, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int arrayElement = 0);
+      // The offset is given when binding, so one set serves every slice of e.g. the UniformRing
+      Bindings& UniformBufferDynamic(int binding, const Buffer& buffer, vk::DeviceSize range, int arrayElement = 0);
+      Bindings& StorageBuffer(int binding, const Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int arrayElement = 0);
+      Bindings& ImageView(int binding, vk::ImageView view, vk::ImageLayout layout, vk::Sampler sampler, int arrayElement = 0);
+      Bindings& StorageImage(int binding, vk::ImageView view, int arrayElement = 0);
+    };
+
+    struct Stats
+    {
+      uint32_t hits = 0;
+      uint32_t misses = 0;
+    };
+
+  private:
+    struct Entry
+    {
+      vk::DescriptorSet set;
+      VkDescriptorSetLayout layout;
+      uint32_t pool;
+      uint64_t lastUsed;
+      std::vector<VkImageView> views;
+    };
+
+    struct Template
+    {
+      vk::UniqueDescriptorUpdateTemplate updateTemplate;
+      VkDescriptorSetLayout layout;
+    };
+
+    vk::Device m_device;
+
+    // Pools are never reset, sets are freed one by one
+    std::vector<vk::UniqueDescriptorPool> m_pools;
+
+    // Keyed by layout + resources, and by layout + the (binding, element, type) shape of the writes
+    std::unordered_map<std::string, Entry> m_sets;
+    std::unordered_map<std::string, Template> m_templates;
+
+    // Invalidated sets may still be used by frames in flight, freed once those are done
+    struct PendingFree
+    {
+      vk::DescriptorSet set;
+      uint32_t pool;
+      uint64_t frame;
+    };
+    std::vector<PendingFree> m_pendingFree;
+
+    std::mutex m_mutex;
+
+    uint64_t m_frame = 0;
+    uint64_t m_framesInFlight;
+    uint64_t m_maxUnusedFrames;
+
+    Stats m_stats;
+
+    void CreatePool();
+    vk::DescriptorSet Allocate(vk::DescriptorSetLayout layout, uint32_t& pool);
+    vk::DescriptorUpdateTemplate GetTemplate(Pipeline& pipeline, const std::vector<Bindings::Write>& writes);
+    void Free(const Entry& entry, bool deferred);
+
+  public:
+    // One hash lookup on a hit. Sets with variable count bindings are not supported, use Pipeline::AllocDescSet.
+    vk::DescriptorSet Get(Pipeline& pipeline, const Bindings& bindings);
+
+    // Must be called before destroying an image view that may have been bound
+    void InvalidateImageView(vk::ImageView view);
+    // Called by the Pipeline releasing the last reference to a set layout
+    void InvalidateSetLayout(vk::DescriptorSetLayout layout);
+
+    // Frees sets unused for more than `maxUnusedFrames` frames. Call once per frame, after the frame slot's
+    // previous use has completed.
+    void NewFrame();
+
+    inline size_t GetSize() const { return m_sets.size(); }
+    inline Stats GetStats()
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      return m_stats;
+    }
+
+    // `maxUnusedFrames` is raised to `framesInFlight` if lower
+    DescriptorCache(vk::Device device, uint32_t framesInFlight, uint64_t maxUnusedFrames = 64);
+  };
+
+}
@@ -0,0 +1,32 @@
+#include "fence_pool.hpp"
+
+using namespace BG;
+
+vk::UniqueFence BG::FencePool::Acquire()
+{
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    if (!m_free.empty())
+    {
+      vk::UniqueFence fence = std::move(m_free.back());
+      m_free.pop_back();
+      return fence;
+    }
+  }
+
+  return m_device.createFenceUnique({});
+}
+
+void BG::FencePool::Release(vk::UniqueFence fence)
+{
+  m_device.resetFences(fence.get());
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_free.push_back(std::move(fence));
+}
+
+BG::FencePool::FencePool(vk::Device device)
+  : m_device(device)
+{
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+
+namespace BG
+{
+
+  // Fences for one-off submits, recycled instead of created and destroyed for every submit
+  class FencePool
+  {
+  private:
+    vk::Device m_device;
+
+    std::vector<vk::UniqueFence> m_free;
+    std::mutex m_mutex;
+
+  public:
+    // Thread safe, unsignaled
+    vk::UniqueFence Acquire();
+    // The fence must be signaled or never submitted
+    void Release(vk::UniqueFence fence);
+
+    FencePool(vk::Device device);
+  };
+
+}
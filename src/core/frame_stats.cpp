@@ -0,0 +1,215 @@
+#include "frame_stats.hpp"
+
+#include "imgui.h"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace BG;
+
+static double ToMilliseconds(std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+BG::FrameStats::Timer::Timer(FrameStats& stats)
+  : m_stats(stats)
+{
+  m_times.fill(0.0);
+  m_frameStart = m_lapStart = std::chrono::steady_clock::now();
+}
+
+void BG::FrameStats::Timer::Lap(Phase phase)
+{
+  auto now = std::chrono::steady_clock::now();
+  m_times[phase] += ToMilliseconds(now - m_lapStart);
+  m_lapStart = now;
+}
+
+void BG::FrameStats::Timer::Commit()
+{
+  auto now = std::chrono::steady_clock::now();
+  m_times[Frame] = ToMilliseconds(now - m_frameStart);
+
+  m_stats.Push(m_times);
+
+  m_times.fill(0.0);
+  m_frameStart = m_lapStart = now;
+}
+
+const char* BG::FrameStats::GetPhaseName(Phase phase)
+{
+  switch (phase)
+  {
+  case Acquire: return "Acquire";
+  case FrameWait: return "Frame wait";
+  case PollEvents: return "Poll events";
+  case GuiWait: return "GUI handoff";
+  case Render: return "Render";
+  case Submit: return "Submit";
+  case Present: return "Present";
+  case Frame: return "Frame";
+  default: return "Unknown";
+  }
+}
+
+void BG::FrameStats::Push(const FrameTimes& times)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_samples[m_head] = times;
+  m_head = (m_head + 1) % m_windowSize;
+  m_count = std::min(m_count + 1, m_windowSize);
+}
+
+BG::FrameStats::PhaseStats BG::FrameStats::Compute(Phase phase) const
+{
+  PhaseStats stats;
+
+  if (m_count == 0) return stats;
+
+  std::vector<double> values;
+  values.reserve(m_count);
+
+  double sum = 0.0;
+  for (size_t i = 0; i < m_count; i++)
+  {
+    double v = m_samples[i][phase];
+    values.push_back(v);
+    sum += v;
+  }
+
+  stats.last = m_samples[(m_head + m_windowSize - 1) % m_windowSize][phase];
+  stats.mean = sum / double(m_count);
+
+  auto percentile = [&](double p) {
+    size_t k = std::min(size_t(p * double(values.size() - 1) + 0.5), values.size() - 1);
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+  };
+
+  stats.p50 = percentile(0.50);
+  stats.p95 = percentile(0.95);
+  stats.p99 = percentile(0.99);
+  stats.min = *std::min_element(values.begin(), values.end());
+
+  return stats;
+}
+
+BG::FrameStats::PhaseStats BG::FrameStats::Get(Phase phase) const
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return Compute(phase);
+}
+
+std::array<BG::FrameStats::PhaseStats, BG::FrameStats::NumPhases> BG::FrameStats::GetAll() const
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  std::array<PhaseStats, NumPhases> all;
+  for (int i = 0; i < NumPhases; i++) all[i] = Compute(Phase(i));
+
+  return all;
+}
+
+size_t BG::FrameStats::GetNumSamples() const
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return m_count;
+}
+
+bool BG::FrameStats::ExportCSV(std::string path) const
+{
+  auto all = GetAll();
+
+  std::ofstream f(path);
+  if (!f)
+  {
+    spdlog::error("Failed to open {} for writing", path);
+    return false;
+  }
+
+  f << "phase,last_ms,min_ms,mean_ms,p50_ms,p95_ms,p99_ms\n";
+  for (int i = 0; i < NumPhases; i++)
+  {
+    auto& s = all[i];
+    f << GetPhaseName(Phase(i)) << "," << s.last << "," << s.min << "," << s.mean << "," << s.p50 << "," << s.p95 << "," << s.p99 << "\n";
+  }
+
+  return bool(f);
+}
+
+bool BG::FrameStats::ExportSamplesCSV(std::string path) const
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  std::ofstream f(path);
+  if (!f)
+  {
+    spdlog::error("Failed to open {} for writing", path);
+    return false;
+  }
+
+  for (int i = 0; i < NumPhases; i++) f << (i == 0 ? "" : ",") << GetPhaseName(Phase(i));
+  f << "\n";
+
+  // Oldest frame first
+  size_t start = (m_head + m_windowSize - m_count) % m_windowSize;
+  for (size_t n = 0; n < m_count; n++)
+  {
+    auto& times = m_samples[(start + n) % m_windowSize];
+    for (int i = 0; i < NumPhases; i++) f << (i == 0 ? "" : ",") << times[i];
+    f << "\n";
+  }
+
+  return bool(f);
+}
+
+void BG::FrameStats::RenderGUI()
+{
+  auto all = GetAll();
+
+  double meanFrame = all[Frame].mean;
+  ImGui::Text("Frame %.3fms (%.1f FPS) over %d frames", meanFrame, meanFrame > 0.0 ? 1000.0 / meanFrame : 0.0, int(GetNumSamples()));
+
+  if (ImGui::BeginTable("FrameStatsTable", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+  {
+    ImGui::TableSetupColumn("Phase");
+    ImGui::TableSetupColumn("Last");
+    ImGui::TableSetupColumn("Min");
+    ImGui::TableSetupColumn("Mean");
+    ImGui::TableSetupColumn("P50");
+    ImGui::TableSetupColumn("P95");
+    ImGui::TableSetupColumn("P99");
+    ImGui::TableHeadersRow();
+
+    for (int i = 0; i < NumPhases; i++)
+    {
+      auto& s = all[i];
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn(); ImGui::TextUnformatted(GetPhaseName(Phase(i)));
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.last);
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.min);
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.mean);
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.p50);
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.p95);
+      ImGui::TableNextColumn(); ImGui::Text("%.3f", s.p99);
+    }
+
+    ImGui::EndTable();
+  }
+
+  if (ImGui::Button("Export CSV"))
+  {
+    if (ExportCSV("frame_stats.csv") && ExportSamplesCSV("frame_stats_samples.csv"))
+    {
+      spdlog::info("Frame stats written to frame_stats.csv & frame_stats_samples.csv");
+    }
+  }
+}
+
+BG::FrameStats::FrameStats(size_t windowSize)
+  : m_windowSize(std::max(windowSize, size_t(1)))
+{
+  m_samples.resize(m_windowSize);
+}
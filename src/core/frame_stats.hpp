@@ -0,0 +1,87 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <array>
+#include <chrono>
+#include <mutex>
+
+namespace BG
+{
+
+  class FrameStats
+  {
+  public:
+    enum Phase
+    {
+      Acquire,
+      FrameWait,
+      PollEvents,
+      GuiWait,
+      Render,
+      Submit,
+      Present,
+      Frame,
+      NumPhases
+    };
+
+    // All values in milliseconds, over the rolling window
+    struct PhaseStats
+    {
+      double last = 0.0;
+      double min = 0.0;
+      double mean = 0.0;
+      double p50 = 0.0;
+      double p95 = 0.0;
+      double p99 = 0.0;
+    };
+
+    using FrameTimes = std::array<double, NumPhases>;
+
+    // Accumulates the time spent in each phase of one frame on the calling thread
+    class Timer
+    {
+    private:
+      FrameStats& m_stats;
+      FrameTimes m_times;
+      std::chrono::steady_clock::time_point m_frameStart, m_lapStart;
+
+    public:
+      // Attribute the time since the last lap (or frame start) to `phase`
+      void Lap(Phase phase);
+      // Push the frame into the stats, and start timing the next one
+      void Commit();
+
+      Timer(FrameStats& stats);
+    };
+
+    static const char* GetPhaseName(Phase phase);
+
+    void Push(const FrameTimes& times);
+
+    PhaseStats Get(Phase phase) const;
+    std::array<PhaseStats, NumPhases> GetAll() const;
+    size_t GetNumSamples() const;
+
+    // One row per phase with the summary statistics
+    bool ExportCSV(std::string path) const;
+    // One row per frame in the window, one column per phase
+    bool ExportSamplesCSV(std::string path) const;
+
+    void RenderGUI();
+
+    FrameStats(size_t windowSize = 512);
+
+  private:
+    size_t m_windowSize;
+    size_t m_head = 0;
+    size_t m_count = 0;
+
+    std::vector<FrameTimes> m_samples;
+
+    mutable std::mutex m_mutex;
+
+    PhaseStats Compute(Phase phase) const;
+  };
+
+}
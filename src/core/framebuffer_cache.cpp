@@ -0,0 +1,131 @@
+#include "framebuffer_cache.hpp"
+#include "lifetime_tracker.hpp"
+
+#include <algorithm>
+
+using namespace BG;
+
+bool BG::FramebufferCache::Key::operator==(const Key& other) const
+{
+  return renderPass == other.renderPass && views == other.views &&
+    width == other.width && height == other.height && layers == other.layers;
+}
+
+size_t BG::FramebufferCache::KeyHash::operator()(const Key& key) const
+{
+  size_t hash = std::hash<VkRenderPass>()(key.renderPass);
+
+  auto combine = [&](size_t value) { hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2); };
+
+  for (auto view : key.views) combine(std::hash<VkImageView>()(view));
+  combine(key.width);
+  combine(key.height);
+  combine(key.layers);
+
+  return hash;
+}
+
+vk::Framebuffer BG::FramebufferCache::Get(vk::RenderPass renderPass, const std::vector<vk::ImageView>& views, glm::uvec2 extent, uint32_t layers)
+{
+  Key key;
+  key.renderPass = renderPass;
+  for (auto view : views) key.views.push_back(view);
+  key.width = extent.x;
+  key.height = extent.y;
+  key.layers = layers;
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  auto it = m_entries.find(key);
+  if (it != m_entries.end())
+  {
+    it->second.lastUsed = m_frame;
+    return it->second.framebuffer.get();
+  }
+
+  vk::FramebufferCreateInfo framebufferInfo;
+  framebufferInfo.setRenderPass(renderPass);
+  framebufferInfo.setAttachments(views);
+  framebufferInfo.setWidth(extent.x);
+  framebufferInfo.setHeight(extent.y);
+  framebufferInfo.setLayers(layers);
+
+  auto& entry = m_entries[key];
+  entry.framebuffer = m_device.createFramebufferUnique(framebufferInfo);
+  entry.lastUsed = m_frame;
+
+  m_created++;
+
+  return entry.framebuffer.get();
+}
+
+void BG::FramebufferCache::InvalidateImageView(vk::ImageView view)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  VkImageView vkView = view;
+
+  for (auto it = m_entries.begin(); it != m_entries.end();)
+  {
+    if (std::find(it->first.views.begin(), it->first.views.end(), vkView) != it->first.views.end())
+    {
+      m_tracker.DisposeFramebuffer(std::move(it->second.framebuffer));
+      it = m_entries.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+void BG::FramebufferCache::InvalidateRenderPass(vk::RenderPass renderPass)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  VkRenderPass vkRenderPass = renderPass;
+
+  for (auto it = m_entries.begin(); it != m_entries.end();)
+  {
+    if (it->first.renderPass == vkRenderPass)
+    {
+      m_tracker.DisposeFramebuffer(std::move(it->second.framebuffer));
+      it = m_entries.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+void BG::FramebufferCache::NewFrame()
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  m_frame++;
+
+  for (auto it = m_entries.begin(); it != m_entries.end();)
+  {
+    if (it->second.lastUsed + m_maxUnusedFrames < m_frame)
+    {
+      m_tracker.DisposeFramebuffer(std::move(it->second.framebuffer));
+      it = m_entries.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+void BG::FramebufferCache::Clear()
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_entries.clear();
+}
+
+BG::FramebufferCache::FramebufferCache(vk::Device device, Tracker& tracker, uint64_t maxUnusedFrames)
+  : m_device(device), m_tracker(tracker), m_maxUnusedFrames(maxUnusedFrames)
+{
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Framebuffers by (render pass, attachments, extent, layers), so render passes over the same targets
+  // don't create one every frame. Evicted framebuffers are handed to the Tracker, which releases them
+  // once the frames using them are done.
+  class FramebufferCache
+  {
+  private:
+    struct Key
+    {
+      VkRenderPass renderPass;
+      std::vector<VkImageView> views;
+      uint32_t width, height, layers;
+
+      bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash
+    {
+      size_t operator()(const Key& key) const;
+    };
+
+    struct Entry
+    {
+      vk::UniqueFramebuffer framebuffer;
+      uint64_t lastUsed;
+    };
+
+    vk::Device m_device;
+    Tracker& m_tracker;
+
+    std::unordered_map<Key, Entry, KeyHash> m_entries;
+    std::mutex m_mutex;
+
+    uint64_t m_frame = 0;
+    uint64_t m_maxUnusedFrames;
+
+    uint32_t m_created = 0;
+
+  public:
+    vk::Framebuffer Get(vk::RenderPass renderPass, const std::vector<vk::ImageView>& views, glm::uvec2 extent, uint32_t layers = 1);
+
+    // Must be called before destroying an image view that may have been rendered to
+    void InvalidateImageView(vk::ImageView view);
+    void InvalidateRenderPass(vk::RenderPass renderPass);
+
+    // Evicts framebuffers unused for more than `maxUnusedFrames` frames. Call after Tracker::NewFrame.
+    void NewFrame();
+
+    // Framebuffers created so far, stays flat in steady state
+    inline uint32_t GetNumCreated() const { return m_created; }
+    inline size_t GetSize() const { return m_entries.size(); }
+
+    void Clear();
+
+    FramebufferCache(vk::Device device, Tracker& tracker, uint64_t maxUnusedFrames = 64);
+  };
+
+}
@@ -0,0 +1,274 @@
+#include "gpu_profiler.hpp"
+
+#include "imgui.h"
+
+using namespace BG;
+
+BG::GpuProfiler::Zone::Zone(GpuProfiler* profiler, RecordState* state, vk::CommandBuffer buf, std::string name, bool pipelineStatistics)
+  : m_profiler(profiler), m_state(state), m_buf(buf)
+{
+  bool statistics = pipelineStatistics && !state->statisticsActive;
+
+  m_parent = state->currentZone;
+  m_zone = profiler->BeginZone(name, m_parent, state->depth, statistics, m_timestampQuery, m_statisticsQuery);
+
+  if (m_zone < 0)
+  {
+    m_profiler = nullptr;
+    return;
+  }
+
+  m_buf.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, m_profiler->m_frames[m_profiler->m_currentFrame].timestamps.get(), m_timestampQuery);
+
+  if (m_statisticsQuery >= 0)
+  {
+    m_buf.beginQuery(m_profiler->m_frames[m_profiler->m_currentFrame].statistics.get(), uint32_t(m_statisticsQuery), {});
+    state->statisticsActive = true;
+  }
+
+  state->currentZone = m_zone;
+  state->depth++;
+}
+
+BG::GpuProfiler::Zone::Zone(Zone&& other) noexcept
+{
+  *this = std::move(other);
+}
+
+BG::GpuProfiler::Zone& BG::GpuProfiler::Zone::operator=(Zone&& other) noexcept
+{
+  End();
+
+  m_profiler = other.m_profiler;
+  m_state = other.m_state;
+  m_buf = other.m_buf;
+  m_zone = other.m_zone;
+  m_parent = other.m_parent;
+  m_timestampQuery = other.m_timestampQuery;
+  m_statisticsQuery = other.m_statisticsQuery;
+
+  other.m_profiler = nullptr;
+
+  return *this;
+}
+
+BG::GpuProfiler::Zone::~Zone()
+{
+  End();
+}
+
+void BG::GpuProfiler::Zone::End()
+{
+  if (m_profiler == nullptr) return;
+
+  auto& frame = m_profiler->m_frames[m_profiler->m_currentFrame];
+
+  if (m_statisticsQuery >= 0)
+  {
+    m_buf.endQuery(frame.statistics.get(), uint32_t(m_statisticsQuery));
+    m_state->statisticsActive = false;
+  }
+
+  m_buf.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.timestamps.get(), m_timestampQuery + 1);
+
+  m_state->currentZone = m_parent;
+  m_state->depth--;
+
+  m_profiler = nullptr;
+}
+
+int BG::GpuProfiler::BeginZone(std::string name, int parent, int depth, bool statistics, uint32_t& timestampQuery, int& statisticsQuery)
+{
+  if (!m_timestampSupported) return -1;
+
+  std::lock_guard<std::mutex> lk(m_recordMutex);
+
+  auto& frame = m_frames[m_currentFrame];
+
+  if (frame.numTimestamps + 2 > MAX_ZONES * 2)
+  {
+    spdlog::warn("GpuProfiler: more than {} zones in a frame, zone {} is dropped", MAX_ZONES, name);
+    return -1;
+  }
+
+  timestampQuery = frame.numTimestamps;
+  frame.numTimestamps += 2;
+
+  statisticsQuery = -1;
+  if (statistics && m_statisticsSupported && frame.numStatistics < MAX_STATISTICS_ZONES)
+  {
+    statisticsQuery = int(frame.numStatistics++);
+  }
+
+  int index = int(frame.zones.size());
+  frame.zones.push_back({ name, depth, parent, timestampQuery, statisticsQuery });
+
+  return index;
+}
+
+void BG::GpuProfiler::NewFrame(int frameIndex)
+{
+  if (!m_timestampSupported) return;
+
+  std::lock_guard<std::mutex> lk(m_recordMutex);
+
+  m_currentFrame = frameIndex;
+  m_needsReset = true;
+
+  auto& frame = m_frames[frameIndex];
+
+  if (frame.zones.empty()) return;
+
+  // The frame's fence has been waited on, the results are available without stalling
+  std::vector<uint64_t> timestamps(frame.numTimestamps);
+  auto result = m_device.getQueryPoolResults(
+    frame.timestamps.get(), 0, frame.numTimestamps,
+    timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+    vk::QueryResultFlagBits::e64);
+
+  std::vector<uint64_t> statistics(frame.numStatistics * 3);
+  bool hasStatistics = false;
+  if (frame.numStatistics > 0)
+  {
+    hasStatistics = m_device.getQueryPoolResults(
+      frame.statistics.get(), 0, frame.numStatistics,
+      statistics.size() * sizeof(uint64_t), statistics.data(), 3 * sizeof(uint64_t),
+      vk::QueryResultFlagBits::e64) == vk::Result::eSuccess;
+  }
+
+  if (result == vk::Result::eSuccess)
+  {
+    std::vector<ZoneResult> results;
+    results.reserve(frame.zones.size());
+
+    for (auto& zone : frame.zones)
+    {
+      uint64_t begin = timestamps[zone.timestampQuery] & m_timestampMask;
+      uint64_t end = timestamps[zone.timestampQuery + 1] & m_timestampMask;
+
+      ZoneResult r{};
+      r.name = zone.name;
+      r.depth = zone.depth;
+      r.parent = zone.parent;
+      r.gpuMs = double((end - begin) & m_timestampMask) * m_timestampPeriod * 1e-6;
+
+      if (hasStatistics && zone.statisticsQuery >= 0)
+      {
+        // Results are laid out in flag bit order
+        r.hasStatistics = true;
+        r.vertexInvocations = statistics[zone.statisticsQuery * 3 + 0];
+        r.clippingPrimitives = statistics[zone.statisticsQuery * 3 + 1];
+        r.fragmentInvocations = statistics[zone.statisticsQuery * 3 + 2];
+      }
+
+      results.push_back(r);
+    }
+
+    std::lock_guard<std::mutex> resultLk(m_resultMutex);
+    m_results = std::move(results);
+  }
+
+  frame.zones.clear();
+  frame.numTimestamps = 0;
+  frame.numStatistics = 0;
+}
+
+void BG::GpuProfiler::ResetQueries(vk::CommandBuffer buf)
+{
+  if (!m_timestampSupported || !m_needsReset) return;
+
+  auto& frame = m_frames[m_currentFrame];
+
+  buf.resetQueryPool(frame.timestamps.get(), 0, MAX_ZONES * 2);
+  if (m_statisticsSupported) buf.resetQueryPool(frame.statistics.get(), 0, MAX_STATISTICS_ZONES);
+
+  m_needsReset = false;
+}
+
+BG::GpuProfiler::Zone BG::GpuProfiler::OpenZone(RecordState& state, vk::CommandBuffer buf, std::string name, bool pipelineStatistics)
+{
+  if (!m_timestampSupported) return Zone();
+
+  return Zone(this, &state, buf, name, pipelineStatistics);
+}
+
+std::vector<BG::GpuProfiler::ZoneResult> BG::GpuProfiler::GetResults() const
+{
+  std::lock_guard<std::mutex> lk(m_resultMutex);
+  return m_results;
+}
+
+void BG::GpuProfiler::RenderGUI()
+{
+  if (!m_timestampSupported)
+  {
+    ImGui::Text("Timestamps are not supported on the graphics queue");
+    return;
+  }
+
+  auto results = GetResults();
+
+  if (ImGui::BeginTable("GpuProfilerTable", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+  {
+    ImGui::TableSetupColumn("Zone");
+    ImGui::TableSetupColumn("GPU ms");
+    ImGui::TableSetupColumn("VS invocations");
+    ImGui::TableSetupColumn("Clip primitives");
+    ImGui::TableSetupColumn("FS invocations");
+    ImGui::TableHeadersRow();
+
+    for (auto& zone : results)
+    {
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::Text("%*s%s", zone.depth * 2, "", zone.name.c_str());
+      ImGui::TableNextColumn();
+      ImGui::Text("%.3f", zone.gpuMs);
+      if (zone.hasStatistics)
+      {
+        ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)zone.vertexInvocations);
+        ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)zone.clippingPrimitives);
+        ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)zone.fragmentInvocations);
+      }
+    }
+
+    ImGui::EndTable();
+  }
+}
+
+BG::GpuProfiler::GpuProfiler(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queueFamily, int numFrames, bool pipelineStatistics)
+  : m_device(device)
+{
+  auto properties = physicalDevice.getProperties();
+  auto queueFamilies = physicalDevice.getQueueFamilyProperties();
+
+  uint32_t validBits = queueFamilies[queueFamily].timestampValidBits;
+
+  m_timestampSupported = validBits > 0 && properties.limits.timestampPeriod > 0.0f;
+  m_statisticsSupported = m_timestampSupported && pipelineStatistics;
+  m_timestampPeriod = properties.limits.timestampPeriod;
+  m_timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+  if (!m_timestampSupported)
+  {
+    spdlog::warn("GpuProfiler: timestamps are not supported, GPU zones are disabled");
+    return;
+  }
+
+  m_frames.resize(numFrames);
+
+  for (auto& frame : m_frames)
+  {
+    frame.timestamps = m_device.createQueryPoolUnique({ {}, vk::QueryType::eTimestamp, MAX_ZONES * 2 });
+
+    if (m_statisticsSupported)
+    {
+      vk::QueryPipelineStatisticFlags flags =
+        vk::QueryPipelineStatisticFlagBits::eVertexShaderInvocations |
+        vk::QueryPipelineStatisticFlagBits::eClippingPrimitives |
+        vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations;
+
+      frame.statistics = m_device.createQueryPoolUnique({ {}, vk::QueryType::ePipelineStatistics, MAX_STATISTICS_ZONES, flags });
+    }
+  }
+}
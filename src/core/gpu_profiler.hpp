@@ -0,0 +1,121 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+
+namespace BG
+{
+
+  class GpuProfiler
+  {
+  public:
+    struct ZoneResult
+    {
+      std::string name;
+      int depth;
+      int parent;
+      double gpuMs;
+
+      bool hasStatistics;
+      uint64_t vertexInvocations;
+      uint64_t clippingPrimitives;
+      uint64_t fragmentInvocations;
+    };
+
+    // Nesting state of one command buffer, zones opened on it form a hierarchy
+    struct RecordState
+    {
+      int currentZone = -1;
+      int depth = 0;
+      bool statisticsActive = false;
+    };
+
+    // Writes a timestamp pair (and optionally pipeline statistics) around its lifetime
+    class Zone
+    {
+    private:
+      GpuProfiler* m_profiler = nullptr;
+      RecordState* m_state = nullptr;
+      vk::CommandBuffer m_buf;
+
+      int m_zone = -1;
+      int m_parent = -1;
+      uint32_t m_timestampQuery = 0;
+      int m_statisticsQuery = -1;
+
+    public:
+      Zone() = default;
+      Zone(GpuProfiler* profiler, RecordState* state, vk::CommandBuffer buf, std::string name, bool pipelineStatistics);
+      Zone(Zone&& other) noexcept;
+      Zone& operator=(Zone&& other) noexcept;
+      Zone(const Zone&) = delete;
+      Zone& operator=(const Zone&) = delete;
+      ~Zone();
+
+      void End();
+    };
+
+  private:
+    static const uint32_t MAX_ZONES = 256;
+    static const uint32_t MAX_STATISTICS_ZONES = 64;
+
+    struct ZoneRecord
+    {
+      std::string name;
+      int depth;
+      int parent;
+      uint32_t timestampQuery;
+      int statisticsQuery;
+    };
+
+    struct FrameData
+    {
+      vk::UniqueQueryPool timestamps;
+      vk::UniqueQueryPool statistics;
+
+      std::vector<ZoneRecord> zones;
+      uint32_t numTimestamps = 0;
+      uint32_t numStatistics = 0;
+    };
+
+    vk::Device m_device;
+
+    bool m_timestampSupported = false;
+    bool m_statisticsSupported = false;
+    double m_timestampPeriod = 1.0;
+    uint64_t m_timestampMask = ~0ull;
+
+    std::vector<FrameData> m_frames;
+    int m_currentFrame = 0;
+    bool m_needsReset = false;
+
+    std::vector<ZoneResult> m_results;
+
+    std::mutex m_recordMutex;
+    mutable std::mutex m_resultMutex;
+
+    int BeginZone(std::string name, int parent, int depth, bool statistics, uint32_t& timestampQuery, int& statisticsQuery);
+
+  public:
+    // Called once the frame slot is no longer in use by the GPU. Reads back its last results.
+    void NewFrame(int frameIndex);
+
+    // Records the query pool reset for the current frame, called from CommandBuffer::Begin
+    void ResetQueries(vk::CommandBuffer buf);
+
+    Zone OpenZone(RecordState& state, vk::CommandBuffer buf, std::string name, bool pipelineStatistics = false);
+
+    inline bool IsEnabled() const { return m_timestampSupported; }
+
+    // Zones of the most recent frame that finished on the GPU, in recording order
+    std::vector<ZoneResult> GetResults() const;
+
+    void RenderGUI();
+
+    GpuProfiler(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queueFamily, int numFrames, bool pipelineStatistics);
+  };
+
+}
@@ -1,8 +1,11 @@
 #include "lifetime_tracker.hpp"
+#include "buffer.hpp"
 
 void BG::Tracker::FrameObjects::ClearAll()
 {
   framebuffers.clear();
+  imageViews.clear();
+  images.clear();
 }
 
 void BG::Tracker::DisposeFramebuffer(vk::UniqueFramebuffer fb)
@@ -10,9 +13,19 @@ void BG::Tracker::DisposeFramebuffer(vk::UniqueFramebuffer fb)
   m_frames[m_currentFrame].framebuffers.push_back(std::move(fb));
 }
 
-void BG::Tracker::NewFrame()
+void BG::Tracker::DisposeImageView(vk::UniqueImageView view)
 {
-  m_currentFrame = (m_currentFrame + 1) % m_numFramesInFlight;
+  m_frames[m_currentFrame].imageViews.push_back(std::move(view));
+}
+
+void BG::Tracker::DisposeImage(std::unique_ptr<Image> image)
+{
+  m_frames[m_currentFrame].images.push_back(std::move(image));
+}
+
+void BG::Tracker::NewFrame(int frameIndex)
+{
+  m_currentFrame = frameIndex % m_numFramesInFlight;
 
   m_frames[m_currentFrame].ClearAll();
 }
@@ -22,3 +35,7 @@ BG::Tracker::Tracker(int maxFrames)
 {
   m_frames.resize(maxFrames);
 }
+
+BG::Tracker::~Tracker()
+{
+}
@@ -14,6 +14,8 @@ namespace BG
     struct FrameObjects
     {
       std::vector<vk::UniqueFramebuffer> framebuffers;
+      std::vector<vk::UniqueImageView> imageViews;
+      std::vector<std::unique_ptr<Image>> images;
 
       void ClearAll();
     };
@@ -22,10 +24,14 @@ namespace BG
 
   public:
     void DisposeFramebuffer(vk::UniqueFramebuffer fb);
+    void DisposeImageView(vk::UniqueImageView view);
+    void DisposeImage(std::unique_ptr<Image> image);
 
-    void NewFrame();
+    // Releases the objects disposed the last time `frameIndex` was recorded
+    void NewFrame(int frameIndex);
 
     Tracker(int maxFrames);
+    ~Tracker();
   };
 
 }
\ No newline at end of file
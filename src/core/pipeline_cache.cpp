@@ -0,0 +1,180 @@
+#include "pipeline_cache.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+
+using namespace BG;
+
+static const uint32_t PIPELINE_CACHE_MAGIC = 0x43504742; // "BGPC"
+static const uint32_t PIPELINE_CACHE_VERSION = 1;
+
+std::vector<uint8_t> BG::PipelineCache::Load()
+{
+  std::vector<uint8_t> data;
+
+  if (m_path.empty()) return data;
+
+  std::ifstream f(m_path, std::ios::binary);
+  if (!f)
+  {
+    spdlog::info("No pipeline cache at {}, starting cold", m_path);
+    return data;
+  }
+
+  FileHeader header;
+  if (!f.read(reinterpret_cast<char*>(&header), sizeof(header)))
+  {
+    spdlog::warn("Pipeline cache {} is truncated, discarding", m_path);
+    return data;
+  }
+
+  // Everything except the data size has to match this device & driver
+  header.dataSize = m_header.dataSize;
+  if (std::memcmp(&header, &m_header, sizeof(header)) != 0)
+  {
+    spdlog::info("Pipeline cache {} was written by another device or driver, discarding", m_path);
+    return data;
+  }
+
+  f.seekg(0, std::ios::end);
+  size_t dataSize = size_t(f.tellg()) - sizeof(header);
+  f.seekg(sizeof(header), std::ios::beg);
+
+  data.resize(dataSize);
+  if (!f.read(reinterpret_cast<char*>(data.data()), dataSize))
+  {
+    spdlog::warn("Failed to read pipeline cache {}, discarding", m_path);
+    data.clear();
+    return data;
+  }
+
+  // The driver validates its own header too (VkPipelineCacheHeaderVersionOne), but a mismatch there
+  // means a silently empty cache
+  uint32_t driverHeader[4];
+  if (dataSize < sizeof(driverHeader) + VK_UUID_SIZE)
+  {
+    data.clear();
+    return data;
+  }
+  std::memcpy(driverHeader, data.data(), sizeof(driverHeader));
+
+  if (driverHeader[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+    driverHeader[2] != m_header.vendorID || driverHeader[3] != m_header.deviceID ||
+    std::memcmp(data.data() + sizeof(driverHeader), m_header.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+  {
+    spdlog::info("Pipeline cache {} has a mismatching driver header, discarding", m_path);
+    data.clear();
+    return data;
+  }
+
+  spdlog::info("Loaded pipeline cache {} ({} KB)", m_path, dataSize >> 10);
+
+  return data;
+}
+
+bool BG::PipelineCache::Save()
+{
+  if (m_path.empty()) return true;
+
+  auto data = m_device.getPipelineCacheData(m_cache.get());
+
+  FileHeader header = m_header;
+  header.dataSize = data.size();
+
+  // Write to a temporary file first, so a crash never leaves a half written cache behind
+  std::string tmpPath = m_path + ".tmp";
+
+  {
+    std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!f)
+    {
+      spdlog::error("Failed to open {} for writing", tmpPath);
+      return false;
+    }
+
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    f.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+    if (!f)
+    {
+      spdlog::error("Failed to write pipeline cache {}", tmpPath);
+      return false;
+    }
+  }
+
+  std::remove(m_path.c_str());
+  if (std::rename(tmpPath.c_str(), m_path.c_str()) != 0)
+  {
+    spdlog::error("Failed to move {} to {}", tmpPath, m_path);
+    return false;
+  }
+
+  spdlog::info("Saved pipeline cache {} ({} KB)", m_path, data.size() >> 10);
+
+  return true;
+}
+
+void BG::PipelineCache::Record(const std::string& name, const vk::PipelineCreationFeedbackEXT& feedback)
+{
+  std::lock_guard<std::mutex> lk(m_statsMutex);
+
+  m_stats.pipelines++;
+
+  if (!(feedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eValid))
+  {
+    m_stats.unknown++;
+    return;
+  }
+
+  bool hit = bool(feedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eApplicationPipelineCacheHit);
+  double ms = double(feedback.duration) * 1e-6;
+
+  if (hit) m_stats.hits++;
+  else m_stats.misses++;
+  m_stats.totalMs += ms;
+
+  spdlog::debug("Pipeline {}: {} in {:.3f} ms", name.empty() ? "(unnamed)" : name, hit ? "cache hit" : "cache miss", ms);
+}
+
+PipelineCache::Stats BG::PipelineCache::GetStats()
+{
+  std::lock_guard<std::mutex> lk(m_statsMutex);
+  return m_stats;
+}
+
+BG::PipelineCache::PipelineCache(vk::PhysicalDevice physicalDevice, vk::Device device, std::string path, bool hasCreationFeedback)
+  : m_device(device), m_path(path), m_hasCreationFeedback(hasCreationFeedback)
+{
+  auto properties = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>();
+  auto& deviceProperties = properties.get<vk::PhysicalDeviceProperties2>().properties;
+  auto& idProperties = properties.get<vk::PhysicalDeviceIDProperties>();
+
+  std::memset(&m_header, 0, sizeof(m_header));
+  m_header.magic = PIPELINE_CACHE_MAGIC;
+  m_header.version = PIPELINE_CACHE_VERSION;
+  m_header.vendorID = deviceProperties.vendorID;
+  m_header.deviceID = deviceProperties.deviceID;
+  m_header.driverVersion = deviceProperties.driverVersion;
+  std::memcpy(m_header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID.data(), VK_UUID_SIZE);
+  std::memcpy(m_header.driverUUID, idProperties.driverUUID.data(), VK_UUID_SIZE);
+
+  auto data = Load();
+
+  vk::PipelineCacheCreateInfo cacheInfo;
+  cacheInfo.initialDataSize = data.size();
+  cacheInfo.pInitialData = data.data();
+
+  m_cache = m_device.createPipelineCacheUnique(cacheInfo);
+}
+
+BG::PipelineCache::~PipelineCache()
+{
+  Save();
+
+  auto stats = GetStats();
+  if (stats.pipelines > 0)
+  {
+    spdlog::info("Pipeline cache: {} pipelines, {} hits, {} misses, {:.1f} ms total", stats.pipelines, stats.hits, stats.misses, stats.totalMs);
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+
+namespace BG
+{
+
+  // Renderer-wide VkPipelineCache, persisted to disk. The file is discarded when it was written by another
+  // device or driver.
+  class PipelineCache
+  {
+  public:
+    struct Stats
+    {
+      uint32_t pipelines = 0;
+      uint32_t hits = 0;     // Driver reported an application pipeline cache hit
+      uint32_t misses = 0;
+      uint32_t unknown = 0;  // No creation feedback available
+      double totalMs = 0.0;  // Pipeline creation time, as reported by the driver
+    };
+
+  private:
+    // Prefixed to the driver's cache data in the file
+    struct FileHeader
+    {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t vendorID;
+      uint32_t deviceID;
+      uint32_t driverVersion;
+      uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+      uint8_t driverUUID[VK_UUID_SIZE];
+      uint64_t dataSize;
+    };
+
+    vk::Device m_device;
+    vk::UniquePipelineCache m_cache;
+
+    std::string m_path;
+    FileHeader m_header;
+
+    bool m_hasCreationFeedback;
+
+    Stats m_stats;
+    std::mutex m_statsMutex;
+
+    std::vector<uint8_t> Load();
+
+  public:
+    inline vk::PipelineCache Get() const { return m_cache.get(); }
+    inline bool HasCreationFeedback() const { return m_hasCreationFeedback; }
+
+    // Thread safe, `name` is only used for logging
+    void Record(const std::string& name, const vk::PipelineCreationFeedbackEXT& feedback);
+    Stats GetStats();
+
+    // Write the cache to disk, no-op without a path
+    bool Save();
+
+    PipelineCache(vk::PhysicalDevice physicalDevice, vk::Device device, std::string path, bool hasCreationFeedback);
+    ~PipelineCache();
+  };
+
+}
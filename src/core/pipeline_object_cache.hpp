@@ -0,0 +1,125 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Shares identical shader modules, render passes, layouts and pipelines between Pipeline instances.
+  // Entries are keyed by the exact creation state and live as long as some Pipeline references them.
+  class PipelineObjectCache
+  {
+  public:
+    // Byte string of the state an object is created from. Only add padding-free values.
+    class Key
+    {
+    private:
+      std::string m_bytes;
+
+    public:
+      template <class T> Key& Add(const T& value)
+      {
+        m_bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        return *this;
+      }
+
+      template <class T> Key& AddArray(const std::vector<T>& values)
+      {
+        Add(uint32_t(values.size()));
+        m_bytes.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        return *this;
+      }
+
+      Key& AddString(const std::string& s)
+      {
+        Add(uint32_t(s.size()));
+        m_bytes.append(s);
+        return *this;
+      }
+
+      inline const std::string& Bytes() const { return m_bytes; }
+    };
+
+    struct Stats
+    {
+      uint32_t hits = 0;
+      uint32_t misses = 0;
+    };
+
+  private:
+    template <class T> using Table = std::unordered_map<std::string, std::weak_ptr<T>>;
+
+    Table<vk::UniqueShaderModule>        m_shaderModules;
+    Table<vk::UniqueRenderPass>          m_renderPasses;
+    Table<vk::UniqueDescriptorSetLayout> m_descSetLayouts;
+    Table<vk::UniquePipelineLayout>      m_pipelineLayouts;
+    Table<vk::UniquePipeline>            m_pipelines;
+
+    Stats m_stats;
+    std::mutex m_mutex;
+
+    // Creation runs unlocked, if two threads race on a key the first insert wins
+    template <class T> std::shared_ptr<T> GetOrCreate(Table<T>& table, const Key& key, const std::function<T()>& create)
+    {
+      {
+        std::lock_guard<std::mutex> lk(m_mutex);
+
+        auto it = table.find(key.Bytes());
+        if (it != table.end())
+        {
+          if (auto object = it->second.lock())
+          {
+            m_stats.hits++;
+            return object;
+          }
+        }
+      }
+
+      auto created = std::make_shared<T>(create());
+
+      std::lock_guard<std::mutex> lk(m_mutex);
+
+      auto& entry = table[key.Bytes()];
+      if (auto object = entry.lock())
+      {
+        m_stats.hits++;
+        return object;
+      }
+
+      m_stats.misses++;
+      entry = created;
+
+      // Drop expired entries now and then, so the tables don't grow with every destroyed pipeline
+      if (table.size() > 64 && (m_stats.misses % 64) == 0)
+      {
+        for (auto i = table.begin(); i != table.end();)
+        {
+          if (i->second.expired()) i = table.erase(i);
+          else i++;
+        }
+      }
+
+      return created;
+    }
+
+  public:
+    std::shared_ptr<vk::UniqueShaderModule> GetShaderModule(const Key& key, const std::function<vk::UniqueShaderModule()>& create) { return GetOrCreate(m_shaderModules, key, create); }
+    std::shared_ptr<vk::UniqueRenderPass> GetRenderPass(const Key& key, const std::function<vk::UniqueRenderPass()>& create) { return GetOrCreate(m_renderPasses, key, create); }
+    std::shared_ptr<vk::UniqueDescriptorSetLayout> GetDescriptorSetLayout(const Key& key, const std::function<vk::UniqueDescriptorSetLayout()>& create) { return GetOrCreate(m_descSetLayouts, key, create); }
+    std::shared_ptr<vk::UniquePipelineLayout> GetPipelineLayout(const Key& key, const std::function<vk::UniquePipelineLayout()>& create) { return GetOrCreate(m_pipelineLayouts, key, create); }
+    std::shared_ptr<vk::UniquePipeline> GetPipeline(const Key& key, const std::function<vk::UniquePipeline()>& create) { return GetOrCreate(m_pipelines, key, create); }
+
+    inline Stats GetStats()
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      return m_stats;
+    }
+  };
+
+}
@@ -1,12 +1,20 @@
 #include "pipelines.hpp"
 #include "renderer.hpp"
 #include "buffer.hpp"
+#include "pipeline_cache.hpp"
+#include "worker_pool.hpp"
+#include "pipeline_object_cache.hpp"
+#include "framebuffer_cache.hpp"
+#include "descriptor_cache.hpp"
+#include "descriptor_allocator.hpp"
 
 #include <glslang/Public/ShaderLang.h>
 #include <SPIRV/GlslangToSpv.h>
 
 #include <SPIRV-Reflect/spirv_reflect.h>
 
+#include <algorithm>
+
 using namespace BG;
 
 std::vector<uint32_t> BuildSPIRV(glslang::TProgram& program, EShLanguage shaderType)
@@ -34,12 +42,23 @@ void BindDescriptorReflection(Pipeline& p, int binding, SpvReflectDescriptorType
     spdlog::debug("Descriptor: binding = {}, Texture / Combined Sampler", binding);
     p.AddDescriptorTexture(binding, stage, arraySize, unbounded);
   }
+  else if (type == SPV_REFLECT_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+  {
+    spdlog::debug("Descriptor: binding = {}, Storage Buffer", binding);
+    p.AddDescriptorStorageBuffer(binding, stage, arraySize);
+  }
+  else if (type == SPV_REFLECT_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+  {
+    spdlog::debug("Descriptor: binding = {}, Storage Image", binding);
+    p.AddDescriptorStorageImage(binding, stage, arraySize);
+  }
 }
 
-std::vector<uint32_t> BG::Pipeline::BuildProgramFromSrc(std::string shaders, int _shaderType)
-{
-  EShLanguage shaderType = EShLanguage(_shaderType);
+// Bump when anything below changes the generated SPIR-V or reflection
+static const char* SHADER_COMPILE_OPTIONS = "glsl100-vulkan1.0-spv1.0-spvrules-validate-v1";
 
+static ShaderCache::CompiledShader CompileShader(const std::string& shaders, EShLanguage shaderType)
+{
   const char* shaderCStr = shaders.c_str();
 
   glslang::TShader shader(shaderType);
@@ -62,6 +81,17 @@ std::vector<uint32_t> BG::Pipeline::BuildProgramFromSrc(std::string shaders, int
   Resources.limits.generalVariableIndexing = true;
   Resources.limits.generalVaryingIndexing = true;
 
+  // glslang validates local_size against these, the device limits are checked at pipeline creation
+  Resources.maxComputeWorkGroupCountX = 65535;
+  Resources.maxComputeWorkGroupCountY = 65535;
+  Resources.maxComputeWorkGroupCountZ = 65535;
+  Resources.maxComputeWorkGroupSizeX = 1024;
+  Resources.maxComputeWorkGroupSizeY = 1024;
+  Resources.maxComputeWorkGroupSizeZ = 64;
+  Resources.maxComputeUniformComponents = 1024;
+  Resources.maxComputeTextureImageUnits = 16;
+  Resources.maxComputeImageUniforms = 8;
+
   EShMessages messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
 
   const int DefaultVersion = 100;
@@ -80,11 +110,12 @@ std::vector<uint32_t> BG::Pipeline::BuildProgramFromSrc(std::string shaders, int
     spdlog::error("Link failed");
     throw std::runtime_error("GLSL Linking Error");
   }
-  
-  auto spirv = BuildSPIRV(program, shaderType);
+
+  ShaderCache::CompiledShader compiled;
+  compiled.spirv = BuildSPIRV(program, shaderType);
 
   SpvReflectShaderModule module;
-  SpvReflectResult result = spvReflectCreateShaderModule(spirv.size() * sizeof(uint32_t), spirv.data(), &module);
+  SpvReflectResult result = spvReflectCreateShaderModule(compiled.spirv.size() * sizeof(uint32_t), compiled.spirv.data(), &module);
   assert(result == SPV_REFLECT_RESULT_SUCCESS);
 
   vk::ShaderStageFlags stage;
@@ -97,77 +128,141 @@ std::vector<uint32_t> BG::Pipeline::BuildProgramFromSrc(std::string shaders, int
   case (SPV_REFLECT_SHADER_STAGE_VERTEX_BIT):
     stage = vk::ShaderStageFlagBits::eVertex;
     break;
+  case (SPV_REFLECT_SHADER_STAGE_COMPUTE_BIT):
+    stage = vk::ShaderStageFlagBits::eCompute;
+    break;
   default:
     stage = vk::ShaderStageFlagBits::eAll;
     break;
   }
 
+  compiled.stage = uint32_t(VkShaderStageFlags(stage));
+
   for (uint32_t i = 0; i < module.descriptor_binding_count; i++)
   {
     SpvReflectDescriptorBinding& binding = module.descriptor_bindings[i];
 
-    bool unbounded = binding.type_description->op == SpvOpTypeRuntimeArray;
-
-    if (std::string(binding.name) != "")
-    {
-      spdlog::debug("Descriptor name {}, unbounded={}", binding.name, unbounded);
-      this->m_name2bindings[binding.name] = binding.binding;
-    }
+    ShaderCache::DescriptorBinding b;
+    b.name = binding.name;
+    b.set = binding.set;
+    b.binding = binding.binding;
+    b.descriptorType = uint32_t(binding.descriptor_type);
+    b.unbounded = binding.type_description->op == SpvOpTypeRuntimeArray;
+    b.isBlock = binding.block.members != nullptr;
+    b.blockSize = b.isBlock ? binding.block.padded_size : 0;
 
-    if (binding.block.members != nullptr)
+    if (b.isBlock)
     {
       for (uint32_t j = 0; j < binding.block.member_count; j++)
       {
         auto& member = binding.block.members[j];
-
-        spdlog::debug("Member variable name {}, offset {}", member.name, member.absolute_offset);
-        this->m_name2bindings[member.name] = binding.binding;
-        this->m_memberOffsets[member.name] = member.absolute_offset;
+        b.members.push_back({ member.name, member.absolute_offset });
       }
-    
-      this->m_uniformBlockSize[binding.name] = binding.block.padded_size;
-      spdlog::debug("Block size {}", binding.block.padded_size);
     }
 
-    BindDescriptorReflection(*this, binding.binding, binding.descriptor_type, stage, 1, unbounded);
+    compiled.bindings.push_back(std::move(b));
   }
 
   for (uint32_t i = 0; i < module.push_constant_block_count; i++)
   {
     auto& pushConstant = module.push_constant_blocks[i];
 
-    this->AddPushConstant(pushConstant.absolute_offset, pushConstant.padded_size, stage);
-  
-    spdlog::debug("Push constant {}, offset={}, size={}", i, pushConstant.absolute_offset, pushConstant.padded_size);
+    ShaderCache::PushConstantBlock p;
+    p.offset = pushConstant.absolute_offset;
+    p.size = pushConstant.padded_size;
 
     for (uint32_t j = 0; j < pushConstant.member_count; j++)
     {
       auto& member = pushConstant.members[j];
-
-      spdlog::debug("Member variable name {}, offset {}", member.name, member.absolute_offset);
-      this->m_memberOffsets[member.name] = member.absolute_offset;
+      p.members.push_back({ member.name, member.absolute_offset });
     }
+
+    compiled.pushConstants.push_back(std::move(p));
   }
 
   spvReflectDestroyShaderModule(&module);
 
-  return spirv;
+  return compiled;
+}
+
+void BG::Pipeline::ApplyReflection(const ShaderCache::CompiledShader& shader)
+{
+  vk::ShaderStageFlags stage = vk::ShaderStageFlags(shader.stage);
+
+  for (auto& binding : shader.bindings)
+  {
+    if (binding.name != "")
+    {
+      spdlog::debug("Descriptor name {}, unbounded={}", binding.name, binding.unbounded);
+      this->m_name2bindings[binding.name] = binding.binding;
+    }
+
+    if (binding.isBlock)
+    {
+      for (auto& member : binding.members)
+      {
+        spdlog::debug("Member variable name {}, offset {}", member.name, member.offset);
+        this->m_name2bindings[member.name] = binding.binding;
+        this->m_memberOffsets[member.name] = member.offset;
+      }
+
+      this->m_uniformBlockSize[binding.name] = binding.blockSize;
+      spdlog::debug("Block size {}", binding.blockSize);
+    }
+
+    // Other sets come from SetExternalDescSetLayout
+    if (binding.set != 0)
+    {
+      m_numDescSets = std::max(m_numDescSets, binding.set + 1);
+      continue;
+    }
+
+    BindDescriptorReflection(*this, binding.binding, SpvReflectDescriptorType(binding.descriptorType), stage, 1, binding.unbounded);
+  }
+
+  for (size_t i = 0; i < shader.pushConstants.size(); i++)
+  {
+    auto& pushConstant = shader.pushConstants[i];
+
+    this->AddPushConstant(pushConstant.offset, pushConstant.size, stage);
+
+    spdlog::debug("Push constant {}, offset={}, size={}", i, pushConstant.offset, pushConstant.size);
+
+    for (auto& member : pushConstant.members)
+    {
+      spdlog::debug("Member variable name {}, offset {}", member.name, member.offset);
+      this->m_memberOffsets[member.name] = member.offset;
+    }
+  }
+}
+
+std::vector<uint32_t> BG::Pipeline::BuildProgramFromSrc(std::string shaders, int shaderType)
+{
+  auto& cache = r.getShaderCache();
+  auto key = ShaderCache::MakeKey(shaders, shaderType, SHADER_COMPILE_OPTIONS);
+
+  auto compiled = cache.GetOrCompile(key, [&]() { return CompileShader(shaders, EShLanguage(shaderType)); });
+
+  ApplyReflection(*compiled);
+
+  return compiled->spirv;
 }
 
-vk::UniqueShaderModule BG::Pipeline::AddShaders(std::string shaders, int shaderType)
+std::shared_ptr<vk::UniqueShaderModule> BG::Pipeline::AddShaders(std::string shaders, int shaderType)
 {
   std::vector<uint32_t> spirv = BuildProgramFromSrc(shaders, shaderType);
 
-  auto shaderModule = m_device.createShaderModuleUnique({ {}, spirv });
+  PipelineObjectCache::Key key;
+  key.AddArray(spirv);
 
-  return shaderModule;
+  return r.getPipelineObjectCache().GetShaderModule(key, [&]() { return m_device.createShaderModuleUnique({ {}, spirv }); });
 }
 
 void BG::Pipeline::AddFragmentShaders(std::string shaders)
 {
   auto shader = AddShaders(shaders, EShLangFragment);
 
-  m_stageCreateInfos.push_back(vk::PipelineShaderStageCreateInfo{ {}, vk::ShaderStageFlagBits::eFragment, shader.get(), "main" });
+  m_stageCreateInfos.push_back(vk::PipelineShaderStageCreateInfo{ {}, vk::ShaderStageFlagBits::eFragment, shader->get(), "main" });
 
   m_shaderModules.push_back(std::move(shader));
 }
@@ -176,9 +271,26 @@ void BG::Pipeline::AddVertexShaders(std::string shaders)
 {
   auto shader = AddShaders(shaders, EShLangVertex);
 
-  m_stageCreateInfos.push_back(vk::PipelineShaderStageCreateInfo{ {}, vk::ShaderStageFlagBits::eVertex, shader.get(), "main" });
+  m_stageCreateInfos.push_back(vk::PipelineShaderStageCreateInfo{ {}, vk::ShaderStageFlagBits::eVertex, shader->get(), "main" });
+
+  m_shaderModules.push_back(std::move(shader));
+}
+
+void BG::Pipeline::AddComputeShaders(std::string shaders)
+{
+  if (!m_stageCreateInfos.empty())
+  {
+    spdlog::error("A compute pipeline has exactly one shader stage");
+    throw std::runtime_error("Compute shader added to a pipeline with other stages");
+  }
+
+  auto shader = AddShaders(shaders, EShLangCompute);
+
+  m_stageCreateInfos.push_back(vk::PipelineShaderStageCreateInfo{ {}, vk::ShaderStageFlagBits::eCompute, shader->get(), "main" });
 
   m_shaderModules.push_back(std::move(shader));
+
+  m_isCompute = true;
 }
 
 void BG::Pipeline::AddAttribute(VertexBufferBinding binding, int location, vk::Format format, size_t offset)
@@ -236,6 +348,32 @@ void BG::Pipeline::AddDescriptorTexture(int binding, vk::ShaderStageFlags stage,
     m_descSetLayoutBindingFlags.push_back(vk::DescriptorBindingFlagBits(0));
 }
 
+void BG::Pipeline::AddDescriptorStorageBuffer(int binding, vk::ShaderStageFlags stage, int count)
+{
+  vk::DescriptorSetLayoutBinding layoutBinding;
+  layoutBinding.binding = binding;
+  layoutBinding.descriptorType = vk::DescriptorType::eStorageBuffer;
+  layoutBinding.descriptorCount = count;
+  layoutBinding.stageFlags = stage;
+  layoutBinding.pImmutableSamplers = nullptr;
+
+  m_descSetLayoutBindings.push_back(layoutBinding);
+  m_descSetLayoutBindingFlags.push_back(vk::DescriptorBindingFlagBits(0));
+}
+
+void BG::Pipeline::AddDescriptorStorageImage(int binding, vk::ShaderStageFlags stage, int count)
+{
+  vk::DescriptorSetLayoutBinding layoutBinding;
+  layoutBinding.binding = binding;
+  layoutBinding.descriptorType = vk::DescriptorType::eStorageImage;
+  layoutBinding.descriptorCount = count;
+  layoutBinding.stageFlags = stage;
+  layoutBinding.pImmutableSamplers = nullptr;
+
+  m_descSetLayoutBindings.push_back(layoutBinding);
+  m_descSetLayoutBindingFlags.push_back(vk::DescriptorBindingFlagBits(0));
+}
+
 void BG::Pipeline::SetViewport(float width, float height, float x, float y, float minDepth, float maxDepth)
 {
   m_viewport.x = x;
@@ -294,8 +432,47 @@ void BG::Pipeline::AddDepthAttachment(vk::ImageLayout initialLayout, vk::ImageLa
   m_useDepthAttachment = true;
 }
 
-void BG::Pipeline::BuildPipeline()
+void BG::Pipeline::SetExternalDescSetLayout(uint32_t set, vk::DescriptorSetLayout layout)
+{
+  if (set == 0)
+  {
+    spdlog::error("Descriptor set 0 is created by the pipeline");
+    throw std::runtime_error("Bad descriptor set");
+  }
+
+  if (m_externalSetLayouts.size() <= set) m_externalSetLayouts.resize(set + 1);
+  m_externalSetLayouts[set] = layout;
+}
+
+void BG::Pipeline::CreateLayouts()
 {
+  for (int binding : m_dynamicUniformBindings)
+  {
+    auto it = std::find_if(m_descSetLayoutBindings.begin(), m_descSetLayoutBindings.end(), [&](auto& b) { return b.binding == uint32_t(binding); });
+    if (it == m_descSetLayoutBindings.end() || it->descriptorType == vk::DescriptorType::eCombinedImageSampler ||
+      it->descriptorType == vk::DescriptorType::eStorageImage || it->descriptorType == vk::DescriptorType::eStorageBuffer)
+    {
+      spdlog::error("Pipeline {}: binding {} is not a uniform buffer, it can't be dynamic", m_name, binding);
+      throw std::runtime_error("Bad dynamic uniform binding");
+    }
+    it->descriptorType = vk::DescriptorType::eUniformBufferDynamic;
+  }
+
+  for (auto& [binding, samplers] : m_immutableSamplers)
+  {
+    auto it = std::find_if(m_descSetLayoutBindings.begin(), m_descSetLayoutBindings.end(), [&](auto& b) { return b.binding == uint32_t(binding); });
+    size_t index = it - m_descSetLayoutBindings.begin();
+    if (it == m_descSetLayoutBindings.end() || it->descriptorType != vk::DescriptorType::eCombinedImageSampler ||
+      (m_descSetLayoutBindingFlags[index] & vk::DescriptorBindingFlagBits::eVariableDescriptorCount))
+    {
+      spdlog::error("Pipeline {}: binding {} is not a fixed size combined image sampler, it can't have an immutable sampler", m_name, binding);
+      throw std::runtime_error("Bad immutable sampler binding");
+    }
+
+    samplers.resize(it->descriptorCount, samplers[0]);
+    it->pImmutableSamplers = samplers.data();
+  }
+
   vk::DescriptorSetLayoutCreateInfo layoutInfo;
   vk::DescriptorSetLayoutBindingFlagsCreateInfo layoutFlagsInfo;
   layoutFlagsInfo.setBindingCount(m_descSetLayoutBindings.size());
@@ -306,14 +483,43 @@ void BG::Pipeline::BuildPipeline()
     layoutInfo.setPNext(&layoutFlagsInfo);
   }
 
-  m_descriptorSetLayout = m_device.createDescriptorSetLayoutUnique(layoutInfo);
+  auto& cache = r.getPipelineObjectCache();
+
+  PipelineObjectCache::Key setLayoutKey;
+  // Immutable samplers are keyed by handle, not by the pointer to them
+  std::vector<vk::DescriptorSetLayoutBinding> keyBindings = m_descSetLayoutBindings;
+  for (auto& b : keyBindings) b.pImmutableSamplers = nullptr;
+
+  setLayoutKey.AddArray(keyBindings).AddArray(m_descSetLayoutBindingFlags).Add(r.m_hasDescriptorIndexing);
+  for (auto& [binding, samplers] : m_immutableSamplers) setLayoutKey.Add(binding).AddArray(samplers);
+
+  m_descriptorSetLayout = cache.GetDescriptorSetLayout(setLayoutKey, [&]() { return m_device.createDescriptorSetLayoutUnique(layoutInfo); });
+
+  std::vector<vk::DescriptorSetLayout> setLayouts = { m_descriptorSetLayout->get() };
+  for (uint32_t set = 1; set < std::max<uint32_t>(m_numDescSets, uint32_t(m_externalSetLayouts.size())); set++)
+  {
+    if (set >= m_externalSetLayouts.size() || !m_externalSetLayouts[set])
+    {
+      spdlog::error("Pipeline {} uses descriptor set {} without a layout, see SetExternalDescSetLayout", m_name, set);
+      throw std::runtime_error("Missing descriptor set layout");
+    }
+    setLayouts.push_back(m_externalSetLayouts[set]);
+  }
 
   vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
-  pipelineLayoutInfo.setLayoutCount = 1;
-  pipelineLayoutInfo.pSetLayouts = &m_descriptorSetLayout.get();
+  pipelineLayoutInfo.setSetLayouts(setLayouts);
   pipelineLayoutInfo.setPushConstantRanges(m_pushConstants);
 
-  m_layout = m_device.createPipelineLayoutUnique(pipelineLayoutInfo);
+  PipelineObjectCache::Key layoutKey;
+  layoutKey.AddArray(setLayouts).AddArray(m_pushConstants);
+
+  m_layout = cache.GetPipelineLayout(layoutKey, [&]() { return m_device.createPipelineLayoutUnique(pipelineLayoutInfo); });
+
+  if (m_isCompute)
+  {
+    m_created = true;
+    return;
+  }
 
   std::vector<vk::AttachmentReference> attachments;
 
@@ -338,17 +544,48 @@ void BG::Pipeline::BuildPipeline()
   if (m_useDepthAttachment) mainSubpass.setPDepthStencilAttachment(&depthAttachmentRef);
   subpass.push_back(mainSubpass);
 
-  if (m_useDepthAttachment)
-  {
-    std::vector<vk::AttachmentDescription> allAttachements;
-    allAttachements = m_attachments;
-    allAttachements.push_back(m_depthAttachment);
+  std::vector<vk::AttachmentDescription> allAttachements;
+  allAttachements = m_attachments;
+  if (m_useDepthAttachment) allAttachements.push_back(m_depthAttachment);
 
-    m_renderpass = m_device.createRenderPassUnique({ {}, allAttachements, subpass });
-  }
-  else
+  // The subpass is derived from the attachments, they are all there is to the render pass
+  PipelineObjectCache::Key renderPassKey;
+  renderPassKey.AddArray(allAttachements).Add(m_useDepthAttachment);
+
+  m_renderpass = cache.GetRenderPass(renderPassKey, [&]() { return m_device.createRenderPassUnique({ {}, allAttachements, subpass }); });
+
+  m_created = true;
+}
+
+void BG::Pipeline::CreatePipelineObject()
+{
+  if (m_isCompute)
   {
-    m_renderpass = m_device.createRenderPassUnique({ {}, m_attachments, subpass });
+    vk::ComputePipelineCreateInfo computeInfo;
+    computeInfo.stage = m_stageCreateInfos[0];
+    computeInfo.layout = m_layout->get();
+
+    PipelineObjectCache::Key key;
+    key.Add(VkShaderModule(computeInfo.stage.module)).AddString(computeInfo.stage.pName).Add(VkPipelineLayout(computeInfo.layout));
+
+    m_pipeline = r.getPipelineObjectCache().GetPipeline(key, [&]() {
+      vk::PipelineCreationFeedbackEXT feedback;
+      vk::PipelineCreationFeedbackCreateInfoEXT feedbackInfo;
+      feedbackInfo.pPipelineCreationFeedback = &feedback;
+      if (r.getPipelineCache().HasCreationFeedback()) computeInfo.setPNext(&feedbackInfo);
+
+      auto result = m_device.createComputePipelineUnique(r.getPipelineCache().Get(), computeInfo, nullptr);
+
+      if (result.result != vk::Result::eSuccess) throw std::runtime_error("Create pipeline failed");
+
+      r.getPipelineCache().Record(m_name, feedback);
+
+      return std::move(result.value);
+      });
+
+    m_ready.store(true, std::memory_order_release);
+
+    return;
   }
 
   std::vector<vk::PipelineColorBlendAttachmentState> colorBlendAttachments;
@@ -389,17 +626,76 @@ void BG::Pipeline::BuildPipeline()
   pipelineInfo.pDepthStencilState = m_useDepthAttachment ? &depthStencilState : nullptr;
   pipelineInfo.pColorBlendState = &blendInfo;
   pipelineInfo.pDynamicState = nullptr;
-  pipelineInfo.layout = m_layout.get();
-  pipelineInfo.renderPass = m_renderpass.get();
+  pipelineInfo.layout = m_layout->get();
+  pipelineInfo.renderPass = m_renderpass->get();
   pipelineInfo.subpass = 0;
-  
-  auto result = m_device.createGraphicsPipelineUnique(nullptr, pipelineInfo, nullptr);
 
-  if (result.result != vk::Result::eSuccess) throw std::runtime_error("Create pipeline failed");
+  // Everything the create info above is built from. Create info structs have padding, so they go in field by field.
+  PipelineObjectCache::Key key;
+  key.Add(uint32_t(m_stageCreateInfos.size()));
+  for (auto& stage : m_stageCreateInfos)
+  {
+    key.Add(VkShaderStageFlags(vk::ShaderStageFlags(stage.stage))).Add(VkShaderModule(stage.module)).AddString(stage.pName);
+  }
+  key.AddArray(m_bindingDescriptions).AddArray(m_attributeDescriptions);
+  key.Add(m_inputAssemblyInfo.topology).Add(m_inputAssemblyInfo.primitiveRestartEnable);
+  key.Add(m_viewport).Add(m_scissor);
+  key.Add(m_rasterizer.depthClampEnable).Add(m_rasterizer.rasterizerDiscardEnable).Add(m_rasterizer.polygonMode);
+  key.Add(VkCullModeFlags(m_rasterizer.cullMode)).Add(m_rasterizer.frontFace).Add(m_rasterizer.lineWidth);
+  key.Add(m_rasterizer.depthBiasEnable).Add(m_rasterizer.depthBiasConstantFactor).Add(m_rasterizer.depthBiasClamp).Add(m_rasterizer.depthBiasSlopeFactor);
+  key.Add(m_multisampling.rasterizationSamples).Add(m_multisampling.sampleShadingEnable).Add(m_multisampling.minSampleShading);
+  key.Add(m_multisampling.alphaToCoverageEnable).Add(m_multisampling.alphaToOneEnable);
+  key.Add(m_useDepthAttachment).Add(uint32_t(m_attachments.size()));
+  key.Add(VkPipelineLayout(pipelineInfo.layout)).Add(VkRenderPass(pipelineInfo.renderPass));
 
-  m_pipeline = std::move(result.value);
+  m_pipeline = r.getPipelineObjectCache().GetPipeline(key, [&]() {
+    vk::PipelineCreationFeedbackEXT feedback;
+    vk::PipelineCreationFeedbackCreateInfoEXT feedbackInfo;
+    feedbackInfo.pPipelineCreationFeedback = &feedback;
+    if (r.getPipelineCache().HasCreationFeedback()) pipelineInfo.setPNext(&feedbackInfo);
 
-  m_created = true;
+    auto result = m_device.createGraphicsPipelineUnique(r.getPipelineCache().Get(), pipelineInfo, nullptr);
+
+    if (result.result != vk::Result::eSuccess) throw std::runtime_error("Create pipeline failed");
+
+    r.getPipelineCache().Record(m_name, feedback);
+
+    return std::move(result.value);
+    });
+
+  m_ready.store(true, std::memory_order_release);
+}
+
+void BG::Pipeline::BuildPipeline()
+{
+  CreateLayouts();
+  CreatePipelineObject();
+}
+
+std::shared_future<void> BG::Pipeline::BuildPipelineAsync()
+{
+  CreateLayouts();
+
+  m_buildFuture = r.getWorkerPool().Submit([this]() {
+    try
+    {
+      CreatePipelineObject();
+    }
+    catch (const std::exception& e)
+    {
+      spdlog::error("Async build of pipeline {} failed: {}", m_name.empty() ? "(unnamed)" : m_name, e.what());
+      throw;
+    }
+    }).share();
+
+  return m_buildFuture;
+}
+
+vk::Pipeline BG::Pipeline::GetBindablePipeline()
+{
+  if (m_ready.load(std::memory_order_acquire)) return m_pipeline->get();
+  if (m_fallback && m_fallback->IsReady()) return m_fallback->m_pipeline->get();
+  return nullptr;
 }
 
 void BG::Pipeline::AddPushConstant(uint32_t offset, uint32_t size, vk::ShaderStageFlags stage)
@@ -423,13 +719,18 @@ vk::DescriptorSet Pipeline::AllocDescSet(vk::DescriptorPool pool, int variableDe
   vk::DescriptorSetAllocateInfo allocInfo;
   allocInfo.descriptorPool = pool;
   allocInfo.descriptorSetCount = 1;
-  allocInfo.pSetLayouts = &m_descriptorSetLayout.get();
+  allocInfo.pSetLayouts = &m_descriptorSetLayout->get();
 
   if (variableDescriptorCount != 0) allocInfo.pNext = &variableCount;
 
   return m_device.allocateDescriptorSets(allocInfo)[0];
 }
 
+vk::DescriptorSet Pipeline::AllocDescSet(DescriptorAllocator& allocator, int variableDescriptorCount)
+{
+  return allocator.Allocate(*this, uint32_t(variableDescriptorCount));
+}
+
 
 void BG::Pipeline::BindGraphicsUniformBuffer(Pipeline& p, vk::DescriptorSet descSet, const BG::Buffer& buffer, uint32_t offset, uint32_t range, int binding, int arrayElement)
 {
@@ -467,11 +768,46 @@ void BG::Pipeline::BindGraphicsImageView(Pipeline& p, vk::DescriptorSet descSet,
   m_device.updateDescriptorSets(1, &descSetWrite, 0, nullptr);
 }
 
+void BG::Pipeline::BindStorageBuffer(vk::DescriptorSet descSet, const BG::Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int binding, int arrayElement)
+{
+  vk::DescriptorBufferInfo bufferInfo;
+  bufferInfo.buffer = buffer.buffer;
+  bufferInfo.offset = offset;
+  bufferInfo.range = range;
+
+  vk::WriteDescriptorSet descSetWrite;
+  descSetWrite.dstBinding = binding;
+  descSetWrite.dstArrayElement = arrayElement;
+  descSetWrite.dstSet = descSet;
+  descSetWrite.descriptorType = vk::DescriptorType::eStorageBuffer;
+  descSetWrite.descriptorCount = 1;
+  descSetWrite.pBufferInfo = &bufferInfo;
+
+  m_device.updateDescriptorSets(1, &descSetWrite, 0, nullptr);
+}
+
+void BG::Pipeline::BindStorageImage(vk::DescriptorSet descSet, vk::ImageView view, int binding, int arrayElement)
+{
+  vk::DescriptorImageInfo imageInfo;
+  imageInfo.imageLayout = vk::ImageLayout::eGeneral;
+  imageInfo.imageView = view;
+
+  vk::WriteDescriptorSet descSetWrite;
+  descSetWrite.dstBinding = binding;
+  descSetWrite.dstArrayElement = arrayElement;
+  descSetWrite.dstSet = descSet;
+  descSetWrite.descriptorType = vk::DescriptorType::eStorageImage;
+  descSetWrite.descriptorCount = 1;
+  descSetWrite.pImageInfo = &imageInfo;
+
+  m_device.updateDescriptorSets(1, &descSetWrite, 0, nullptr);
+}
+
 vk::RenderPass Pipeline::GetRenderPass()
 {
   if (m_created)
   {
-    return m_renderpass.get();
+    return m_renderpass->get();
   }
   else
   {
@@ -482,9 +818,9 @@ vk::RenderPass Pipeline::GetRenderPass()
 
 vk::Pipeline Pipeline::GetPipeline()
 {
-  if (m_created)
+  if (IsReady())
   {
-    return m_pipeline.get();
+    return m_pipeline->get();
   }
   else
   {
@@ -497,7 +833,20 @@ vk::PipelineLayout Pipeline::GetLayout()
 {
   if (m_created)
   {
-    return m_layout.get();
+    return m_layout->get();
+  }
+  else
+  {
+    spdlog::error("Pipeline is not built");
+    throw std::runtime_error("Pipeline is not built");
+  }
+}
+
+vk::DescriptorSetLayout Pipeline::GetDescSetLayout()
+{
+  if (m_created)
+  {
+    return m_descriptorSetLayout->get();
   }
   else
   {
@@ -511,7 +860,8 @@ void BG::Pipeline::BindRenderPass(
   vk::Framebuffer& frameBuffer,
   glm::uvec2 extent,
   glm::vec4 clearColor,
-  glm::ivec2 offset)
+  glm::ivec2 offset,
+  vk::SubpassContents contents)
 {
   if (!m_created)
   {
@@ -520,7 +870,7 @@ void BG::Pipeline::BindRenderPass(
   }
 
   vk::RenderPassBeginInfo renderPassInfo{};
-  renderPassInfo.renderPass = m_renderpass.get();
+  renderPassInfo.renderPass = m_renderpass->get();
   renderPassInfo.framebuffer = frameBuffer;
   renderPassInfo.renderArea.offset = vk::Offset2D{ offset.x, offset.y };
   renderPassInfo.renderArea.extent = vk::Extent2D{ extent.x, extent.y };
@@ -541,9 +891,13 @@ void BG::Pipeline::BindRenderPass(
 
   renderPassInfo.setClearValues(clearValues);
 
-  buf.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
+  buf.beginRenderPass(renderPassInfo, contents);
 
-  buf.bindPipeline(vk::PipelineBindPoint::eGraphics, m_pipeline.get());
+  // Secondary command buffers bind their own pipeline. Nothing is bound while an async build is running
+  // without a fallback, CommandBuffer skips the draws.
+  vk::Pipeline pipeline = GetBindablePipeline();
+  if (contents == vk::SubpassContents::eInline && pipeline)
+    buf.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
 }
 
 BG::Pipeline::Pipeline(Renderer& r, vk::Device device)
@@ -567,6 +921,17 @@ BG::Pipeline::Pipeline(Renderer& r, vk::Device device)
   m_multisampling.rasterizationSamples = vk::SampleCountFlagBits::e1;
 }
 
+BG::Pipeline::~Pipeline()
+{
+  // The async build still uses this pipeline's state
+  if (m_buildFuture.valid()) m_buildFuture.wait();
+
+  // Last user of a shared render pass, its handle may be reused by an incompatible one
+  if (m_renderpass && m_renderpass.use_count() == 1) r.getFramebufferCache().InvalidateRenderPass(m_renderpass->get());
+  // Same for the set layout, cached descriptor sets & templates are keyed by it
+  if (m_descriptorSetLayout && m_descriptorSetLayout.use_count() == 1) r.getDescriptorCache().InvalidateSetLayout(m_descriptorSetLayout->get());
+}
+
 void BG::Pipeline::InitBackend()
 {
   if (!glslangInitialized)
@@ -1,21 +1,30 @@
 #pragma once
 
 #include "berkeley_gfx.hpp"
+#include "shader_cache.hpp"
 
 #include <vulkan/vulkan.hpp>
 
+#include <atomic>
+#include <future>
+#include <map>
+
 namespace BG
 {
   static bool glslangInitialized = false;
 
+  // Building distinct Pipelines (Add*Shaders, BuildPipeline) from different threads is safe, a single
+  // Pipeline is not thread safe
   class Pipeline
   {
   private:
-    vk::UniqueShaderModule AddShaders(std::string shaders, int shaderType);
+    std::shared_ptr<vk::UniqueShaderModule> AddShaders(std::string shaders, int shaderType);
 
     vk::Device m_device;
 
     Renderer& r;
+
+    std::string m_name;
     
     vk::Viewport m_viewport;
     vk::Rect2D   m_scissor;
@@ -26,19 +35,25 @@ namespace BG
     vk::PipelineRasterizationStateCreateInfo       m_rasterizer;
     vk::PipelineMultisampleStateCreateInfo         m_multisampling;
 
-    std::vector<vk::UniqueShaderModule>            m_shaderModules;
+    std::vector<std::shared_ptr<vk::UniqueShaderModule>> m_shaderModules;
     std::vector<vk::PipelineShaderStageCreateInfo> m_stageCreateInfos;
     std::vector<vk::AttachmentDescription>         m_attachments;
 
     vk::AttachmentDescription m_depthAttachment;
     bool m_useDepthAttachment = false;
 
-    vk::UniqueDescriptorSetLayout m_descriptorSetLayout;
-    vk::UniquePipelineLayout      m_layout;
-    vk::UniqueRenderPass          m_renderpass;
-    vk::UniquePipeline            m_pipeline;
+    // Shared with identical pipelines through the renderer's PipelineObjectCache
+    std::shared_ptr<vk::UniqueDescriptorSetLayout> m_descriptorSetLayout;
+    std::shared_ptr<vk::UniquePipelineLayout>      m_layout;
+    std::shared_ptr<vk::UniqueRenderPass>          m_renderpass;
+    std::shared_ptr<vk::UniquePipeline>            m_pipeline;
     
-    bool m_created = false;
+    bool m_created = false;          // Layouts & render pass
+    std::atomic<bool> m_ready{ false }; // Pipeline object
+    bool m_isCompute = false;
+
+    std::shared_future<void> m_buildFuture;
+    Pipeline* m_fallback = nullptr;
 
     std::vector<vk::VertexInputBindingDescription> m_bindingDescriptions;
     std::vector<vk::VertexInputAttributeDescription> m_attributeDescriptions;
@@ -46,7 +61,19 @@ namespace BG
     std::vector<vk::DescriptorBindingFlags> m_descSetLayoutBindingFlags;
     std::vector<vk::PushConstantRange> m_pushConstants;
 
+    // Set 0 is created from the reflected bindings, higher sets are owned elsewhere (e.g. the texture table)
+    std::vector<vk::DescriptorSetLayout> m_externalSetLayouts;
+    uint32_t m_numDescSets = 1;
+
+    std::vector<int> m_dynamicUniformBindings;
+    std::map<int, std::vector<vk::Sampler>> m_immutableSamplers; // By binding, one per array element
+
+    // Compiles through the renderer's ShaderCache, and applies the reflection to this pipeline
+    void CreateLayouts();
+    void CreatePipelineObject();
+
     std::vector<uint32_t> BuildProgramFromSrc(std::string shaders, int shaderType);
+    void ApplyReflection(const ShaderCache::CompiledShader& shader);
     
     std::unordered_map<std::string, uint32_t> m_name2bindings;
     std::unordered_map<std::string, uint32_t> m_memberOffsets;
@@ -55,6 +82,8 @@ namespace BG
   public:
     void AddFragmentShaders(std::string shaders);
     void AddVertexShaders(std::string shaders);
+    // Makes this a compute pipeline, it can not have other stages or attachments
+    void AddComputeShaders(std::string shaders);
 
     template <class T> VertexBufferBinding AddVertexBuffer(bool perVertex = true)
     {
@@ -74,34 +103,74 @@ namespace BG
 
     void AddDescriptorUniform(int binding, vk::ShaderStageFlags stage, int count = 1, bool unbound = false);
     void AddDescriptorTexture(int binding, vk::ShaderStageFlags stage, int count = 1, bool unbound = false);
+    void AddDescriptorStorageBuffer(int binding, vk::ShaderStageFlags stage, int count = 1);
+    void AddDescriptorStorageImage(int binding, vk::ShaderStageFlags stage, int count = 1);
 
     void AddPushConstant(uint32_t offset, uint32_t size, vk::ShaderStageFlags stage);
 
+    // Layout of descriptor set `set` (> 0), which the pipeline doesn't create or allocate. Every set used
+    // by the shaders other than 0 needs one, e.g. TextureSystem::GetDescSetLayout()
+    void SetExternalDescSetLayout(uint32_t set, vk::DescriptorSetLayout layout);
+
+    // Declares a reflected uniform buffer as eUniformBufferDynamic, e.g. for the renderer's UniformRing.
+    // Its offset is passed when binding the descriptor set.
+    inline void SetDynamicUniformBuffer(int binding) { m_dynamicUniformBindings.push_back(binding); }
+
+    // Bakes `sampler` into the layout for every element of a reflected combined image sampler binding, e.g. one
+    // from SamplerCache. Descriptor writes then only need the view, the sampler they pass is ignored.
+    inline void SetImmutableSampler(int binding, vk::Sampler sampler) { m_immutableSamplers[binding] = { sampler }; }
+
     void SetViewport(float width, float height, float x = 0.0, float y = 0.0, float minDepth = 0.0f, float maxDepth = 1.0f);
     void SetScissor(int x, int y, int width, int height);
 
     void AddAttachment(vk::Format format, vk::ImageLayout initialLayout, vk::ImageLayout finalLayout, vk::SampleCountFlagBits samples = vk::SampleCountFlagBits::e1);
     void AddDepthAttachment(vk::ImageLayout initialLayout = vk::ImageLayout::eUndefined, vk::ImageLayout finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
+    // Labels pipeline cache feedback and the render pass profiler zones
+    inline void SetName(std::string name) { m_name = name; }
+    inline const std::string& GetName() const { return m_name; }
+
     void BuildPipeline();
 
+    // Creates the layouts & render pass right away, and the pipeline object on the renderer's worker pool.
+    // Descriptor sets, push constants and render passes can be used immediately. Until the future is ready
+    // CommandBuffer binds the fallback pipeline, or skips the draws / dispatches without one. The pipeline
+    // must not be modified until then.
+    std::shared_future<void> BuildPipelineAsync();
+
+    // Bound while this pipeline is still building, must have a compatible layout & render pass
+    inline void SetFallback(Pipeline* fallback) { m_fallback = fallback; }
+    inline bool IsReady() const { return m_ready.load(std::memory_order_acquire); }
+    // This pipeline, or the fallback while building, or null
+    vk::Pipeline GetBindablePipeline();
+
     vk::DescriptorSet AllocDescSet(vk::DescriptorPool pool, int variableDescriptorCount = 0);
+    // Per-frame set, e.g. from `ctx.descAllocator`
+    vk::DescriptorSet AllocDescSet(DescriptorAllocator& allocator, int variableDescriptorCount = 0);
 
     void BindGraphicsUniformBuffer(Pipeline& p, vk::DescriptorSet descSet, const BG::Buffer& buffer, uint32_t offset, uint32_t range, int binding, int arrayElement = 0);
     void BindGraphicsImageView(Pipeline& p, vk::DescriptorSet descSet, vk::ImageView view, vk::ImageLayout layout, vk::Sampler sampler, int binding, int arrayElement = 0);
+    void BindStorageBuffer(vk::DescriptorSet descSet, const BG::Buffer& buffer, vk::DeviceSize offset, vk::DeviceSize range, int binding, int arrayElement = 0);
+    void BindStorageImage(vk::DescriptorSet descSet, vk::ImageView view, int binding, int arrayElement = 0);
 
     vk::RenderPass GetRenderPass();
     vk::Pipeline GetPipeline();
     vk::PipelineLayout GetLayout();
+    vk::DescriptorSetLayout GetDescSetLayout();
+    inline const std::vector<vk::DescriptorSetLayoutBinding>& GetDescSetLayoutBindings() const { return m_descSetLayoutBindings; }
+    inline const std::vector<vk::DescriptorBindingFlags>& GetDescSetLayoutBindingFlags() const { return m_descSetLayoutBindingFlags; }
+    inline bool IsCompute() const { return m_isCompute; }
 
     void BindRenderPass(
       vk::CommandBuffer& buf,
       vk::Framebuffer& frameBuffer,
       glm::uvec2 extent,
       glm::vec4 clearColor = glm::vec4(1.0),
-      glm::ivec2 offset = glm::ivec2(0));
+      glm::ivec2 offset = glm::ivec2(0),
+      vk::SubpassContents contents = vk::SubpassContents::eInline);
 
     Pipeline(Renderer& r, vk::Device device);
+    ~Pipeline();
 
     static void InitBackend();
   };
@@ -0,0 +1,73 @@
+#include "sampler_cache.hpp"
+
+#include <algorithm>
+
+using namespace BG;
+
+bool BG::SamplerDesc::operator==(const SamplerDesc& other) const
+{
+  return magFilter == other.magFilter && minFilter == other.minFilter && mipmapMode == other.mipmapMode &&
+    addressU == other.addressU && addressV == other.addressV && addressW == other.addressW &&
+    maxAnisotropy == other.maxAnisotropy && mipLodBias == other.mipLodBias && minLod == other.minLod && maxLod == other.maxLod &&
+    compareOp == other.compareOp && borderColor == other.borderColor;
+}
+
+size_t BG::SamplerCache::DescHash::operator()(const SamplerDesc& desc) const
+{
+  size_t hash = 0;
+
+  auto combine = [&](size_t value) { hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2); };
+
+  combine(size_t(desc.magFilter));
+  combine(size_t(desc.minFilter));
+  combine(size_t(desc.mipmapMode));
+  combine(size_t(desc.addressU));
+  combine(size_t(desc.addressV));
+  combine(size_t(desc.addressW));
+  combine(std::hash<float>()(desc.maxAnisotropy));
+  combine(std::hash<float>()(desc.mipLodBias));
+  combine(std::hash<float>()(desc.minLod));
+  combine(std::hash<float>()(desc.maxLod));
+  combine(size_t(desc.compareOp));
+  combine(size_t(desc.borderColor));
+
+  return hash;
+}
+
+vk::Sampler BG::SamplerCache::Get(const SamplerDesc& desc)
+{
+  // Requests above the device limit share the clamped sampler
+  SamplerDesc key = desc;
+  key.maxAnisotropy = std::clamp(desc.maxAnisotropy, 1.0f, m_maxAnisotropy);
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  auto it = m_samplers.find(key);
+  if (it != m_samplers.end()) return it->second.get();
+
+  vk::SamplerCreateInfo samplerInfo;
+  samplerInfo.magFilter = key.magFilter;
+  samplerInfo.minFilter = key.minFilter;
+  samplerInfo.mipmapMode = key.mipmapMode;
+  samplerInfo.addressModeU = key.addressU;
+  samplerInfo.addressModeV = key.addressV;
+  samplerInfo.addressModeW = key.addressW;
+  samplerInfo.anisotropyEnable = key.maxAnisotropy > 1.0f;
+  samplerInfo.maxAnisotropy = key.maxAnisotropy;
+  samplerInfo.mipLodBias = key.mipLodBias;
+  samplerInfo.minLod = key.minLod;
+  samplerInfo.maxLod = key.maxLod;
+  samplerInfo.compareEnable = key.compareOp != vk::CompareOp::eNever;
+  samplerInfo.compareOp = key.compareOp;
+  samplerInfo.borderColor = key.borderColor;
+
+  auto& sampler = m_samplers[key];
+  sampler = m_device.createSamplerUnique(samplerInfo);
+
+  return sampler.get();
+}
+
+BG::SamplerCache::SamplerCache(vk::Device device, float maxAnisotropy)
+  : m_device(device), m_maxAnisotropy(std::max(maxAnisotropy, 1.0f))
+{
+}
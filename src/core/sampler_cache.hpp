@@ -0,0 +1,59 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace BG
+{
+
+  struct SamplerDesc
+  {
+    vk::Filter magFilter = vk::Filter::eLinear;
+    vk::Filter minFilter = vk::Filter::eLinear;
+    vk::SamplerMipmapMode mipmapMode = vk::SamplerMipmapMode::eLinear;
+    vk::SamplerAddressMode addressU = vk::SamplerAddressMode::eRepeat;
+    vk::SamplerAddressMode addressV = vk::SamplerAddressMode::eRepeat;
+    vk::SamplerAddressMode addressW = vk::SamplerAddressMode::eRepeat;
+    // 1 disables anisotropic filtering, clamped to the device limit
+    float maxAnisotropy = 1.0f;
+    float mipLodBias = 0.0f;
+    float minLod = 0.0f;
+    float maxLod = VK_LOD_CLAMP_NONE;
+    // Depth comparison for shadow maps, disabled with eNever
+    vk::CompareOp compareOp = vk::CompareOp::eNever;
+    vk::BorderColor borderColor = vk::BorderColor::eFloatTransparentBlack;
+
+    bool operator==(const SamplerDesc& other) const;
+  };
+
+  // One vk::Sampler per distinct SamplerDesc, shared by every texture and pipeline asking for it. Samplers live
+  // as long as the cache, there are only ever a handful of distinct ones.
+  class SamplerCache
+  {
+  private:
+    struct DescHash
+    {
+      size_t operator()(const SamplerDesc& desc) const;
+    };
+
+    vk::Device m_device;
+    float m_maxAnisotropy; // 1 without the samplerAnisotropy feature
+
+    std::unordered_map<SamplerDesc, vk::UniqueSampler, DescHash> m_samplers;
+    std::mutex m_mutex;
+
+  public:
+    // Thread safe
+    vk::Sampler Get(const SamplerDesc& desc);
+
+    inline float GetMaxAnisotropy() const { return m_maxAnisotropy; }
+    inline size_t GetSize() const { return m_samplers.size(); }
+
+    SamplerCache(vk::Device device, float maxAnisotropy);
+  };
+
+}
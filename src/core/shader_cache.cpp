@@ -0,0 +1,321 @@
+#include "shader_cache.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+using namespace BG;
+
+static const uint32_t SHADER_CACHE_MAGIC = 0x43534742; // "BGSC"
+static const uint32_t SHADER_CACHE_VERSION = 2;
+
+namespace
+{
+  // Minimal binary (de)serialization of the cache files, no versioning beyond the file header
+  struct Writer
+  {
+    std::ofstream& f;
+
+    void U32(uint32_t v) { f.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void Str(const std::string& s) { U32(uint32_t(s.size())); f.write(s.data(), s.size()); }
+
+    void Members(const std::vector<ShaderCache::Member>& members)
+    {
+      U32(uint32_t(members.size()));
+      for (auto& m : members) { Str(m.name); U32(m.offset); }
+    }
+  };
+
+  struct Reader
+  {
+    std::ifstream& f;
+    size_t remaining; // Bytes left in the file
+    bool bad = false;
+
+    void Read(void* data, size_t size)
+    {
+      if (size > remaining) { bad = true; return; }
+      f.read(reinterpret_cast<char*>(data), size);
+      remaining -= size;
+    }
+
+    uint32_t U32() { uint32_t v = 0; Read(&v, sizeof(v)); return v; }
+
+    // An element count, checked against what's left of the file before anything is allocated for it
+    size_t Count(size_t minElementSize)
+    {
+      size_t count = U32();
+      if (count > remaining / minElementSize) { bad = true; return 0; }
+      return count;
+    }
+
+    std::string Str()
+    {
+      std::string s(Count(1), '\0');
+      Read(s.data(), s.size());
+      return s;
+    }
+
+    std::vector<ShaderCache::Member> Members()
+    {
+      // Name length and offset
+      std::vector<ShaderCache::Member> members(Count(2 * sizeof(uint32_t)));
+      for (auto& m : members) { m.name = Str(); m.offset = U32(); }
+      return members;
+    }
+  };
+}
+
+ShaderCache::Key BG::ShaderCache::MakeKey(const std::string& source, int shaderType, const std::string& options)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  auto mix = [&](const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ull;
+    }
+  };
+
+  mix(source.data(), source.size());
+  mix(&shaderType, sizeof(shaderType));
+  mix(options.data(), options.size());
+
+  return hash;
+}
+
+std::string BG::ShaderCache::GetPath(Key key) const
+{
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.spvc", (unsigned long long)(key));
+  return (std::filesystem::path(m_directory) / name).string();
+}
+
+std::shared_ptr<const ShaderCache::CompiledShader> BG::ShaderCache::Load(Key key)
+{
+  if (m_directory.empty()) return nullptr;
+
+  std::ifstream f(GetPath(key), std::ios::binary | std::ios::ate);
+  if (!f) return nullptr;
+
+  std::streamoff size = f.tellg();
+  if (size < 0) return nullptr;
+  f.seekg(0);
+
+  Reader r{ f, size_t(size) };
+
+  if (r.U32() != SHADER_CACHE_MAGIC || r.U32() != SHADER_CACHE_VERSION) return nullptr;
+
+  // The key is repeated in the file, a renamed / clashing file is a miss
+  uint32_t keyLo = r.U32(), keyHi = r.U32();
+  if ((uint64_t(keyHi) << 32 | keyLo) != key) return nullptr;
+
+  auto shader = std::make_shared<CompiledShader>();
+
+  shader->spirv.resize(r.Count(sizeof(uint32_t)));
+  r.Read(shader->spirv.data(), shader->spirv.size() * sizeof(uint32_t));
+  shader->stage = r.U32();
+
+  // Name length, six fields and the member count
+  shader->bindings.resize(r.Count(8 * sizeof(uint32_t)));
+  for (auto& b : shader->bindings)
+  {
+    b.name = r.Str();
+    b.set = r.U32();
+    b.binding = r.U32();
+    b.descriptorType = r.U32();
+    b.unbounded = r.U32() != 0;
+    b.isBlock = r.U32() != 0;
+    b.blockSize = r.U32();
+    b.members = r.Members();
+  }
+
+  // Offset, size and the member count
+  shader->pushConstants.resize(r.Count(3 * sizeof(uint32_t)));
+  for (auto& p : shader->pushConstants)
+  {
+    p.offset = r.U32();
+    p.size = r.U32();
+    p.members = r.Members();
+  }
+
+  if (!f || r.bad)
+  {
+    spdlog::warn("Shader cache file {} is corrupted, ignoring", GetPath(key));
+    return nullptr;
+  }
+
+  return shader;
+}
+
+void BG::ShaderCache::Store(Key key, const CompiledShader& shader)
+{
+  if (m_directory.empty()) return;
+
+  // Written under a temporary name, so concurrent processes never read a partial file
+  std::string path = GetPath(key);
+  std::string tmpPath = path + ".tmp";
+
+  {
+    std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!f)
+    {
+      spdlog::warn("Failed to open {} for writing", tmpPath);
+      return;
+    }
+
+    Writer w{ f };
+
+    w.U32(SHADER_CACHE_MAGIC);
+    w.U32(SHADER_CACHE_VERSION);
+    w.U32(uint32_t(key));
+    w.U32(uint32_t(key >> 32));
+
+    w.U32(uint32_t(shader.spirv.size()));
+    f.write(reinterpret_cast<const char*>(shader.spirv.data()), shader.spirv.size() * sizeof(uint32_t));
+    w.U32(shader.stage);
+
+    w.U32(uint32_t(shader.bindings.size()));
+    for (auto& b : shader.bindings)
+    {
+      w.Str(b.name);
+      w.U32(b.set);
+      w.U32(b.binding);
+      w.U32(b.descriptorType);
+      w.U32(b.unbounded);
+      w.U32(b.isBlock);
+      w.U32(b.blockSize);
+      w.Members(b.members);
+    }
+
+    w.U32(uint32_t(shader.pushConstants.size()));
+    for (auto& p : shader.pushConstants)
+    {
+      w.U32(p.offset);
+      w.U32(p.size);
+      w.Members(p.members);
+    }
+
+    if (!f)
+    {
+      spdlog::warn("Failed to write {}", tmpPath);
+      return;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmpPath, path, ec);
+  if (ec) spdlog::warn("Failed to move {} to {}: {}", tmpPath, path, ec.message());
+}
+
+std::shared_ptr<const ShaderCache::CompiledShader> BG::ShaderCache::Find(Key key)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  auto it = m_shaders.find(key);
+  if (it != m_shaders.end())
+  {
+    m_hits++;
+    return it->second;
+  }
+
+  auto shader = Load(key);
+  if (shader)
+  {
+    m_hits++;
+    m_shaders[key] = shader;
+  }
+  else
+  {
+    m_misses++;
+  }
+
+  return shader;
+}
+
+std::shared_ptr<const ShaderCache::CompiledShader> BG::ShaderCache::Insert(Key key, CompiledShader shader)
+{
+  auto entry = std::make_shared<const CompiledShader>(std::move(shader));
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  // Another thread may have compiled the same source meanwhile, keep the first one
+  auto result = m_shaders.emplace(key, entry);
+  if (result.second) Store(key, *entry);
+
+  return result.first->second;
+}
+
+std::shared_ptr<const ShaderCache::CompiledShader> BG::ShaderCache::GetOrCompile(Key key, std::function<CompiledShader()> compile)
+{
+  std::promise<std::shared_ptr<const CompiledShader>> promise;
+
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+
+    auto it = m_shaders.find(key);
+    if (it != m_shaders.end())
+    {
+      m_hits++;
+      return it->second;
+    }
+
+    auto compiling = m_compiling.find(key);
+    if (compiling != m_compiling.end())
+    {
+      auto future = compiling->second;
+      lk.unlock();
+      m_hits++;
+      return future.get();
+    }
+
+    auto shader = Load(key);
+    if (shader)
+    {
+      m_hits++;
+      m_shaders[key] = shader;
+      return shader;
+    }
+
+    m_misses++;
+    m_compiling[key] = promise.get_future().share();
+  }
+
+  try
+  {
+    auto shader = Insert(key, compile());
+    promise.set_value(shader);
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_compiling.erase(key);
+
+    return shader;
+  }
+  catch (...)
+  {
+    // Waiters see the same error, the next request retries
+    promise.set_exception(std::current_exception());
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_compiling.erase(key);
+
+    throw;
+  }
+}
+
+BG::ShaderCache::ShaderCache(std::string directory)
+  : m_directory(directory)
+{
+  if (m_directory.empty()) return;
+
+  std::error_code ec;
+  std::filesystem::create_directories(m_directory, ec);
+  if (ec)
+  {
+    spdlog::warn("Can not create shader cache directory {} ({}), caching in memory only", m_directory, ec.message());
+    m_directory.clear();
+  }
+}
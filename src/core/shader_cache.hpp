@@ -0,0 +1,86 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Content addressed cache of compiled shaders: SPIR-V plus the reflection the Pipeline needs, so that a hit
+  // skips glslang and SPIRV-Reflect. Kept in memory, and in a directory on disk when one is given.
+  class ShaderCache
+  {
+  public:
+    struct Member
+    {
+      std::string name;
+      uint32_t offset;
+    };
+
+    struct DescriptorBinding
+    {
+      std::string name;
+      uint32_t set;
+      uint32_t binding;
+      uint32_t descriptorType; // SpvReflectDescriptorType
+      bool unbounded;
+      bool isBlock;
+      uint32_t blockSize;
+      std::vector<Member> members;
+    };
+
+    struct PushConstantBlock
+    {
+      uint32_t offset;
+      uint32_t size;
+      std::vector<Member> members;
+    };
+
+    struct CompiledShader
+    {
+      std::vector<uint32_t> spirv;
+      uint32_t stage; // vk::ShaderStageFlags
+      std::vector<DescriptorBinding> bindings;
+      std::vector<PushConstantBlock> pushConstants;
+    };
+
+    using Key = uint64_t;
+
+  private:
+    std::string m_directory;
+
+    std::unordered_map<Key, std::shared_ptr<const CompiledShader>> m_shaders;
+    // Compiles in progress, so concurrent requests for the same source compile it once
+    std::unordered_map<Key, std::shared_future<std::shared_ptr<const CompiledShader>>> m_compiling;
+    std::mutex m_mutex;
+
+    std::atomic<uint32_t> m_hits{ 0 }, m_misses{ 0 };
+
+    std::string GetPath(Key key) const;
+    std::shared_ptr<const CompiledShader> Load(Key key);
+    void Store(Key key, const CompiledShader& shader);
+
+  public:
+    // `options` must capture every compiler setting that changes the output
+    static Key MakeKey(const std::string& source, int shaderType, const std::string& options);
+
+    // Thread safe, nullptr on a miss
+    std::shared_ptr<const CompiledShader> Find(Key key);
+    std::shared_ptr<const CompiledShader> Insert(Key key, CompiledShader shader);
+
+    // Thread safe. Runs `compile` on a miss, other threads asking for the same key meanwhile wait for it
+    std::shared_ptr<const CompiledShader> GetOrCompile(Key key, std::function<CompiledShader()> compile);
+
+    inline uint32_t GetHits() const { return m_hits; }
+    inline uint32_t GetMisses() const { return m_misses; }
+
+    // Empty directory = memory only
+    ShaderCache(std::string directory);
+  };
+
+}
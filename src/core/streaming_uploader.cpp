@@ -0,0 +1,371 @@
+#include "streaming_uploader.hpp"
+#include "buffer.hpp"
+#include "fence_pool.hpp"
+
+using namespace BG;
+
+BG::StreamingUploader::Ticket BG::StreamingUploader::Enqueue(Request request, const uint8_t* data)
+{
+  request.staging = m_stagingPool.Acquire(request.size);
+  uint8_t* stagingGPU = request.staging.buffer->Map<uint8_t>();
+  std::copy(data, data + request.size, stagingGPU);
+  request.staging.buffer->UnMap();
+
+  Ticket ticket = request.promise.get_future().share();
+
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_pending.push_back(std::move(request));
+
+  return ticket;
+}
+
+BG::StreamingUploader::Ticket BG::StreamingUploader::UploadImage(
+  Image& image, glm::uvec2 extent, const uint8_t* data, size_t size,
+  vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  return UploadImageMips(image, extent, 1, TexelBlock(), data, size, finalLayout, dstStage, dstAccess);
+}
+
+BG::StreamingUploader::Ticket BG::StreamingUploader::UploadImageMips(
+  Image& image, glm::uvec2 extent, uint32_t mipLevels, TexelBlock block, const uint8_t* data, size_t size,
+  vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  Request request;
+  request.image = &image;
+  request.extent = extent;
+  request.mipLevels = mipLevels;
+  request.block = block;
+  request.finalLayout = finalLayout;
+  request.size = size;
+  request.dstStage = dstStage;
+  request.dstAccess = dstAccess;
+
+  return Enqueue(std::move(request), data);
+}
+
+BG::StreamingUploader::Ticket BG::StreamingUploader::UploadBuffer(
+  Buffer& buffer, vk::DeviceSize dstOffset, const uint8_t* data, size_t size,
+  vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  Request request;
+  request.buffer = &buffer;
+  request.dstOffset = dstOffset;
+  request.size = size;
+  request.dstStage = dstStage;
+  request.dstAccess = dstAccess;
+
+  return Enqueue(std::move(request), data);
+}
+
+void BG::StreamingUploader::RecordCopy(vk::CommandBuffer cmdBuf, Request& request)
+{
+  // Release to the graphics family, or just make the copy available to the semaphore signal
+  uint32_t srcFamily = m_ownershipTransfer ? m_transferFamily : VK_QUEUE_FAMILY_IGNORED;
+  uint32_t dstFamily = m_ownershipTransfer ? m_graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+
+  if (request.image)
+  {
+    vk::ImageMemoryBarrier barrier;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = request.image->image;
+    barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, request.mipLevels, 0, 1 };
+    barrier.oldLayout = vk::ImageLayout::eUndefined;
+    barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.srcAccessMask = {};
+    barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    std::vector<vk::BufferImageCopy> copies;
+    vk::DeviceSize offset = 0;
+    for (uint32_t level = 0; level < request.mipLevels; level++)
+    {
+      glm::uvec2 extent = glm::max(request.extent >> level, glm::uvec2(1));
+
+      vk::BufferImageCopy copy;
+      copy.bufferOffset = offset;
+      copy.bufferRowLength = (extent.x + request.block.width - 1) / request.block.width * request.block.width;
+      copy.bufferImageHeight = (extent.y + request.block.height - 1) / request.block.height * request.block.height;
+      copy.imageSubresource = { vk::ImageAspectFlagBits::eColor, level, 0, 1 };
+      copy.imageExtent = vk::Extent3D{ extent.x, extent.y, 1 };
+      copies.push_back(copy);
+
+      offset += request.block.ImageSize(extent);
+    }
+
+    cmdBuf.copyBufferToImage(request.staging.buffer->buffer, request.image->image, vk::ImageLayout::eTransferDstOptimal, copies);
+
+    barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.newLayout = request.finalLayout;
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    barrier.dstAccessMask = {};
+    barrier.srcQueueFamilyIndex = srcFamily;
+    barrier.dstQueueFamilyIndex = dstFamily;
+
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, 0, nullptr, 0, nullptr, 1, &barrier);
+  }
+  else
+  {
+    vk::BufferCopy copy{ 0, request.dstOffset, request.size };
+    cmdBuf.copyBuffer(request.staging.buffer->buffer, request.buffer->buffer, 1, &copy);
+
+    vk::BufferMemoryBarrier barrier;
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    barrier.dstAccessMask = {};
+    barrier.srcQueueFamilyIndex = srcFamily;
+    barrier.dstQueueFamilyIndex = dstFamily;
+    barrier.buffer = request.buffer->buffer;
+    barrier.offset = request.dstOffset;
+    barrier.size = request.size;
+
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, 0, nullptr, 1, &barrier, 0, nullptr);
+  }
+}
+
+void BG::StreamingUploader::RecordAcquire(vk::CommandBuffer cmdBuf, Request& request)
+{
+  // Mirrors the release in RecordCopy. The graphics submit waits on the timeline at every request's dstStage,
+  // so starting the barrier's first scope there orders the layout transition after the transfer.
+  if (request.image)
+  {
+    vk::ImageMemoryBarrier barrier;
+    barrier.srcQueueFamilyIndex = m_transferFamily;
+    barrier.dstQueueFamilyIndex = m_graphicsFamily;
+    barrier.image = request.image->image;
+    barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, request.mipLevels, 0, 1 };
+    barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.newLayout = request.finalLayout;
+    barrier.srcAccessMask = {};
+    barrier.dstAccessMask = request.dstAccess;
+
+    cmdBuf.pipelineBarrier(request.dstStage, request.dstStage, {}, 0, nullptr, 0, nullptr, 1, &barrier);
+  }
+  else
+  {
+    vk::BufferMemoryBarrier barrier;
+    barrier.srcAccessMask = {};
+    barrier.dstAccessMask = request.dstAccess;
+    barrier.srcQueueFamilyIndex = m_transferFamily;
+    barrier.dstQueueFamilyIndex = m_graphicsFamily;
+    barrier.buffer = request.buffer->buffer;
+    barrier.offset = request.dstOffset;
+    barrier.size = request.size;
+
+    cmdBuf.pipelineBarrier(request.dstStage, request.dstStage, {}, 0, nullptr, 1, &barrier, 0, nullptr);
+  }
+}
+
+void BG::StreamingUploader::SubmitBatch(size_t budget)
+{
+  std::vector<Request> requests;
+
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    // A request larger than the budget still goes out, on its own
+    size_t bytes = 0;
+    while (!m_pending.empty() && (requests.empty() || bytes + m_pending.front().size <= budget))
+    {
+      bytes += m_pending.front().size;
+      requests.push_back(std::move(m_pending.front()));
+      m_pending.pop_front();
+    }
+  }
+
+  if (requests.empty()) return;
+
+  vk::UniqueCommandBuffer cmdBuf;
+  if (!m_freeCmdBufs.empty())
+  {
+    cmdBuf = std::move(m_freeCmdBufs.back());
+    m_freeCmdBufs.pop_back();
+  }
+  else
+  {
+    cmdBuf = std::move(m_device.allocateCommandBuffersUnique({ m_transferCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]);
+  }
+
+  cmdBuf->begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+  for (auto& request : requests) RecordCopy(cmdBuf.get(), request);
+  cmdBuf->end();
+
+  uint64_t serial = ++m_lastSerial;
+  vk::Semaphore timeline = m_timeline.get();
+  vk::CommandBuffer buf = cmdBuf.get();
+
+  vk::TimelineSemaphoreSubmitInfo timelineInfo;
+  timelineInfo.setSignalSemaphoreValues(serial);
+
+  vk::SubmitInfo submitInfo;
+  submitInfo.setCommandBuffers(buf);
+  submitInfo.setSignalSemaphores(timeline);
+  submitInfo.setPNext(&timelineInfo);
+
+  if (m_transferQueue.submit(1, &submitInfo, nullptr) != vk::Result::eSuccess)
+  {
+    spdlog::error("StreamingUploader: transfer submit failed");
+    throw std::runtime_error("Transfer submit failed");
+  }
+
+  m_inFlight.push_back({ serial, std::move(cmdBuf), std::move(requests) });
+}
+
+std::vector<BG::StreamingUploader::Batch> BG::StreamingUploader::TakeCompleted(uint64_t completedSerial)
+{
+  std::vector<Batch> completed;
+
+  while (!m_inFlight.empty() && m_inFlight.front().serial <= completedSerial)
+  {
+    completed.push_back(std::move(m_inFlight.front()));
+    m_inFlight.pop_front();
+  }
+
+  return completed;
+}
+
+void BG::StreamingUploader::Retire(Batch& batch)
+{
+  for (auto& request : batch.requests)
+  {
+    request.promise.set_value();
+    m_stagingPool.Release(std::move(request.staging));
+  }
+  m_freeCmdBufs.push_back(std::move(batch.cmdBuf));
+}
+
+BG::StreamingUploader::FrameSync BG::StreamingUploader::NewFrame(int frameIndex)
+{
+  FrameSync sync;
+
+  auto completed = TakeCompleted(m_device.getSemaphoreCounterValue(m_timeline.get()));
+
+  if (!completed.empty())
+  {
+    sync.waitValue = completed.back().serial;
+
+    for (auto& batch : completed)
+      for (auto& request : batch.requests) sync.waitStage |= request.dstStage;
+
+    if (m_ownershipTransfer)
+    {
+      auto cmdBuf = m_acquireCmdBufs[frameIndex].get();
+
+      cmdBuf.begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+      for (auto& batch : completed)
+        for (auto& request : batch.requests) RecordAcquire(cmdBuf, request);
+      cmdBuf.end();
+
+      sync.acquireCmdBuf = cmdBuf;
+    }
+
+    // Everything recorded from now on is submitted after the acquire / wait
+    for (auto& batch : completed) Retire(batch);
+  }
+
+  SubmitBatch(m_budget);
+
+  return sync;
+}
+
+void BG::StreamingUploader::Flush()
+{
+  while (true)
+  {
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (m_pending.empty()) break;
+    }
+
+    SubmitBatch(SIZE_MAX);
+  }
+
+  if (m_inFlight.empty()) return;
+
+  uint64_t waitValue = m_lastSerial;
+  auto completed = TakeCompleted(waitValue);
+
+  auto cmdBuf = std::move(m_device.allocateCommandBuffersUnique({ m_graphicsCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]);
+
+  cmdBuf->begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+  if (m_ownershipTransfer)
+  {
+    for (auto& batch : completed)
+      for (auto& request : batch.requests) RecordAcquire(cmdBuf.get(), request);
+  }
+  cmdBuf->end();
+
+  vk::Semaphore timeline = m_timeline.get();
+  vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eAllCommands;
+  vk::CommandBuffer buf = cmdBuf.get();
+
+  vk::TimelineSemaphoreSubmitInfo timelineInfo;
+  timelineInfo.setWaitSemaphoreValues(waitValue);
+
+  vk::SubmitInfo submitInfo;
+  submitInfo.setWaitSemaphores(timeline);
+  submitInfo.setWaitDstStageMask(waitStage);
+  submitInfo.setCommandBuffers(buf);
+  submitInfo.setPNext(&timelineInfo);
+
+  auto fence = m_fencePool.Acquire();
+
+  if (m_graphicsQueue.submit(1, &submitInfo, fence.get()) != vk::Result::eSuccess ||
+    m_device.waitForFences(1, &fence.get(), true, UINT64_MAX) != vk::Result::eSuccess)
+  {
+    spdlog::error("StreamingUploader: flush failed");
+    throw std::runtime_error("Upload flush failed");
+  }
+
+  m_fencePool.Release(std::move(fence));
+
+  for (auto& batch : completed) Retire(batch);
+}
+
+BG::StreamingUploader::StreamingUploader(
+  vk::Device device, StagingPool& stagingPool, FencePool& fencePool,
+  vk::Queue transferQueue, uint32_t transferFamily,
+  vk::Queue graphicsQueue, uint32_t graphicsFamily,
+  int numFrames, size_t budget)
+  : m_device(device), m_stagingPool(stagingPool), m_fencePool(fencePool),
+  m_transferQueue(transferQueue), m_graphicsQueue(graphicsQueue),
+  m_transferFamily(transferFamily), m_graphicsFamily(graphicsFamily),
+  m_ownershipTransfer(transferFamily != graphicsFamily), m_budget(budget)
+{
+  m_transferCmdPool = m_device.createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, transferFamily });
+  m_graphicsCmdPool = m_device.createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, graphicsFamily });
+
+  for (int i = 0; i < numFrames; i++)
+  {
+    m_acquireCmdBufs.push_back(std::move(m_device.allocateCommandBuffersUnique({ m_graphicsCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]));
+  }
+
+  vk::StructureChain<vk::SemaphoreCreateInfo, vk::SemaphoreTypeCreateInfo> timelineInfo;
+  timelineInfo.get<vk::SemaphoreTypeCreateInfo>().semaphoreType = vk::SemaphoreType::eTimeline;
+  timelineInfo.get<vk::SemaphoreTypeCreateInfo>().initialValue = 0;
+
+  m_timeline = m_device.createSemaphoreUnique(timelineInfo.get<vk::SemaphoreCreateInfo>());
+}
+
+BG::StreamingUploader::~StreamingUploader()
+{
+  // Staging buffers & command buffers of in-flight batches must outlive the transfers
+  if (m_lastSerial > 0)
+  {
+    vk::Semaphore timeline = m_timeline.get();
+
+    vk::SemaphoreWaitInfo waitInfo;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &timeline;
+    waitInfo.pValues = &m_lastSerial;
+
+    if (m_device.waitSemaphores(waitInfo, UINT64_MAX) != vk::Result::eSuccess)
+    {
+      spdlog::error("StreamingUploader: waiting for the uploads in flight failed");
+    }
+  }
+
+  m_inFlight.clear();
+  m_freeCmdBufs.clear();
+  m_acquireCmdBufs.clear();
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+#include "upload_batch.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <atomic>
+#include <deque>
+#include <future>
+#include <mutex>
+
+namespace BG
+{
+
+  // Asynchronous uploads on the transfer queue. Requests can be queued from any thread, the renderer
+  // submits up to a byte budget of them per frame, and hands completed ones over to the graphics queue
+  // (with a queue family ownership transfer when the families differ).
+  class StreamingUploader
+  {
+  public:
+    // Ready once the data is usable by graphics commands recorded from then on
+    using Ticket = std::shared_future<void>;
+
+    // What the graphics submit of a frame needs to pick up completed uploads
+    struct FrameSync
+    {
+      vk::CommandBuffer acquireCmdBuf = nullptr; // Run before the frame's own command buffers
+      uint64_t waitValue = 0;                    // On GetTimeline(), 0 = no wait
+      vk::PipelineStageFlags waitStage;
+    };
+
+  private:
+    struct Request
+    {
+      Image* image = nullptr;
+      glm::uvec2 extent;
+      uint32_t mipLevels = 1;
+      TexelBlock block;
+      vk::ImageLayout finalLayout;
+
+      Buffer* buffer = nullptr;
+      vk::DeviceSize dstOffset = 0;
+
+      StagingPool::Chunk staging;
+      size_t size;
+
+      vk::PipelineStageFlags dstStage;
+      vk::AccessFlags dstAccess;
+
+      std::promise<void> promise;
+    };
+
+    struct Batch
+    {
+      uint64_t serial;
+      vk::UniqueCommandBuffer cmdBuf;
+      std::vector<Request> requests;
+    };
+
+    vk::Device m_device;
+    StagingPool& m_stagingPool;
+    FencePool& m_fencePool;
+
+    vk::Queue m_transferQueue, m_graphicsQueue;
+    uint32_t m_transferFamily, m_graphicsFamily;
+    bool m_ownershipTransfer;
+
+    vk::UniqueCommandPool m_transferCmdPool;
+    vk::UniqueCommandPool m_graphicsCmdPool;
+    std::vector<vk::UniqueCommandBuffer> m_freeCmdBufs;
+    std::vector<vk::UniqueCommandBuffer> m_acquireCmdBufs;
+
+    vk::UniqueSemaphore m_timeline;
+    uint64_t m_lastSerial = 0;
+
+    std::atomic<size_t> m_budget;
+
+    std::deque<Request> m_pending; // Guarded by m_mutex
+    std::mutex m_mutex;
+
+    std::deque<Batch> m_inFlight;
+
+    void SubmitBatch(size_t budget);
+    void RecordCopy(vk::CommandBuffer cmdBuf, Request& request);
+    void RecordAcquire(vk::CommandBuffer cmdBuf, Request& request);
+
+    std::vector<Batch> TakeCompleted(uint64_t completedSerial);
+    void Retire(Batch& batch);
+    Ticket Enqueue(Request request, const uint8_t* data);
+
+  public:
+    // Copy `size` bytes into mip 0 of `image`, which is left in `finalLayout`. The data is staged before
+    // returning. The image must have been created with eTransferDst usage and outlive the upload.
+    Ticket UploadImage(
+      Image& image, glm::uvec2 extent, const uint8_t* data, size_t size,
+      vk::ImageLayout finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    // `mipLevels` mips packed in `data`, as in UploadBatch::UploadImageMips. The transfer queue can't blit,
+    // so mips must be generated beforehand.
+    Ticket UploadImageMips(
+      Image& image, glm::uvec2 extent, uint32_t mipLevels, TexelBlock block, const uint8_t* data, size_t size,
+      vk::ImageLayout finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    Ticket UploadBuffer(
+      Buffer& buffer, vk::DeviceSize dstOffset, const uint8_t* data, size_t size,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eVertexInput,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+
+    // Main thread only. Submits the next batch within budget, and collects the finished ones into
+    // the acquire command buffer of `frameIndex`.
+    FrameSync NewFrame(int frameIndex);
+
+    // Main thread only. Submits everything queued and blocks until it's usable on the graphics queue.
+    void Flush();
+
+    inline void SetBudget(size_t bytesPerFrame) { m_budget = bytesPerFrame; }
+    inline size_t GetBudget() const { return m_budget; }
+    inline vk::Semaphore GetTimeline() const { return m_timeline.get(); }
+
+    StreamingUploader(
+      vk::Device device, StagingPool& stagingPool, FencePool& fencePool,
+      vk::Queue transferQueue, uint32_t transferFamily,
+      vk::Queue graphicsQueue, uint32_t graphicsFamily,
+      int numFrames, size_t budget);
+    ~StreamingUploader();
+  };
+
+}
@@ -0,0 +1,44 @@
+#include "uniform_ring.hpp"
+#include "buffer.hpp"
+
+using namespace BG;
+
+UniformRing::Allocation BG::UniformRing::Alloc(vk::DeviceSize size)
+{
+  vk::DeviceSize alignedSize = (size + m_alignment - 1) & ~(m_alignment - 1);
+  vk::DeviceSize offset = m_head.fetch_add(alignedSize);
+
+  if (offset + size > m_regionSize)
+  {
+    spdlog::error("Uniform ring is out of space ({} bytes per frame), raise Options::uniformRingSizePerFrame", m_regionSize);
+    throw std::runtime_error("Uniform ring out of space");
+  }
+
+  offset += m_currentFrame * m_regionSize;
+
+  return Allocation{ m_mapped + offset, uint32_t(offset) };
+}
+
+void BG::UniformRing::NewFrame(uint32_t frameIndex)
+{
+  m_currentFrame = frameIndex;
+  m_head = 0;
+}
+
+void BG::UniformRing::Flush()
+{
+  vk::DeviceSize used = std::min(m_head.load(), m_regionSize);
+  if (used > 0) m_buffer->Flush(m_currentFrame * m_regionSize, used);
+}
+
+BG::UniformRing::UniformRing(MemoryAllocator& allocator, vk::PhysicalDevice physicalDevice, uint32_t framesInFlight, vk::DeviceSize regionSize)
+{
+  auto limits = physicalDevice.getProperties().limits;
+
+  // Offsets must be aligned, and a region has to start on an aligned offset too
+  m_alignment = std::max<vk::DeviceSize>(limits.minUniformBufferOffsetAlignment, 16);
+  m_regionSize = (regionSize + m_alignment - 1) & ~(m_alignment - 1);
+
+  m_buffer = allocator.AllocMapped(m_regionSize * framesInFlight, vk::BufferUsageFlagBits::eUniformBuffer);
+  m_mapped = m_buffer->Map<uint8_t>();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <atomic>
+
+namespace BG
+{
+
+  // Per-frame constants suballocated from one persistently mapped buffer, split into a region per frame slot.
+  // Allocating is an atomic pointer bump. Bind the buffer once through an eUniformBufferDynamic descriptor
+  // (Pipeline::SetDynamicUniformBuffer), and pass the returned offsets when binding the descriptor set.
+  // Meant for the graphics queue, and the compute queue when it shares the graphics family.
+  class UniformRing
+  {
+  private:
+    std::unique_ptr<Buffer> m_buffer;
+    uint8_t* m_mapped = nullptr;
+
+    vk::DeviceSize m_regionSize;
+    vk::DeviceSize m_alignment;
+
+    uint32_t m_currentFrame = 0;
+    std::atomic<vk::DeviceSize> m_head{ 0 }; // Within the current region
+
+  public:
+    struct Allocation
+    {
+      void* data;
+      uint32_t offset; // Dynamic offset from the start of the buffer
+    };
+
+    // Thread safe, valid for the current frame only
+    Allocation Alloc(vk::DeviceSize size);
+
+    template <class T> uint32_t Push(const T& value)
+    {
+      auto allocation = Alloc(sizeof(T));
+      *static_cast<T*>(allocation.data) = value;
+      return allocation.offset;
+    }
+
+    // Starts filling the region of `frameIndex`. Call once the frame slot is free.
+    void NewFrame(uint32_t frameIndex);
+    // Makes this frame's writes visible to the device, before submitting
+    void Flush();
+
+    inline Buffer& GetBuffer() { return *m_buffer; }
+    inline vk::DeviceSize GetRegionSize() const { return m_regionSize; }
+    inline vk::DeviceSize GetUsed() const { return m_head.load(); }
+
+    UniformRing(MemoryAllocator& allocator, vk::PhysicalDevice physicalDevice, uint32_t framesInFlight, vk::DeviceSize regionSize);
+  };
+
+}
@@ -0,0 +1,373 @@
+#include "upload_batch.hpp"
+#include "buffer.hpp"
+#include "fence_pool.hpp"
+#include "renderer.hpp"
+
+#include <exception>
+
+using namespace BG;
+
+StagingPool::Chunk BG::StagingPool::Acquire(vk::DeviceSize size)
+{
+  vk::DeviceSize chunkSize = MIN_CHUNK_SIZE;
+  while (chunkSize < size) chunkSize *= 2;
+
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    auto it = m_free.find(chunkSize);
+    if (it != m_free.end())
+    {
+      Chunk chunk = std::move(it->second);
+      m_free.erase(it);
+      m_freeBytes -= chunk.size;
+      return chunk;
+    }
+  }
+
+  Chunk chunk;
+  chunk.buffer = m_allocator.AllocMapped(chunkSize, vk::BufferUsageFlagBits::eTransferSrc);
+  chunk.size = chunkSize;
+
+  return chunk;
+}
+
+void BG::StagingPool::Release(Chunk chunk)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  // Dropped when over the limit, e.g. after loading a large scene
+  if (m_freeBytes + chunk.size > m_maxFreeBytes) return;
+
+  m_freeBytes += chunk.size;
+  m_free.emplace(chunk.size, std::move(chunk));
+}
+
+BG::StagingPool::StagingPool(MemoryAllocator& allocator, vk::DeviceSize maxFreeBytes)
+  : m_allocator(allocator), m_maxFreeBytes(maxFreeBytes)
+{
+}
+
+void BG::UploadBatch::CheckRecording()
+{
+  if (m_fence)
+  {
+    spdlog::error("UploadBatch: recording into a submitted batch, call Wait() first");
+    throw std::runtime_error("Recording into a submitted upload batch");
+  }
+}
+
+vk::DeviceSize BG::UploadBatch::Stage(const uint8_t* data, size_t size, vk::Buffer& staging)
+{
+  vk::DeviceSize offset = (m_chunkOffset + STAGING_ALIGNMENT - 1) / STAGING_ALIGNMENT * STAGING_ALIGNMENT;
+
+  if (m_chunks.empty() || offset + size > m_chunks.back().size)
+  {
+    m_chunks.push_back(m_renderer.getStagingPool().Acquire(std::max<vk::DeviceSize>(size, CHUNK_SIZE)));
+    offset = 0;
+  }
+
+  Buffer& chunk = *m_chunks.back().buffer;
+  std::copy(data, data + size, chunk.Map<uint8_t>() + offset);
+
+  m_chunkOffset = offset + size;
+  staging = chunk.buffer;
+
+  return offset;
+}
+
+void BG::UploadBatch::UploadBuffer(
+  Buffer& buffer, vk::DeviceSize dstOffset, const uint8_t* data, size_t size,
+  vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  CheckRecording();
+
+  BufferCopy copy;
+  copy.region.srcOffset = Stage(data, size, copy.src);
+  copy.region.dstOffset = dstOffset;
+  copy.region.size = size;
+  copy.dst = buffer.buffer;
+
+  m_bufferCopies.push_back(copy);
+
+  vk::BufferMemoryBarrier barrier;
+  barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+  barrier.dstAccessMask = dstAccess;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = buffer.buffer;
+  barrier.offset = dstOffset;
+  barrier.size = size;
+
+  m_postBufferBarriers.push_back(barrier);
+  m_dstStages |= dstStage;
+}
+
+uint32_t BG::UploadBatch::FullMipLevels(glm::uvec2 extent)
+{
+  uint32_t levels = 1;
+  for (uint32_t size = std::max(extent.x, extent.y); size > 1; size /= 2) levels++;
+  return levels;
+}
+
+void BG::UploadBatch::UploadImage(
+  Image& image, glm::uvec2 extent, const uint8_t* data, size_t size,
+  vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  UploadImageMips(image, extent, 1, TexelBlock(), data, size, finalLayout, dstStage, dstAccess);
+}
+
+void BG::UploadBatch::UploadImageMips(
+  Image& image, glm::uvec2 extent, uint32_t levels, TexelBlock block, const uint8_t* data, size_t size,
+  vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  CheckRecording();
+
+  vk::Buffer staging;
+  vk::DeviceSize start = Stage(data, size, staging);
+  vk::DeviceSize offset = start;
+
+  for (uint32_t level = 0; level < levels; level++)
+  {
+    glm::uvec2 levelExtent = glm::max(extent >> level, glm::uvec2(1));
+
+    ImageCopy copy;
+    copy.region.bufferOffset = offset;
+    // In texels, whole blocks
+    copy.region.bufferRowLength = (levelExtent.x + block.width - 1) / block.width * block.width;
+    copy.region.bufferImageHeight = (levelExtent.y + block.height - 1) / block.height * block.height;
+    copy.region.imageSubresource = { vk::ImageAspectFlagBits::eColor, level, 0, 1 };
+    copy.region.imageExtent = vk::Extent3D{ levelExtent.x, levelExtent.y, 1 };
+    copy.src = staging;
+    copy.dst = image.image;
+
+    m_imageCopies.push_back(copy);
+
+    offset += block.ImageSize(levelExtent);
+  }
+
+  if (levels > 1 && offset - start > size)
+  {
+    spdlog::error("UploadBatch: {} mips of {}x{} need {} bytes, got {}", levels, extent.x, extent.y, offset - start, size);
+    throw std::runtime_error("Mip data too small");
+  }
+
+  vk::ImageMemoryBarrier barrier;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image.image;
+  barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, levels, 0, 1 };
+  barrier.oldLayout = vk::ImageLayout::eUndefined;
+  barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+  barrier.srcAccessMask = {};
+  barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+
+  m_preBarriers.push_back(barrier);
+
+  barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+  barrier.newLayout = finalLayout;
+  barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+  barrier.dstAccessMask = dstAccess;
+
+  m_postImageBarriers.push_back(barrier);
+  m_dstStages |= dstStage;
+}
+
+void BG::UploadBatch::UploadImageBlitMips(
+  Image& image, glm::uvec2 extent, uint32_t levels, const uint8_t* data, size_t size,
+  vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  if (levels <= 1)
+  {
+    UploadImage(image, extent, data, size, finalLayout, dstStage, dstAccess);
+    return;
+  }
+
+  CheckRecording();
+
+  ImageCopy copy;
+  copy.region.bufferOffset = Stage(data, size, copy.src);
+  copy.region.bufferRowLength = extent.x;
+  copy.region.bufferImageHeight = extent.y;
+  copy.region.imageSubresource = { vk::ImageAspectFlagBits::eColor, 0, 0, 1 };
+  copy.region.imageExtent = vk::Extent3D{ extent.x, extent.y, 1 };
+  copy.dst = image.image;
+
+  m_imageCopies.push_back(copy);
+
+  // Every level is a blit destination first
+  vk::ImageMemoryBarrier barrier;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image.image;
+  barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, levels, 0, 1 };
+  barrier.oldLayout = vk::ImageLayout::eUndefined;
+  barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+  barrier.srcAccessMask = {};
+  barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+
+  m_preBarriers.push_back(barrier);
+
+  m_blitChains.push_back({ image.image, extent, levels, finalLayout, dstAccess });
+  m_dstStages |= dstStage;
+}
+
+void BG::UploadBatch::Transition(Image& image, vk::ImageLayout newLayout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+  CheckRecording();
+
+  vk::ImageMemoryBarrier barrier;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image.image;
+  barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+  barrier.oldLayout = vk::ImageLayout::eUndefined;
+  barrier.newLayout = newLayout;
+  barrier.srcAccessMask = {};
+  barrier.dstAccessMask = dstAccess;
+
+  m_postImageBarriers.push_back(barrier);
+  m_dstStages |= dstStage;
+}
+
+void BG::UploadBatch::Submit()
+{
+  CheckRecording();
+
+  if (IsEmpty()) return;
+
+  for (auto& chunk : m_chunks) chunk.buffer->Flush();
+
+  if (!m_cmdBuf) m_cmdBuf = m_renderer.AllocCmdBuffer();
+
+  vk::CommandBuffer cmdBuf = m_cmdBuf.get();
+
+  cmdBuf.begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+
+  if (!m_preBarriers.empty())
+  {
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, m_preBarriers);
+  }
+
+  for (auto& copy : m_imageCopies) cmdBuf.copyBufferToImage(copy.src, copy.dst, vk::ImageLayout::eTransferDstOptimal, 1, &copy.region);
+  for (auto& copy : m_bufferCopies) cmdBuf.copyBuffer(copy.src, copy.dst, 1, &copy.region);
+
+  // Level by level across every chain, so each step is one barrier call
+  uint32_t maxLevels = 0;
+  for (auto& chain : m_blitChains) maxLevels = std::max(maxLevels, chain.levels);
+
+  for (uint32_t level = 1; level < maxLevels; level++)
+  {
+    std::vector<vk::ImageMemoryBarrier> barriers;
+    for (auto& chain : m_blitChains)
+    {
+      if (level >= chain.levels) continue;
+
+      vk::ImageMemoryBarrier barrier;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.image = chain.image;
+      barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, level - 1, 1, 0, 1 };
+      barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+      barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
+      barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+      barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+
+      barriers.push_back(barrier);
+    }
+
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, barriers);
+
+    for (auto& chain : m_blitChains)
+    {
+      if (level >= chain.levels) continue;
+
+      glm::uvec2 srcExtent = glm::max(chain.extent >> (level - 1), glm::uvec2(1));
+      glm::uvec2 dstExtent = glm::max(chain.extent >> level, glm::uvec2(1));
+
+      vk::ImageBlit blit;
+      blit.srcSubresource = { vk::ImageAspectFlagBits::eColor, level - 1, 0, 1 };
+      blit.srcOffsets[1] = vk::Offset3D{ int32_t(srcExtent.x), int32_t(srcExtent.y), 1 };
+      blit.dstSubresource = { vk::ImageAspectFlagBits::eColor, level, 0, 1 };
+      blit.dstOffsets[1] = vk::Offset3D{ int32_t(dstExtent.x), int32_t(dstExtent.y), 1 };
+
+      cmdBuf.blitImage(chain.image, vk::ImageLayout::eTransferSrcOptimal, chain.image, vk::ImageLayout::eTransferDstOptimal, 1, &blit, vk::Filter::eLinear);
+    }
+  }
+
+  // All but the last level were blit sources
+  for (auto& chain : m_blitChains)
+  {
+    vk::ImageMemoryBarrier barrier;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = chain.image;
+    barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, chain.levels - 1, 0, 1 };
+    barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+    barrier.newLayout = chain.finalLayout;
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+    barrier.dstAccessMask = chain.dstAccess;
+
+    m_postImageBarriers.push_back(barrier);
+
+    barrier.subresourceRange = { vk::ImageAspectFlagBits::eColor, chain.levels - 1, 1, 0, 1 };
+    barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+
+    m_postImageBarriers.push_back(barrier);
+  }
+
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, m_dstStages, {}, {}, m_postBufferBarriers, m_postImageBarriers);
+
+  cmdBuf.end();
+
+  m_fence = m_renderer.getFencePool().Acquire();
+  m_renderer.SubmitCmdBuffer(cmdBuf, m_fence.get());
+
+  m_preBarriers.clear();
+  m_imageCopies.clear();
+  m_bufferCopies.clear();
+  m_blitChains.clear();
+  m_postImageBarriers.clear();
+  m_postBufferBarriers.clear();
+  m_dstStages = {};
+}
+
+void BG::UploadBatch::Wait()
+{
+  if (!m_fence) return;
+
+  if (m_renderer.getDevice().waitForFences(m_fence.get(), true, UINT64_MAX) != vk::Result::eSuccess)
+  {
+    spdlog::error("UploadBatch: waiting for the upload failed");
+    throw std::runtime_error("Upload batch wait failed");
+  }
+
+  m_renderer.getFencePool().Release(std::move(m_fence));
+
+  for (auto& chunk : m_chunks) m_renderer.getStagingPool().Release(std::move(chunk));
+  m_chunks.clear();
+  m_chunkOffset = 0;
+}
+
+BG::UploadBatch::UploadBatch(Renderer& renderer)
+  : m_renderer(renderer), m_uncaughtExceptions(std::uncaught_exceptions())
+{
+}
+
+BG::UploadBatch::~UploadBatch()
+{
+  // A batch abandoned by an exception may be half recorded, it's dropped rather than submitted. Staging
+  // chunks of an already submitted batch must still outlive the copies.
+  bool unwinding = std::uncaught_exceptions() > m_uncaughtExceptions;
+
+  try
+  {
+    if (!m_fence && !unwinding) Submit();
+    Wait();
+  }
+  catch (std::exception& e)
+  {
+    spdlog::error("UploadBatch: flushing in the destructor failed: {}", e.what());
+  }
+}
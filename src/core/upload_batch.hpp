@@ -0,0 +1,163 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <map>
+#include <mutex>
+
+namespace BG
+{
+
+  // Texel block of a format, 1x1 for uncompressed ones
+  struct TexelBlock
+  {
+    uint32_t width = 1;
+    uint32_t height = 1;
+    uint32_t bytes = 0;
+
+    // Bytes of a tightly packed image of `extent` texels
+    inline size_t ImageSize(glm::uvec2 extent) const
+    {
+      return size_t((extent.x + width - 1) / width) * ((extent.y + height - 1) / height) * bytes;
+    }
+  };
+
+  // Persistently mapped staging buffers in power of two sizes, recycled once the GPU is done copying from them
+  class StagingPool
+  {
+  public:
+    static constexpr vk::DeviceSize MIN_CHUNK_SIZE = 64 << 10;
+
+    struct Chunk
+    {
+      std::unique_ptr<Buffer> buffer;
+      vk::DeviceSize size = 0;
+    };
+
+  private:
+    MemoryAllocator& m_allocator;
+
+    std::multimap<vk::DeviceSize, Chunk> m_free; // By size
+    vk::DeviceSize m_freeBytes = 0;
+    vk::DeviceSize m_maxFreeBytes;
+
+    std::mutex m_mutex;
+
+  public:
+    // Thread safe. At least `size` bytes, rounded up to a power of two.
+    Chunk Acquire(vk::DeviceSize size);
+    // The copies reading from the chunk must have completed. Chunks beyond `maxFreeBytes` are freed.
+    void Release(Chunk chunk);
+
+    StagingPool(MemoryAllocator& allocator, vk::DeviceSize maxFreeBytes = 64 << 20);
+  };
+
+  // Many buffer / image uploads recorded into one graphics command buffer and submitted once, instead of a
+  // submit and a wait per resource. Data is copied into staging chunks when recorded, so the source can be freed
+  // right away. The destination resources must stay alive until Wait() returns. Main thread only.
+  class UploadBatch
+  {
+  private:
+    struct ImageCopy
+    {
+      vk::Buffer src;
+      vk::Image dst;
+      vk::BufferImageCopy region;
+    };
+
+    struct BufferCopy
+    {
+      vk::Buffer src;
+      vk::Buffer dst;
+      vk::BufferCopy region;
+    };
+
+    // Mips 1 .. levels - 1 blitted from the previous level, after the copies
+    struct BlitChain
+    {
+      vk::Image image;
+      glm::uvec2 extent;
+      uint32_t levels;
+      vk::ImageLayout finalLayout;
+      vk::AccessFlags dstAccess;
+    };
+
+    Renderer& m_renderer;
+
+    vk::UniqueCommandBuffer m_cmdBuf;
+    vk::UniqueFence m_fence; // Set while submitted
+
+    // Recorded at Submit(), so every barrier before and after the copies is a single call
+    std::vector<vk::ImageMemoryBarrier> m_preBarriers;
+    std::vector<ImageCopy> m_imageCopies;
+    std::vector<BufferCopy> m_bufferCopies;
+    std::vector<BlitChain> m_blitChains;
+    std::vector<vk::ImageMemoryBarrier> m_postImageBarriers;
+    std::vector<vk::BufferMemoryBarrier> m_postBufferBarriers;
+    vk::PipelineStageFlags m_dstStages;
+
+    std::vector<StagingPool::Chunk> m_chunks; // The last one is being suballocated
+    vk::DeviceSize m_chunkOffset = 0;
+
+    int m_uncaughtExceptions; // At construction, to tell unwinding apart in the destructor
+
+    vk::DeviceSize Stage(const uint8_t* data, size_t size, vk::Buffer& staging);
+    void CheckRecording();
+
+  public:
+    // Multiple of every texel / block size up to 16 bytes, including the 3, 6, 12 and 24 byte formats
+    static constexpr vk::DeviceSize STAGING_ALIGNMENT = 48;
+    static constexpr vk::DeviceSize CHUNK_SIZE = 4 << 20;
+
+    void UploadBuffer(
+      Buffer& buffer, vk::DeviceSize dstOffset, const uint8_t* data, size_t size,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eVertexInput,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+
+    // Copies into mip 0, the image is left in `finalLayout`. Needs eTransferDst usage.
+    void UploadImage(
+      Image& image, glm::uvec2 extent, const uint8_t* data, size_t size,
+      vk::ImageLayout finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    // Copies `levels` mips packed in `data` one after the other, mip 0 first, each level half the size of the
+    // previous one (rounded down, at least 1). Block compressed formats are packed in whole blocks.
+    void UploadImageMips(
+      Image& image, glm::uvec2 extent, uint32_t levels, TexelBlock block, const uint8_t* data, size_t size,
+      vk::ImageLayout finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    // Copies mip 0 and fills the other `levels - 1` mips with a chain of linear blits. Needs eTransferSrc usage too,
+    // and a format with eBlitSrc, eBlitDst and eSampledImageFilterLinear support for optimal tiling.
+    void UploadImageBlitMips(
+      Image& image, glm::uvec2 extent, uint32_t levels, const uint8_t* data, size_t size,
+      vk::ImageLayout finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    // Moves a newly created image out of eUndefined, without uploading anything
+    void Transition(
+      Image& image, vk::ImageLayout newLayout,
+      vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eFragmentShader,
+      vk::AccessFlags dstAccess = vk::AccessFlagBits::eShaderRead);
+
+    inline bool IsEmpty() const { return m_preBarriers.empty() && m_bufferCopies.empty() && m_postImageBarriers.empty(); }
+
+    // floor(log2(max(width, height))) + 1
+    static uint32_t FullMipLevels(glm::uvec2 extent);
+
+    // Submits everything recorded on the graphics queue without blocking. Nothing can be recorded until Wait().
+    void Submit();
+    // Blocks until the submitted work is done and returns the staging memory, the batch can be reused after
+    void Wait();
+
+    UploadBatch(Renderer& renderer);
+    // Submits and waits for anything left. Errors are logged, and nothing is submitted while unwinding.
+    ~UploadBatch();
+  };
+
+}
@@ -0,0 +1,127 @@
+#include "worker_pool.hpp"
+
+#include <atomic>
+
+using namespace BG;
+
+void BG::WorkerPool::WorkerMain()
+{
+  while (true)
+  {
+    std::function<void()> task;
+
+    {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      m_cv.wait(lk, [&] { return m_stopping || !m_tasks.empty(); });
+
+      if (m_tasks.empty()) return;
+
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+
+    task();
+  }
+}
+
+void BG::WorkerPool::Enqueue(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_tasks.push_back(std::move(task));
+  }
+  m_cv.notify_one();
+}
+
+std::future<void> BG::WorkerPool::Submit(std::function<void()> task)
+{
+  auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+  auto future = packaged->get_future();
+
+  Enqueue([packaged]() { (*packaged)(); });
+
+  return future;
+}
+
+void BG::WorkerPool::ParallelFor(uint32_t count, std::function<void(uint32_t)> func)
+{
+  if (count == 0) return;
+
+  struct State
+  {
+    std::function<void(uint32_t)> func;
+    uint32_t count;
+    std::atomic<uint32_t> next{ 0 };
+    std::atomic<uint32_t> done{ 0 };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr exception;
+  };
+
+  auto state = std::make_shared<State>();
+  state->func = std::move(func);
+  state->count = count;
+
+  // Helpers that start after all indices are taken return immediately, nobody waits on them
+  auto run = [](std::shared_ptr<State> state) {
+    uint32_t i;
+    while ((i = state->next.fetch_add(1)) < state->count)
+    {
+      try
+      {
+        state->func(i);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lk(state->mutex);
+        if (!state->exception) state->exception = std::current_exception();
+      }
+
+      if (state->done.fetch_add(1) + 1 == state->count)
+      {
+        std::lock_guard<std::mutex> lk(state->mutex);
+        state->cv.notify_all();
+      }
+    }
+  };
+
+  uint32_t helpers = std::min(count - 1, GetNumThreads());
+  for (uint32_t i = 0; i < helpers; i++)
+  {
+    Enqueue([state, run]() { run(state); });
+  }
+
+  run(state);
+
+  {
+    std::unique_lock<std::mutex> lk(state->mutex);
+    state->cv.wait(lk, [&] { return state->done.load() == state->count; });
+  }
+
+  if (state->exception) std::rethrow_exception(state->exception);
+}
+
+BG::WorkerPool::WorkerPool(uint32_t numThreads)
+{
+  if (numThreads == 0)
+  {
+    numThreads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+  }
+
+  for (uint32_t i = 0; i < numThreads; i++)
+  {
+    m_threads.emplace_back([this]() { WorkerMain(); });
+  }
+}
+
+BG::WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_stopping = true;
+  }
+  m_cv.notify_all();
+
+  for (auto& t : m_threads) t.join();
+}
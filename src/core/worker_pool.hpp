@@ -0,0 +1,42 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace BG
+{
+
+  class WorkerPool
+  {
+  private:
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stopping = false;
+
+    void WorkerMain();
+    void Enqueue(std::function<void()> task);
+
+  public:
+    // Run `task` on a worker thread
+    std::future<void> Submit(std::function<void()> task);
+
+    // Run func(0) ... func(count - 1) across the workers. The calling thread takes part,
+    // so this is safe to call from within a worker task. Rethrows the first exception.
+    void ParallelFor(uint32_t count, std::function<void(uint32_t)> func);
+
+    inline uint32_t GetNumThreads() const { return uint32_t(m_threads.size()); }
+
+    WorkerPool(uint32_t numThreads = 0);
+    ~WorkerPool();
+  };
+
+}
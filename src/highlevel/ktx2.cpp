@@ -0,0 +1,299 @@
+#include "ktx2.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+using namespace BG;
+
+static const uint8_t KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+struct Ktx2Header
+{
+  uint8_t identifier[12];
+  uint32_t vkFormat;
+  uint32_t typeSize;
+  uint32_t pixelWidth;
+  uint32_t pixelHeight;
+  uint32_t pixelDepth;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  uint32_t levelCount;
+  uint32_t supercompressionScheme;
+  uint32_t dfdByteOffset;
+  uint32_t dfdByteLength;
+  uint32_t kvdByteOffset;
+  uint32_t kvdByteLength;
+  uint64_t sgdByteOffset;
+  uint64_t sgdByteLength;
+};
+
+static_assert(sizeof(Ktx2Header) == 80, "KTX2 header layout");
+
+struct Ktx2LevelIndex
+{
+  uint64_t byteOffset;
+  uint64_t byteLength;
+  uint64_t uncompressedByteLength;
+};
+
+// Basic data format descriptor sample, see the Khronos Data Format Specification
+struct DfdSample
+{
+  uint16_t bitOffset;
+  uint8_t bitLength;
+  uint8_t channelType;
+  uint32_t upper;
+};
+
+static const uint8_t DFD_MODEL_RGBSDA = 1;
+static const uint8_t DFD_MODEL_BC1A = 128;
+static const uint8_t DFD_MODEL_BC3 = 130;
+static const uint8_t DFD_MODEL_BC4 = 131;
+static const uint8_t DFD_MODEL_BC5 = 132;
+static const uint8_t DFD_MODEL_BC7 = 134;
+static const uint8_t DFD_SAMPLE_LINEAR = 0x10;
+
+static bool DescribeFormat(vk::Format format, uint8_t& colorModel, bool& srgb, std::vector<DfdSample>& samples)
+{
+  srgb = false;
+
+  switch (format)
+  {
+  case vk::Format::eBc1RgbSrgbBlock: srgb = true; [[fallthrough]];
+  case vk::Format::eBc1RgbUnormBlock:
+    colorModel = DFD_MODEL_BC1A;
+    samples = { { 0, 64, 0, UINT32_MAX } };
+    return true;
+  case vk::Format::eBc3SrgbBlock: srgb = true; [[fallthrough]];
+  case vk::Format::eBc3UnormBlock:
+    colorModel = DFD_MODEL_BC3;
+    samples = { { 0, 64, 15 | DFD_SAMPLE_LINEAR, UINT32_MAX }, { 64, 64, 0, UINT32_MAX } };
+    return true;
+  case vk::Format::eBc4UnormBlock:
+    colorModel = DFD_MODEL_BC4;
+    samples = { { 0, 64, 0, UINT32_MAX } };
+    return true;
+  case vk::Format::eBc5UnormBlock:
+    colorModel = DFD_MODEL_BC5;
+    samples = { { 0, 64, 0, UINT32_MAX }, { 64, 64, 1, UINT32_MAX } };
+    return true;
+  case vk::Format::eBc7SrgbBlock: srgb = true; [[fallthrough]];
+  case vk::Format::eBc7UnormBlock:
+    colorModel = DFD_MODEL_BC7;
+    samples = { { 0, 128, 0, UINT32_MAX } };
+    return true;
+  case vk::Format::eR8G8B8A8Srgb: srgb = true; [[fallthrough]];
+  case vk::Format::eR8G8B8A8Unorm:
+    colorModel = DFD_MODEL_RGBSDA;
+    samples = { { 0, 8, 0, 255 }, { 8, 8, 1, 255 }, { 16, 8, 2, 255 }, { 24, 8, 15 | DFD_SAMPLE_LINEAR, 255 } };
+    return true;
+  default:
+    return false;
+  }
+}
+
+template <class T> static void Write(std::vector<uint8_t>& out, size_t offset, const T& value)
+{
+  std::memcpy(out.data() + offset, &value, sizeof(T));
+}
+
+Ktx2Texture BG::Ktx2Texture::Parse(const uint8_t* bytes, size_t size)
+{
+  Ktx2Header header;
+
+  if (size < sizeof(Ktx2Header) || std::memcmp(bytes, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0)
+  {
+    spdlog::error("KTX2: not a KTX2 file");
+    throw std::runtime_error("Not a KTX2 file");
+  }
+
+  std::memcpy(&header, bytes, sizeof(Ktx2Header));
+
+  if (header.supercompressionScheme != 0)
+  {
+    spdlog::error("KTX2: supercompression scheme {} (BasisLZ / Zstandard / zlib) is not supported, no transcoder is linked", header.supercompressionScheme);
+    throw std::runtime_error("Unsupported KTX2 supercompression");
+  }
+
+  if (header.vkFormat == VK_FORMAT_UNDEFINED)
+  {
+    spdlog::error("KTX2: Basis Universal payloads need transcoding, which is not supported");
+    throw std::runtime_error("Unsupported KTX2 format");
+  }
+
+  if (header.pixelDepth > 1 || header.layerCount > 1 || header.faceCount != 1)
+  {
+    spdlog::error("KTX2: only 2D textures are supported (depth {}, layers {}, faces {})", header.pixelDepth, header.layerCount, header.faceCount);
+    throw std::runtime_error("Unsupported KTX2 texture type");
+  }
+
+  Ktx2Texture texture;
+  texture.format = vk::Format(header.vkFormat);
+  texture.extent = glm::uvec2(header.pixelWidth, std::max(header.pixelHeight, 1u));
+  texture.levels = std::max(header.levelCount, 1u);
+
+  // More levels than the extent has would shift it by its bit width
+  if (header.pixelWidth == 0 || texture.levels > UploadBatch::FullMipLevels(texture.extent))
+  {
+    spdlog::error("KTX2: {} levels for a {}x{} texture", texture.levels, header.pixelWidth, header.pixelHeight);
+    throw std::runtime_error("Invalid KTX2 file");
+  }
+
+  // Basic descriptor block after the total size: texelBlockDimension0..3 at byte 12, bytesPlane0 at byte 16
+  const size_t dfdBlockOffset = size_t(header.dfdByteOffset) + 4;
+  if (header.dfdByteLength < 4 + 24 || size_t(header.dfdByteOffset) + header.dfdByteLength > size)
+  {
+    spdlog::error("KTX2: missing data format descriptor");
+    throw std::runtime_error("Invalid KTX2 file");
+  }
+
+  texture.block.width = uint32_t(bytes[dfdBlockOffset + 12]) + 1;
+  texture.block.height = uint32_t(bytes[dfdBlockOffset + 13]) + 1;
+  texture.block.bytes = bytes[dfdBlockOffset + 16];
+
+  if (texture.block.bytes == 0)
+  {
+    spdlog::error("KTX2: format {} has no block size", vk::to_string(texture.format));
+    throw std::runtime_error("Invalid KTX2 file");
+  }
+
+  if (sizeof(Ktx2Header) + texture.levels * sizeof(Ktx2LevelIndex) > size)
+  {
+    spdlog::error("KTX2: truncated level index");
+    throw std::runtime_error("Invalid KTX2 file");
+  }
+
+  for (uint32_t level = 0; level < texture.levels; level++)
+  {
+    Ktx2LevelIndex index;
+    std::memcpy(&index, bytes + sizeof(Ktx2Header) + level * sizeof(Ktx2LevelIndex), sizeof(Ktx2LevelIndex));
+
+    glm::uvec2 levelExtent = glm::max(texture.extent >> level, glm::uvec2(1));
+    size_t expected = texture.block.ImageSize(levelExtent);
+
+    if (index.byteLength != expected || index.byteOffset > size || index.byteLength > size - index.byteOffset)
+    {
+      spdlog::error("KTX2: level {} has {} bytes at {}, expected {}", level, index.byteLength, index.byteOffset, expected);
+      throw std::runtime_error("Invalid KTX2 file");
+    }
+
+    texture.data.insert(texture.data.end(), bytes + index.byteOffset, bytes + index.byteOffset + index.byteLength);
+  }
+
+  return texture;
+}
+
+Ktx2Texture BG::Ktx2Texture::Load(const std::string& path)
+{
+  std::ifstream f(path, std::ios::binary);
+  if (!f)
+  {
+    spdlog::error("KTX2: can't open {}", path);
+    throw std::runtime_error("Can't open KTX2 file");
+  }
+
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+  return Parse(bytes.data(), bytes.size());
+}
+
+void BG::Ktx2Texture::Save(const std::string& path) const
+{
+  uint8_t colorModel;
+  bool srgb;
+  std::vector<DfdSample> samples;
+
+  if (!DescribeFormat(format, colorModel, srgb, samples))
+  {
+    spdlog::error("KTX2: can't write format {}", vk::to_string(format));
+    throw std::runtime_error("Unsupported KTX2 format");
+  }
+
+  const size_t levelIndexOffset = sizeof(Ktx2Header);
+  const size_t dfdOffset = levelIndexOffset + levels * sizeof(Ktx2LevelIndex);
+  const size_t dfdBlockSize = 24 + 16 * samples.size();
+  const size_t dfdSize = 4 + dfdBlockSize;
+
+  // Mips are stored smallest first, each aligned to lcm(block size, 4)
+  const size_t alignment = std::lcm(size_t(block.bytes), size_t(4));
+
+  std::vector<Ktx2LevelIndex> levelIndex(levels);
+  std::vector<size_t> srcOffsets(levels);
+
+  size_t srcOffset = 0;
+  for (uint32_t level = 0; level < levels; level++)
+  {
+    srcOffsets[level] = srcOffset;
+    levelIndex[level].byteLength = block.ImageSize(glm::max(extent >> level, glm::uvec2(1)));
+    levelIndex[level].uncompressedByteLength = levelIndex[level].byteLength;
+    srcOffset += levelIndex[level].byteLength;
+  }
+
+  size_t fileSize = dfdOffset + dfdSize;
+  for (int level = int(levels) - 1; level >= 0; level--)
+  {
+    fileSize = (fileSize + alignment - 1) / alignment * alignment;
+    levelIndex[level].byteOffset = fileSize;
+    fileSize += levelIndex[level].byteLength;
+  }
+
+  if (srcOffset > data.size())
+  {
+    spdlog::error("KTX2: {} mips of {}x{} need {} bytes, got {}", levels, extent.x, extent.y, srcOffset, data.size());
+    throw std::runtime_error("KTX2 data too small");
+  }
+
+  std::vector<uint8_t> out(fileSize, 0);
+
+  Ktx2Header header = {};
+  std::memcpy(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+  header.vkFormat = uint32_t(format);
+  header.typeSize = 1;
+  header.pixelWidth = extent.x;
+  header.pixelHeight = extent.y;
+  header.faceCount = 1;
+  header.levelCount = levels;
+  header.dfdByteOffset = uint32_t(dfdOffset);
+  header.dfdByteLength = uint32_t(dfdSize);
+  Write(out, 0, header);
+
+  for (uint32_t level = 0; level < levels; level++)
+  {
+    Write(out, levelIndexOffset + level * sizeof(Ktx2LevelIndex), levelIndex[level]);
+    std::memcpy(out.data() + levelIndex[level].byteOffset, data.data() + srcOffsets[level], levelIndex[level].byteLength);
+  }
+
+  // Basic descriptor block: vendor / type 0, version 2, BT.709 primaries, straight alpha
+  size_t dfd = dfdOffset;
+  Write(out, dfd, uint32_t(dfdSize));
+  Write(out, dfd + 4, uint32_t(0));
+  Write(out, dfd + 8, uint32_t(2 | (dfdBlockSize << 16)));
+  out[dfd + 12] = colorModel;
+  out[dfd + 13] = 1;
+  out[dfd + 14] = srgb ? 2 : 1;
+  out[dfd + 15] = 0;
+  out[dfd + 16] = uint8_t(block.width - 1);
+  out[dfd + 17] = uint8_t(block.height - 1);
+  out[dfd + 20] = uint8_t(block.bytes);
+
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    size_t sample = dfd + 28 + 16 * i;
+    uint32_t word0 = uint32_t(samples[i].bitOffset) | (uint32_t(samples[i].bitLength - 1) << 16) | (uint32_t(samples[i].channelType) << 24);
+    Write(out, sample, word0);
+    Write(out, sample + 4, uint32_t(0));
+    Write(out, sample + 8, uint32_t(0));
+    Write(out, sample + 12, samples[i].upper);
+  }
+
+  std::ofstream f(path, std::ios::binary);
+  if (!f)
+  {
+    spdlog::error("KTX2: can't write {}", path);
+    throw std::runtime_error("Can't write KTX2 file");
+  }
+
+  f.write((const char*)out.data(), out.size());
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+#include "upload_batch.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+namespace BG
+{
+
+  // A 2D texture in a KTX2 container, any vkFormat including BCn / ETC2 / ASTC, with all its mips.
+  // Supercompressed files (BasisLZ, Zstandard, zlib) and Basis Universal payloads are rejected, no transcoder
+  // is linked. Encode them without supercompression, e.g. with the Ktx2Encode tool.
+  struct Ktx2Texture
+  {
+    vk::Format format = vk::Format::eUndefined;
+    glm::uvec2 extent;
+    uint32_t levels = 1;
+    TexelBlock block;
+
+    // Packed mip 0 first, as UploadBatch::UploadImageMips takes them
+    std::vector<uint8_t> data;
+
+    static Ktx2Texture Load(const std::string& path);
+    static Ktx2Texture Parse(const uint8_t* bytes, size_t size);
+
+    // Without supercompression. Only the BC1 (RGB), BC3, BC4, BC5, BC7 and R8G8B8A8 formats can be described.
+    void Save(const std::string& path) const;
+  };
+
+}
@@ -1,6 +1,8 @@
 #include "mesh_system.hpp"
 #include "renderer.hpp"
 #include "texture_system.hpp"
+#include "upload_batch.hpp"
+#include "sampler_cache.hpp"
 
 // Import the tinyGlTF library to load glTF models
 #define TINYGLTF_IMPLEMENTATION
@@ -12,6 +14,50 @@
 using namespace BG;
 using namespace BG::MeshSystem;
 
+// glTF sampler enums follow OpenGL. Minification without a mip mode samples mip 0 only.
+static SamplerDesc GltfSamplerDesc(const tinygltf::Sampler& sampler)
+{
+  SamplerDesc desc = TextureSystem::DefaultSamplerDesc();
+
+  auto address = [](int wrap) {
+    if (wrap == TINYGLTF_TEXTURE_WRAP_CLAMP_TO_EDGE) return vk::SamplerAddressMode::eClampToEdge;
+    if (wrap == TINYGLTF_TEXTURE_WRAP_MIRRORED_REPEAT) return vk::SamplerAddressMode::eMirroredRepeat;
+    return vk::SamplerAddressMode::eRepeat;
+  };
+  desc.addressU = address(sampler.wrapS);
+  desc.addressV = address(sampler.wrapT);
+
+  if (sampler.magFilter == TINYGLTF_TEXTURE_FILTER_NEAREST) desc.magFilter = vk::Filter::eNearest;
+
+  switch (sampler.minFilter)
+  {
+  case TINYGLTF_TEXTURE_FILTER_NEAREST:
+    desc.minFilter = vk::Filter::eNearest;
+    desc.maxLod = 0.0f;
+    break;
+  case TINYGLTF_TEXTURE_FILTER_LINEAR:
+    desc.maxLod = 0.0f;
+    break;
+  case TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_NEAREST:
+    desc.minFilter = vk::Filter::eNearest;
+    desc.mipmapMode = vk::SamplerMipmapMode::eNearest;
+    break;
+  case TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_NEAREST:
+    desc.mipmapMode = vk::SamplerMipmapMode::eNearest;
+    break;
+  case TINYGLTF_TEXTURE_FILTER_NEAREST_MIPMAP_LINEAR:
+    desc.minFilter = vk::Filter::eNearest;
+    break;
+  default:
+    break;
+  }
+
+  // Point sampled textures are usually pixel art, anisotropy would blur them
+  if (desc.magFilter == vk::Filter::eNearest || desc.minFilter == vk::Filter::eNearest) desc.maxAnisotropy = 1.0f;
+
+  return desc;
+}
+
 Node::Node(glm::mat4 transform)
   : transform(transform), uid(GetUID())
 {
@@ -128,6 +174,28 @@ std::pair<std::vector<Node>, Node*> BG::MeshSystem::Loader::FromGltf(Renderer& r
     }
   }
 
+  // Load the images, packed into pooled staging memory and uploaded with a single submit
+  auto& textures = r.getTextureSystem();
+
+  UploadBatch batch(r);
+  std::vector<TextureSystem::Handle> imageHandles;
+  for (auto& img : model.images)
+  {
+    imageHandles.push_back(textures.AddTexture(batch, img.image.data(), img.width, img.height, img.image.size(), vk::Format::eR8G8B8A8Srgb));
+  }
+  batch.Submit();
+
+  // A glTF texture is an image and a sampler. The table has one sampler per image, so textures sharing an
+  // image with different samplers get the last one.
+  std::vector<int> textureIndices;
+  for (auto& texture : model.textures)
+  {
+    TextureSystem::Handle handle = imageHandles[texture.source];
+    if (texture.sampler >= 0) textures.SetSampler(handle, GltfSamplerDesc(model.samplers[texture.sampler]));
+
+    textureIndices.push_back(handle.index);
+  }
+
   for (auto& nodeGltf : model.nodes)
   {
     glm::mat4 localTransform = glm::mat4(1.0);
@@ -194,7 +262,7 @@ std::pair<std::vector<Node>, Node*> BG::MeshSystem::Loader::FromGltf(Renderer& r
           Vertex v;
           v.pos = glm::vec3(elementBase[0], elementBase[1], elementBase[2]);
           v.uv0 = glm::vec2(uvElementBase[0], uvElementBase[1]);
-          v.materialIndex = textureIndex;
+          v.materialIndex = textureIndex >= 0 ? textureIndices[textureIndex] : -1;
           node.GetVertices().push_back(v);
         }
 
@@ -230,11 +298,7 @@ std::pair<std::vector<Node>, Node*> BG::MeshSystem::Loader::FromGltf(Renderer& r
     rootNode.GetChildren().push_back(&nodes[nodeId]);
   }
 
-  // Load the images
-  for (auto img : model.images)
-  {
-    r.getTextureSystem().AddTexture(img.image.data(), img.width, img.height, img.image.size(), vk::Format::eR8G8B8A8Srgb);
-  }
+  batch.Wait();
 
   return std::pair<std::vector<Node>, Node*>(std::move(nodes), &rootNode);
 }
@@ -4,6 +4,12 @@
 #include "command_buffer.hpp"
 #include "pipelines.hpp"
 #include "buffer.hpp"
+#include "worker_pool.hpp"
+#include "framebuffer_cache.hpp"
+#include "descriptor_cache.hpp"
+#include "uniform_ring.hpp"
+#include "upload_batch.hpp"
+#include "ktx2.hpp"
 
 #include <json.hpp>
 #include <imgui/imgui.h>
@@ -76,22 +82,15 @@ void main() {
 
 )V0G0N";
 
-void BG::ShaderGraph::Graph::CreateTexture(glm::uvec2 extent, vk::Format format, Renderer& r, std::string name)
+void BG::ShaderGraph::Graph::CreateTexture(glm::uvec2 extent, vk::Format format, Renderer& r, std::string name, UploadBatch& batch)
 {
   auto texture = std::make_shared<Texture>();
 
-  for (int i = 0; i < r.getSwapchainImages().size(); i++)
+  for (int i = 0; i < numImages; i++)
   {
     auto image = r.getMemoryAllocator().AllocImage2D(extent, 1, format, vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eSampled, vk::ImageLayout::eUndefined);
 
-    auto _cmdBuf = r.AllocCmdBuffer();
-    CommandBuffer cmdBuf(r.getDevice(), _cmdBuf.get(), r.getTracker());
-
-    cmdBuf.Begin();
-    cmdBuf.ImageTransition(*image, vk::PipelineStageFlagBits::eBottomOfPipe, vk::PipelineStageFlagBits::eTopOfPipe, vk::ImageLayout::eUndefined, vk::ImageLayout::eShaderReadOnlyOptimal);
-    cmdBuf.End();
-
-    r.SubmitCmdBufferNow(cmdBuf.GetVkCmdBuf());
+    batch.Transition(*image, vk::ImageLayout::eShaderReadOnlyOptimal);
 
     vk::ImageViewCreateInfo viewInfo;
     viewInfo.image = image->image;
@@ -114,7 +113,7 @@ void BG::ShaderGraph::Graph::CreateTexture(glm::uvec2 extent, vk::Format format,
 }
 
 Graph::Graph(std::string jsonFile, Renderer& r)
-  : r(r)
+  : r(r), numImages(r.getFramesInFlight() + 1)
 {
   using json = nlohmann::json;
 
@@ -135,7 +134,9 @@ Graph::Graph(std::string jsonFile, Renderer& r)
   std::filesystem::path jsonPath = jsonFile;
   jsonPath.remove_filename();
 
-  // Load custom textures
+  // Load custom textures, the uploads and layout transitions all go out in one submit
+  UploadBatch batch(r);
+
   for (auto jsonPairTexture : j["images"].items())
   {
     std::string name = jsonPairTexture.key();
@@ -147,17 +148,31 @@ Graph::Graph(std::string jsonFile, Renderer& r)
       p.append(std::string(image["fileName"]));
       auto pathString = p.string();
 
-      int imageWidth, imageHeight, channels;
-      uint8_t* imgData = stbi_load(pathString.data(), &imageWidth, &imageHeight, &channels, 0);
-
-      auto handle = r.getTextureSystem().AddTexture(imgData, imageWidth, imageHeight, imageWidth * imageHeight * channels, vk::Format::eR8G8B8A8Srgb);
-
       auto texture = std::make_shared<Texture>();
-      texture->format = vk::Format::eR8G8B8A8Srgb;
-      texture->extent = glm::uvec2(imageWidth, imageHeight);
       texture->isInternal = false;
 
-      for (int i = 0; i < r.getSwapchainImages().size(); i++)
+      TextureSystem::Handle handle;
+
+      // KTX2 files keep their own (e.g. block compressed) format and mips
+      if (p.extension() == ".ktx2")
+      {
+        auto ktx = Ktx2Texture::Load(pathString);
+
+        handle = r.getTextureSystem().AddTexture(batch, ktx);
+        texture->format = ktx.format;
+        texture->extent = ktx.extent;
+      }
+      else
+      {
+        int imageWidth, imageHeight, channels;
+        uint8_t* imgData = stbi_load(pathString.data(), &imageWidth, &imageHeight, &channels, 0);
+
+        handle = r.getTextureSystem().AddTexture(batch, imgData, imageWidth, imageHeight, imageWidth * imageHeight * channels, vk::Format::eR8G8B8A8Srgb);
+        texture->format = vk::Format::eR8G8B8A8Srgb;
+        texture->extent = glm::uvec2(imageWidth, imageHeight);
+      }
+
+      for (int i = 0; i < numImages; i++)
       {
         texture->imageView.push_back(r.getTextureSystem().GetImageView(handle));
       }
@@ -232,9 +247,19 @@ Graph::Graph(std::string jsonFile, Renderer& r)
 
     spdlog::debug("Texture image {}, resolution={}x{}, format={}", name, extent.x, extent.y, format);
 
-    CreateTexture(extent, format, r, name);
+    CreateTexture(extent, format, r, name, batch);
   }
 
+  struct PendingStage
+  {
+    std::shared_ptr<Stage> stage;
+    std::string shaderText;
+    std::vector<std::pair<vk::Format, vk::ImageLayout>> attachments; // Format, final layout
+    glm::uvec2 extent;
+  };
+
+  std::vector<PendingStage> pendingStages;
+
   // Load in stages
   for (auto jsonPairStage : j["stages"].items())
   {
@@ -293,21 +318,17 @@ Graph::Graph(std::string jsonFile, Renderer& r)
       stage->texture.push_back(TextureBinding{ texture, 0 });
     }
 
-    // Load in shader text & construct pipeline & ouput texture/view
+    // Load in shader text & create the output textures, the pipeline is built below
     {
       auto shaderPath = jsonPath;
       shaderPath.append(stage->shaderFile);
       std::ifstream f(shaderPath);
-      std::string shaderText = std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-      f.close();
 
-      spdlog::debug("Shader stage {}", stage->name);
-
-      glm::uvec2 extent = glm::uvec2(r.getWidth(), r.getHeight());
-
-      stage->pipeline = r.CreatePipeline();
-      stage->pipeline->AddFragmentShaders(shaderText);
-      stage->pipeline->AddVertexShaders(fullscreenVertexShader);
+      PendingStage pending;
+      pending.stage = stage;
+      pending.shaderText = std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+      pending.extent = glm::uvec2(r.getWidth(), r.getHeight());
+      f.close();
 
       for (std::string outputName : jsonStage["output"])
       {
@@ -315,35 +336,67 @@ Graph::Graph(std::string jsonFile, Renderer& r)
         
         if (this->textures.find(outputName) == this->textures.end())
         {
-          CreateTexture(extent, format, r, outputName);
+          CreateTexture(pending.extent, format, r, outputName, batch);
         }
         else
         {
-          extent = this->textures[outputName]->extent;
+          pending.extent = this->textures[outputName]->extent;
           format = this->textures[outputName]->format;
         }
 
         this->dependency[outputName] = stage->name;
 
         if (outputName == "framebuffer")
-          stage->pipeline->AddAttachment(format, vk::ImageLayout::eUndefined, vk::ImageLayout::ePresentSrcKHR);
+          pending.attachments.push_back({ format, vk::ImageLayout::ePresentSrcKHR });
         else
-          stage->pipeline->AddAttachment(format, vk::ImageLayout::eUndefined, vk::ImageLayout::eShaderReadOnlyOptimal);
+          pending.attachments.push_back({ format, vk::ImageLayout::eShaderReadOnlyOptimal });
       }
 
-      stage->pipeline->SetViewport(float(extent.x), float(extent.y));
-      stage->pipeline->BuildPipeline();
+      pendingStages.push_back(std::move(pending));
+    }
+  }
 
-      // Map bindings
-      for (auto& textureBinding : stage->texture)
-      {
-        textureBinding.binding = stage->pipeline->GetBindingByName(textureBinding.name);
-      }
+  // Declared and output textures are transitioned together
+  batch.Submit();
+  batch.Wait();
+
+  // Compile & build the stages' pipelines in parallel, each task only touches its own stage
+  r.getWorkerPool().ParallelFor(uint32_t(pendingStages.size()), [&](uint32_t i) {
+    auto& pending = pendingStages[i];
+    auto& stage = pending.stage;
 
-      stage->builtinParamBindPoint = stage->pipeline->GetBindingByName("iTime");
+    spdlog::debug("Shader stage {}", stage->name);
+
+    stage->pipeline = r.CreatePipeline();
+    stage->pipeline->SetName(stage->name);
+    stage->pipeline->AddFragmentShaders(pending.shaderText);
+    stage->pipeline->AddVertexShaders(fullscreenVertexShader);
+
+    for (auto& attachment : pending.attachments)
+    {
+      stage->pipeline->AddAttachment(attachment.first, vk::ImageLayout::eUndefined, attachment.second);
     }
-  
-    // Verify all bindings
+
+    stage->pipeline->SetViewport(float(pending.extent.x), float(pending.extent.y));
+
+    // The builtin uniforms live in the renderer's UniformRing
+    stage->builtinParamBindPoint = stage->pipeline->GetBindingByName("iTime");
+    if (stage->builtinParamBindPoint >= 0) stage->pipeline->SetDynamicUniformBuffer(stage->builtinParamBindPoint);
+
+    stage->pipeline->BuildPipeline();
+
+    // Map bindings
+    for (auto& textureBinding : stage->texture)
+    {
+      textureBinding.binding = stage->pipeline->GetBindingByName(textureBinding.name);
+    }
+    });
+
+  // Verify all bindings, in file order
+  for (auto& pending : pendingStages)
+  {
+    auto& stage = pending.stage;
+
     for (auto textureBinding : stage->texture)
     {
       if (textureBinding.binding > 1024)
@@ -352,7 +405,6 @@ Graph::Graph(std::string jsonFile, Renderer& r)
         throw std::runtime_error("Bad binding");
       }
     }
-
   }
   
   startTime = std::chrono::steady_clock::now();
@@ -366,6 +418,8 @@ BG::ShaderGraph::Graph::~Graph()
     {
       for (auto imageView : pair.second->imageView)
       {
+        r.getFramebufferCache().InvalidateImageView(imageView);
+        r.getDescriptorCache().InvalidateImageView(imageView);
         r.getDevice().destroyImageView(imageView);
       }
     }
@@ -384,7 +438,7 @@ void Graph::Render(Renderer& r, Renderer::Context& ctx, std::string target)
   }
   else
   {
-    renderTarget.push_back(texture->imageView[ctx.imageIndex]);
+    renderTarget.push_back(texture->imageView[currentImage]);
   }
 
   std::string stageName = this->dependency[target];
@@ -403,24 +457,25 @@ void Graph::Render(Renderer& r, Renderer::Context& ctx, std::string target)
   }
 
   // Render current node
+  auto zone = ctx.cmdBuffer.ProfileZone(stageName);
+
   auto& pipeline = stage->pipeline;
 
-  // Allocate descriptor sets & bind uniforms
-  auto descSet = pipeline->AllocDescSet(ctx.descPool);
+  // Gather the uniforms & textures, the descriptor set is reused from an earlier frame binding the same ones
+  DescriptorCache::Bindings bindings;
 
   if (stage->builtinParamBindPoint >= 0)
-    pipeline->BindGraphicsUniformBuffer(*pipeline, descSet, *uniformBuffer, 0, uint32_t(sizeof(ShaderUniform)), stage->builtinParamBindPoint);
+    bindings.UniformBufferDynamic(stage->builtinParamBindPoint, r.getUniformRing().GetBuffer(), sizeof(ShaderUniform));
 
   for (auto& textureBinding : stage->texture)
   {
-    int imageIndex = ctx.imageIndex;
+    int imageIndex = currentImage;
     std::string textureName = textureBinding.name;
 
     if (textureName.rfind("previous_") == 0)
     {
       textureName = textureName.substr(9);
-      int size = int(r.getSwapchainImages().size());
-      imageIndex = (imageIndex - 1 + size) % size;
+      imageIndex = (imageIndex - 1 + numImages) % numImages;
     }
 
     if (textures[textureName]->isInternal)
@@ -431,17 +486,18 @@ void Graph::Render(Renderer& r, Renderer::Context& ctx, std::string target)
         vk::ImageLayout::eShaderReadOnlyOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
     }
 
-    pipeline->BindGraphicsImageView(
-      *pipeline, descSet,
+    bindings.ImageView(
+      textureBinding.binding,
       textures[textureName]->imageView[imageIndex],
-      vk::ImageLayout::eShaderReadOnlyOptimal, r.getTextureSystem().GetSampler(),
-      textureBinding.binding);
+      vk::ImageLayout::eShaderReadOnlyOptimal, r.getTextureSystem().GetSampler());
   }
 
+  auto descSet = r.getDescriptorCache().Get(*pipeline, bindings);
+
   if (target != "framebuffer")
   {
     ctx.cmdBuffer.ImageTransition(
-      *texture->image[ctx.imageIndex],
+      *texture->image[currentImage],
       vk::PipelineStageFlagBits::eBottomOfPipe, vk::PipelineStageFlagBits::eColorAttachmentOutput,
       vk::ImageLayout::eUndefined, vk::ImageLayout::eColorAttachmentOptimal);
   }
@@ -450,7 +506,10 @@ void Graph::Render(Renderer& r, Renderer::Context& ctx, std::string target)
     // Bind the pipeline to use
     ctx.cmdBuffer.BindPipeline(*pipeline);
     // Bind the descriptor sets (uniform buffer, texture, etc.)
-    ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet);
+    if (stage->builtinParamBindPoint >= 0)
+      ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet, { uniformOffset });
+    else
+      ctx.cmdBuffer.BindGraphicsDescSets(*pipeline, descSet);
     // Push parameters as push constants
     for (auto& p : stage->parameters)
     {
@@ -462,22 +521,23 @@ void Graph::Render(Renderer& r, Renderer::Context& ctx, std::string target)
 
   if (target != "framebuffer")
   {
-    ctx.cmdBuffer.ImageTransition(*texture->image[ctx.imageIndex], vk::PipelineStageFlagBits::eBottomOfPipe, vk::PipelineStageFlagBits::eFragmentShader, vk::ImageLayout::eShaderReadOnlyOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
+    ctx.cmdBuffer.ImageTransition(*texture->image[currentImage], vk::PipelineStageFlagBits::eBottomOfPipe, vk::PipelineStageFlagBits::eFragmentShader, vk::ImageLayout::eShaderReadOnlyOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
   }
 }
 
 void Graph::Render(Renderer& r, Renderer::Context& ctx)
 {
-  // Map & upload the constants
-  uniformBuffer = r.getMemoryAllocator().AllocTransient(sizeof(ShaderUniform), vk::BufferUsageFlagBits::eUniformBuffer);
+  currentImage = int(frameCount % numImages);
+
+  // Upload the constants, shared by all stages this frame
   auto now = std::chrono::steady_clock::now();
-  ShaderUniform* uniformBufferGPU = uniformBuffer->Map<ShaderUniform>();
-  uniformBufferGPU->iResolution = glm::vec3(r.getWidth(), r.getHeight(), 1.0f);
-  uniformBufferGPU->iTime = float((now - startTime).count() * 1e-9);
-  uniformBufferGPU->iMouse = glm::vec4(r.getCursorPos(), r.getMouseButtonState());
-  uniformBufferGPU->iTimeDelta = float((now - lastTime).count() * 1e-9);
-  uniformBufferGPU->iFrame = int(frameCount);
-  uniformBuffer->UnMap();
+  ShaderUniform uniform;
+  uniform.iResolution = glm::vec3(r.getWidth(), r.getHeight(), 1.0f);
+  uniform.iTime = float((now - startTime).count() * 1e-9);
+  uniform.iMouse = glm::vec4(r.getCursorPos(), r.getMouseButtonState());
+  uniform.iTimeDelta = float((now - lastTime).count() * 1e-9);
+  uniform.iFrame = int(frameCount);
+  uniformOffset = r.getUniformRing().Push(uniform);
   lastTime = now;
   frameCount++;
 
@@ -94,12 +94,18 @@ namespace BG::ShaderGraph
 
     std::string outputStage;
 
-    BG::Buffer* uniformBuffer;
+    // This frame's ShaderUniform in the renderer's UniformRing
+    uint32_t uniformOffset = 0;
 
     std::chrono::steady_clock::time_point startTime, lastTime;
     uint32_t frameCount = 0;
 
-    void CreateTexture(glm::uvec2 extent, vk::Format format, Renderer& r, std::string name);
+    // Internal textures are versioned per frame, one more than the frames in flight so that
+    // "previous_" reads never overlap with a frame still on the GPU
+    int numImages;
+    int currentImage = 0;
+
+    void CreateTexture(glm::uvec2 extent, vk::Format format, Renderer& r, std::string name, UploadBatch& batch);
 
   public:
     Graph(std::string jsonFile, BG::Renderer& r);
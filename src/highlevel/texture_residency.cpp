@@ -0,0 +1,303 @@
+#include "texture_residency.hpp"
+
+#include "buffer.hpp"
+#include "renderer.hpp"
+#include "streaming_uploader.hpp"
+#include "texture_system.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace BG;
+
+vk::DeviceSize TextureResidency::LevelBytes(glm::uvec2 extent, uint32_t levels, TexelBlock block, uint32_t firstMip)
+{
+  vk::DeviceSize bytes = 0;
+  for (uint32_t level = firstMip; level < levels; level++)
+  {
+    bytes += block.ImageSize(glm::max(extent >> level, glm::uvec2(1)));
+  }
+
+  return bytes;
+}
+
+void TextureResidency::Add(int index, Source source)
+{
+  Entry entry;
+  entry.id = m_nextId++;
+  entry.source = std::move(source);
+
+  m_entries[index] = std::move(entry);
+}
+
+void TextureResidency::Remove(int index)
+{
+  auto it = m_entries.find(index);
+  if (it == m_entries.end()) return;
+
+  // In flight loads and uploads are dropped when they finish, their id no longer matches
+  m_releasing.push_back({ it->second.residentBytes, m_frame });
+  m_entries.erase(it);
+}
+
+void TextureResidency::MarkUsed(int index, uint64_t frame)
+{
+  auto it = m_entries.find(index);
+  if (it == m_entries.end()) return;
+
+  it->second.lastUsed = frame;
+  it->second.used = true;
+}
+
+void TextureResidency::StartLoad(int index, Entry& entry, uint32_t firstMip)
+{
+  auto texture = std::make_shared<Ktx2Texture>();
+  Source source = entry.source;
+
+  std::future<void> done = m_renderer.getWorkerPool().Submit([texture, source]() {
+    *texture = source();
+  });
+
+  vk::DeviceSize newBytes = entry.levels > 0 ? LevelBytes(entry.extent, entry.levels, entry.block, firstMip) : 0;
+  m_loads.push_back(Load{ entry.id, index, firstMip, entry.residentBytes, newBytes, texture, std::move(done) });
+
+  entry.loading = true;
+}
+
+void TextureResidency::FinishLoads(int64_t& headroom)
+{
+  for (auto it = m_loads.begin(); it != m_loads.end();)
+  {
+    if (it->done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      it++;
+      continue;
+    }
+
+    Load load = std::move(*it);
+    it = m_loads.erase(it);
+
+    // Update() counted this load's estimate, what it really allocates is counted below instead
+    headroom += int64_t(load.newBytes) - int64_t(load.oldBytes);
+
+    auto entryIt = m_entries.find(load.index);
+    if (entryIt == m_entries.end() || entryIt->second.id != load.id) continue;
+
+    Entry& entry = entryIt->second;
+    entry.loading = false;
+
+    try
+    {
+      load.done.get();
+      m_textures.CheckSampleable(load.texture->format);
+    }
+    catch (std::exception& e)
+    {
+      spdlog::error("Streamed texture {} failed to load: {}", load.index, e.what());
+      entry.failed = true;
+      continue;
+    }
+
+    const Ktx2Texture& texture = *load.texture;
+    entry.format = texture.format;
+    entry.extent = texture.extent;
+    entry.levels = texture.levels;
+    entry.block = texture.block;
+
+    // Drop more top mips until it fits, the image it replaces is freed after
+    uint32_t firstMip = std::min(load.firstMip, texture.levels - 1);
+    while (firstMip + 1 < texture.levels && int64_t(LevelBytes(texture.extent, texture.levels, texture.block, firstMip)) > headroom + int64_t(entry.residentBytes))
+    {
+      firstMip++;
+    }
+
+    // Nothing gained over what's resident
+    if (entry.residentBytes > 0 && firstMip == entry.residentMip) continue;
+
+    glm::uvec2 extent = glm::max(texture.extent >> firstMip, glm::uvec2(1));
+    uint32_t levels = texture.levels - firstMip;
+    vk::DeviceSize offset = LevelBytes(texture.extent, firstMip, texture.block, 0);
+    vk::DeviceSize bytes = LevelBytes(texture.extent, texture.levels, texture.block, firstMip);
+
+    std::unique_ptr<Image> image;
+    try
+    {
+      image = m_renderer.getMemoryAllocator().AllocImage2D(
+        extent, levels, texture.format, vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled,
+        vk::ImageLayout::eUndefined, VMA_MEMORY_USAGE_GPU_ONLY, VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT);
+    }
+    catch (std::exception&)
+    {
+      // Over budget. A demotion that can't get its smaller image evicts instead, so the memory is still freed and
+      // the texture isn't read again every frame. Anything else is retried once something is reclaimed.
+      if (entry.residentBytes > 0 && firstMip > entry.residentMip)
+      {
+        headroom += int64_t(entry.residentBytes);
+        Evict(load.index, entry);
+      }
+      continue;
+    }
+
+    auto ready = m_renderer.getUploader().UploadImageMips(*image, extent, levels, texture.block, texture.data.data() + offset, size_t(bytes));
+
+    headroom -= int64_t(bytes) - int64_t(entry.residentBytes);
+    entry.loading = true;
+
+    m_uploads.push_back(Upload{ load.id, load.index, firstMip, entry.residentBytes, bytes, std::move(image), ready });
+  }
+}
+
+void TextureResidency::FinishUploads()
+{
+  for (auto it = m_uploads.begin(); it != m_uploads.end();)
+  {
+    if (it->ready.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      it++;
+      continue;
+    }
+
+    auto entryIt = m_entries.find(it->index);
+    if (entryIt == m_entries.end() || entryIt->second.id != it->id)
+    {
+      // The acquire on the graphics queue may still be running
+      m_renderer.getTracker().DisposeImage(std::move(it->image));
+    }
+    else
+    {
+      Entry& entry = entryIt->second;
+
+      m_textures.Replace(it->index, std::move(it->image), entry.format, entry.levels - it->firstMip);
+      m_releasing.push_back({ entry.residentBytes, m_frame });
+
+      entry.residentMip = it->firstMip;
+      entry.residentBytes = it->newBytes;
+      entry.loading = false;
+    }
+
+    it = m_uploads.erase(it);
+  }
+}
+
+void TextureResidency::Evict(int index, Entry& entry)
+{
+  m_textures.Replace(index, nullptr, entry.format, 0);
+  m_releasing.push_back({ entry.residentBytes, m_frame });
+
+  entry.residentMip = entry.levels;
+  entry.residentBytes = 0;
+}
+
+void TextureResidency::Reclaim(vk::DeviceSize excess)
+{
+  // Least recently used first. Textures the last frames sampled are left alone, they would come right back.
+  uint64_t framesInFlight = uint64_t(m_renderer.getFramesInFlight());
+
+  std::vector<std::pair<uint64_t, int>> candidates;
+  for (auto& [index, entry] : m_entries)
+  {
+    if (!entry.loading && entry.residentBytes > 0 && entry.lastUsed + framesInFlight < m_frame) candidates.push_back({ entry.lastUsed, index });
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  vk::DeviceSize freed = 0;
+  for (auto [lastUsed, index] : candidates)
+  {
+    if (freed >= excess) break;
+
+    Entry& entry = m_entries[index];
+
+    // Textures unused for long, or already down to their last mip, are evicted right away
+    if (m_frame - lastUsed > m_evictAfterFrames || entry.residentMip + 1 >= entry.levels)
+    {
+      freed += entry.residentBytes;
+      Evict(index, entry);
+    }
+    else if (m_loads.size() < m_maxLoads)
+    {
+      freed += entry.residentBytes - LevelBytes(entry.extent, entry.levels, entry.block, entry.residentMip + 1);
+      StartLoad(index, entry, entry.residentMip + 1);
+    }
+  }
+}
+
+void TextureResidency::StreamIn(vk::DeviceSize headroom)
+{
+  // Textures the last frames sampled that are missing mips, most recently used first
+  uint64_t framesInFlight = uint64_t(m_renderer.getFramesInFlight());
+
+  std::vector<std::pair<uint64_t, int>> candidates;
+  for (auto& [index, entry] : m_entries)
+  {
+    bool missing = entry.residentBytes == 0 || entry.residentMip > 0;
+    if (missing && entry.used && !entry.loading && !entry.failed && entry.lastUsed + framesInFlight >= m_frame) candidates.push_back({ entry.lastUsed, index });
+  }
+  std::sort(candidates.rbegin(), candidates.rend());
+
+  for (auto [lastUsed, index] : candidates)
+  {
+    if (m_loads.size() >= m_maxLoads) break;
+
+    Entry& entry = m_entries[index];
+
+    vk::DeviceSize bytes = entry.levels > 0 ? LevelBytes(entry.extent, entry.levels, entry.block, 0) - entry.residentBytes : 0;
+    if (bytes > headroom) continue;
+
+    headroom -= bytes;
+    StartLoad(index, entry, 0);
+  }
+}
+
+void TextureResidency::Update(uint64_t frame)
+{
+  m_frame = frame;
+
+  uint64_t framesInFlight = uint64_t(m_renderer.getFramesInFlight());
+  m_releasing.erase(std::remove_if(m_releasing.begin(), m_releasing.end(), [&](const Releasing& r) { return r.frame + framesInFlight <= frame; }), m_releasing.end());
+
+  FinishUploads();
+
+  // Counts what is already on its way in or out, so the same pressure isn't acted on twice
+  MemoryAllocator::Budget budget = m_renderer.getMemoryAllocator().GetDeviceLocalBudget();
+  int64_t usage = int64_t(budget.usage);
+  for (auto& load : m_loads) usage += int64_t(load.newBytes) - int64_t(load.oldBytes);
+  for (auto& upload : m_uploads) usage -= int64_t(upload.oldBytes);
+  for (auto& releasing : m_releasing) usage -= int64_t(releasing.bytes);
+
+  int64_t limit = int64_t(double(budget.budget) * m_budgetFraction);
+  int64_t headroom = limit - usage;
+
+  FinishLoads(headroom);
+
+  if (usage > limit) Reclaim(vk::DeviceSize(usage - limit));
+  else StreamIn(vk::DeviceSize(std::max<int64_t>(headroom, 0)));
+}
+
+TextureResidency::Stats TextureResidency::GetStats() const
+{
+  Stats stats;
+  for (auto& [index, entry] : m_entries)
+  {
+    stats.textures++;
+    stats.residentBytes += entry.residentBytes;
+
+    if (entry.loading) stats.loading++;
+
+    if (entry.residentBytes == 0) stats.evicted++;
+    else if (entry.residentMip > 0) stats.demoted++;
+    else stats.full++;
+  }
+
+  return stats;
+}
+
+TextureResidency::TextureResidency(TextureSystem& textures, Renderer& renderer)
+  : m_textures(textures), m_renderer(renderer)
+{
+}
+
+TextureResidency::~TextureResidency()
+{
+  for (auto& load : m_loads) load.done.wait();
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "berkeley_gfx.hpp"
+#include "ktx2.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <functional>
+#include <future>
+#include <unordered_map>
+
+namespace BG
+{
+
+  // Keeps the streamed textures of a TextureSystem within the device local memory budget. Under pressure the
+  // least recently used ones lose their top mips, or go back to the placeholder if unused for long. Textures
+  // marked used are streamed back in on the worker pool and the streaming uploader when there is room.
+  class TextureResidency
+  {
+  public:
+    // Produces the texture with all its mips. Called on a worker thread, may throw.
+    using Source = std::function<Ktx2Texture()>;
+
+    struct Stats
+    {
+      uint32_t textures = 0;
+      uint32_t full = 0;    // Every mip resident
+      uint32_t demoted = 0; // Missing top mips
+      uint32_t evicted = 0; // Sampling the placeholder
+      uint32_t loading = 0;
+      vk::DeviceSize residentBytes = 0;
+    };
+
+  private:
+    struct Entry
+    {
+      uint64_t id;
+      Source source;
+      uint64_t lastUsed = 0;
+      bool used = false; // Marked used at least once
+      bool loading = false;
+      bool failed = false;
+
+      // Known after the first load
+      vk::Format format = vk::Format::eUndefined;
+      glm::uvec2 extent = glm::uvec2(0);
+      uint32_t levels = 0;
+      TexelBlock block;
+
+      // First resident mip, 0 resident bytes while evicted
+      uint32_t residentMip = 0;
+      vk::DeviceSize residentBytes = 0;
+    };
+
+    struct Load
+    {
+      uint64_t id;
+      int index;
+      uint32_t firstMip;
+      vk::DeviceSize oldBytes;
+      vk::DeviceSize newBytes; // Estimated, 0 before the first load
+      std::shared_ptr<Ktx2Texture> texture;
+      std::future<void> done;
+    };
+
+    struct Upload
+    {
+      uint64_t id;
+      int index;
+      uint32_t firstMip;
+      vk::DeviceSize oldBytes;
+      vk::DeviceSize newBytes;
+      std::unique_ptr<Image> image;
+      std::shared_future<void> ready;
+    };
+
+    // Replaced images, still counted by VMA until the frames in flight are done
+    struct Releasing
+    {
+      vk::DeviceSize bytes;
+      uint64_t frame;
+    };
+
+    TextureSystem& m_textures;
+    Renderer& m_renderer;
+
+    std::unordered_map<int, Entry> m_entries; // By Handle::index
+    uint64_t m_nextId = 0;
+
+    std::vector<Load> m_loads;
+    std::vector<Upload> m_uploads;
+    std::vector<Releasing> m_releasing;
+    uint64_t m_frame = 0;
+
+    float m_budgetFraction = 0.9f;
+    uint64_t m_evictAfterFrames = 300;
+    uint32_t m_maxLoads = 4;
+
+    static vk::DeviceSize LevelBytes(glm::uvec2 extent, uint32_t levels, TexelBlock block, uint32_t firstMip);
+
+    void StartLoad(int index, Entry& entry, uint32_t firstMip);
+    // Headroom is signed, negative while over the limit
+    void FinishLoads(int64_t& headroom);
+    void FinishUploads();
+    void Evict(int index, Entry& entry);
+    void Reclaim(vk::DeviceSize excess);
+    void StreamIn(vk::DeviceSize headroom);
+
+  public:
+    // The TextureSystem calls these
+    void Add(int index, Source source);
+    void Remove(int index);
+    inline bool Contains(int index) const { return m_entries.count(index) > 0; }
+    void MarkUsed(int index, uint64_t frame);
+    void Update(uint64_t frame);
+
+    // Pressure starts above this fraction of the device local budget
+    inline void SetBudgetFraction(float fraction) { m_budgetFraction = fraction; }
+    // Under pressure, textures unused for this many frames are evicted instead of demoted
+    inline void SetEvictAfterFrames(uint64_t frames) { m_evictAfterFrames = frames; }
+    // Textures being read on the worker pool at once
+    inline void SetMaxLoads(uint32_t loads) { m_maxLoads = loads; }
+
+    Stats GetStats() const;
+
+    TextureResidency(TextureSystem& textures, Renderer& renderer);
+    // Waits for the loads on the worker pool
+    ~TextureResidency();
+  };
+
+}
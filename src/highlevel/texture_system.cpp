@@ -2,78 +2,515 @@
 
 #include "buffer.hpp"
 #include "renderer.hpp"
-#include "command_buffer.hpp"
+#include "streaming_uploader.hpp"
+#include "upload_batch.hpp"
+#include "lifetime_tracker.hpp"
+#include "worker_pool.hpp"
+#include "ktx2.hpp"
+#include "texture_residency.hpp"
+#include "sampler_cache.hpp"
+#include "descriptor_cache.hpp"
+#include "framebuffer_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
 
 using namespace BG;
 
-TextureSystem::Handle TextureSystem::AddTexture(uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format)
+// Channel count of the 8 bit formats the CPU downsampler handles, 0 for the others
+static uint32_t MipChannels(vk::Format format, bool& srgb)
 {
-  auto image = m_allocator.AllocImage2D(glm::uvec2(width, height), 1, format, vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled, vk::ImageLayout::eUndefined);
+  srgb = false;
 
-  int index = int(m_images.size());
+  switch (format)
+  {
+  case vk::Format::eR8Unorm: return 1;
+  case vk::Format::eR8G8Unorm: return 2;
+  case vk::Format::eR8G8B8Unorm: return 3;
+  case vk::Format::eR8G8B8A8Unorm: return 4;
+  case vk::Format::eB8G8R8A8Unorm: return 4;
+  case vk::Format::eR8G8B8Srgb: srgb = true; return 3;
+  case vk::Format::eR8G8B8A8Srgb: srgb = true; return 4;
+  case vk::Format::eB8G8R8A8Srgb: srgb = true; return 4;
+  default: return 0;
+  }
+}
+
+struct SrgbTables
+{
+  float toLinear[256];
+  uint8_t fromLinear[4096];
+
+  SrgbTables()
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      float c = float(i) / 255.0f;
+      toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    for (int i = 0; i < 4096; i++)
+    {
+      float l = float(i) / 4095.0f;
+      float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+      fromLinear[i] = uint8_t(c * 255.0f + 0.5f);
+    }
+  }
+};
+
+bool TextureSystem::CanBlit(vk::Format format)
+{
+  auto it = m_canBlit.find(VkFormat(format));
+  if (it != m_canBlit.end()) return it->second;
+
+  auto features = m_renderer.getPhysicalDevice().getFormatProperties(format).optimalTilingFeatures;
+  auto required = vk::FormatFeatureFlagBits::eBlitSrc | vk::FormatFeatureFlagBits::eBlitDst | vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+
+  bool canBlit = (features & required) == required;
+  m_canBlit[VkFormat(format)] = canBlit;
+
+  return canBlit;
+}
+
+std::vector<uint8_t> TextureSystem::GenerateMipsCPU(WorkerPool& workers, const uint8_t* data, size_t size, glm::uvec2 extent, uint32_t levels, vk::Format format)
+{
+  bool srgb;
+  uint32_t channels = MipChannels(format, srgb);
+  if (channels == 0 || size < size_t(extent.x) * extent.y * channels) return {};
+
+  std::vector<size_t> offsets(levels);
+  size_t total = 0;
+  for (uint32_t level = 0; level < levels; level++)
+  {
+    glm::uvec2 levelExtent = glm::max(extent >> level, glm::uvec2(1));
+    offsets[level] = total;
+    total += size_t(levelExtent.x) * levelExtent.y * channels;
+  }
+
+  std::vector<uint8_t> mips(total);
+  std::copy(data, data + size_t(extent.x) * extent.y * channels, mips.begin());
+
+  static const SrgbTables tables;
+
+  // Each level is split into blocks of rows across the workers. The inner loops are plain integer / table
+  // arithmetic the compiler can vectorize.
+  const uint32_t rowsPerTask = 16;
 
+  for (uint32_t level = 1; level < levels; level++)
+  {
+    glm::uvec2 srcExtent = glm::max(extent >> (level - 1), glm::uvec2(1));
+    glm::uvec2 dstExtent = glm::max(extent >> level, glm::uvec2(1));
+    const uint8_t* src = mips.data() + offsets[level - 1];
+    uint8_t* dst = mips.data() + offsets[level];
+
+    uint32_t numTasks = (dstExtent.y + rowsPerTask - 1) / rowsPerTask;
+
+    workers.ParallelFor(numTasks, [&](uint32_t task) {
+      uint32_t rowEnd = std::min(dstExtent.y, (task + 1) * rowsPerTask);
+
+      for (uint32_t y = task * rowsPerTask; y < rowEnd; y++)
+      {
+        // Odd sizes clamp to the last row / column
+        const uint8_t* row0 = src + size_t(std::min(2 * y, srcExtent.y - 1)) * srcExtent.x * channels;
+        const uint8_t* row1 = src + size_t(std::min(2 * y + 1, srcExtent.y - 1)) * srcExtent.x * channels;
+        uint8_t* out = dst + size_t(y) * dstExtent.x * channels;
+
+        for (uint32_t x = 0; x < dstExtent.x; x++)
+        {
+          uint32_t x0 = std::min(2 * x, srcExtent.x - 1) * channels;
+          uint32_t x1 = std::min(2 * x + 1, srcExtent.x - 1) * channels;
+
+          for (uint32_t c = 0; c < channels; c++)
+          {
+            uint8_t a = row0[x0 + c], b = row0[x1 + c], d = row1[x0 + c], e = row1[x1 + c];
+
+            // Alpha is always linear
+            if (srgb && c < 3)
+            {
+              float l = (tables.toLinear[a] + tables.toLinear[b] + tables.toLinear[d] + tables.toLinear[e]) * 0.25f;
+              out[x * channels + c] = tables.fromLinear[int(l * 4095.0f + 0.5f)];
+            }
+            else
+            {
+              out[x * channels + c] = uint8_t((uint32_t(a) + b + d + e + 2) / 4);
+            }
+          }
+        }
+      }
+    });
+  }
+
+  return mips;
+}
+
+std::unique_ptr<Image> TextureSystem::CreateImage(int width, int height, uint32_t levels, vk::Format format)
+{
+  vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled;
+  if (levels > 1) usage |= vk::ImageUsageFlagBits::eTransferSrc;
+
+  return m_allocator.AllocImage2D(glm::uvec2(width, height), levels, format, usage, vk::ImageLayout::eUndefined);
+}
+
+vk::UniqueImageView TextureSystem::CreateView(Image& image, vk::Format format, uint32_t levels)
+{
   vk::ImageViewCreateInfo viewInfo;
-  viewInfo.image = image->image;
+  viewInfo.image = image.image;
   viewInfo.viewType = vk::ImageViewType::e2D;
   viewInfo.format = format;
   viewInfo.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
   viewInfo.subresourceRange.baseMipLevel = 0;
-  viewInfo.subresourceRange.levelCount = 1;
+  viewInfo.subresourceRange.levelCount = levels;
   viewInfo.subresourceRange.baseArrayLayer = 0;
   viewInfo.subresourceRange.layerCount = 1;
 
-  auto stagingBuffer = m_allocator.AllocCPU2GPU(size, vk::BufferUsageFlagBits::eTransferSrc);
-  uint8_t* stagingBufferGPU = stagingBuffer->Map<uint8_t>();
-  std::copy(imageBuffer, imageBuffer + size, stagingBufferGPU);
-  stagingBuffer->UnMap();
-
-  vk::BufferImageCopy copy;
-  copy.bufferOffset = 0;
-  copy.bufferRowLength = width;
-  copy.bufferImageHeight = height;
-  copy.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
-  copy.imageSubresource.mipLevel = 0;
-  copy.imageSubresource.baseArrayLayer = 0;
-  copy.imageSubresource.layerCount = 1;
-  copy.imageExtent.width = width;
-  copy.imageExtent.height = height;
-  copy.imageExtent.depth = 1;
-  copy.imageOffset.x = 0;
-  copy.imageOffset.y = 0;
-  copy.imageOffset.z = 0;
-  
-  auto _cmdBuf = m_renderer.AllocCmdBuffer();
-  CommandBuffer cmdBuf(m_device, _cmdBuf.get(), m_renderer.getTracker());
-
-  cmdBuf.Begin();
-  cmdBuf.ImageTransition(*image, vk::PipelineStageFlagBits::eBottomOfPipe, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal);
-  cmdBuf.GetVkCmdBuf().copyBufferToImage(stagingBuffer->buffer, image->image, vk::ImageLayout::eTransferDstOptimal, 1, &copy);
-  cmdBuf.ImageTransition(*image, vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
-  cmdBuf.End();
-
-  m_images.push_back(std::move(image));
-  m_imageViews.push_back(m_device.createImageViewUnique(viewInfo));
-
-  m_renderer.SubmitCmdBufferNow(cmdBuf.GetVkCmdBuf());
+  return m_device.createImageViewUnique(viewInfo);
+}
+
+int TextureSystem::TakeIndex()
+{
+  int index = int(m_images.size());
+  if (!m_freeIndices.empty())
+  {
+    index = m_freeIndices.back();
+    m_freeIndices.pop_back();
+  }
+  else if (!m_tableSets.empty() && index >= int(MAX_TEXTURES))
+  {
+    spdlog::error("Texture table is full ({} textures)", MAX_TEXTURES);
+    throw std::runtime_error("Too many textures");
+  }
+
+  if (index == int(m_images.size()))
+  {
+    m_images.emplace_back();
+    m_imageViews.emplace_back();
+    m_samplers.emplace_back();
+  }
+
+  m_samplers[index] = m_defaultSampler;
+
+  return index;
+}
+
+TextureSystem::Handle TextureSystem::Insert(std::unique_ptr<Image> image, vk::Format format, uint32_t levels)
+{
+  int index = TakeIndex();
+
+  m_imageViews[index] = CreateView(*image, format, levels);
+  m_images[index] = std::move(image);
+
+  // Sampling must still wait for the upload, but the descriptor can be written now
+  QueueWrite(index, true);
 
   return Handle{ index };
 }
 
+void TextureSystem::QueueWrite(int index, bool added)
+{
+  bool updateAfterBind = m_renderer.m_hasDescriptorUpdateAfterBind;
+
+  // Without update-after-bind, a set can only be written once its frame slot is done. Existing indices may be
+  // sampled by the frames in flight, each one keeps using what its set held.
+  for (size_t set = 0; set < m_tableSets.size(); set++)
+  {
+    if (added && updateAfterBind) WriteTable(m_tableSets[set], index);
+    else m_pendingWrites[set].push_back(index);
+  }
+}
+
+void TextureSystem::Dispose(int index)
+{
+  if (m_imageViews[index])
+  {
+    m_renderer.getFramebufferCache().InvalidateImageView(m_imageViews[index].get());
+    m_renderer.getDescriptorCache().InvalidateImageView(m_imageViews[index].get());
+    m_renderer.getTracker().DisposeImageView(std::move(m_imageViews[index]));
+  }
+  if (m_images[index]) m_renderer.getTracker().DisposeImage(std::move(m_images[index]));
+}
+
+void TextureSystem::Replace(int index, std::unique_ptr<Image> image, vk::Format format, uint32_t levels)
+{
+  Dispose(index);
+
+  if (image) m_imageViews[index] = CreateView(*image, format, levels);
+  m_images[index] = std::move(image);
+
+  QueueWrite(index, false);
+}
+
+void TextureSystem::CheckSampleable(vk::Format format)
+{
+  auto features = m_renderer.getPhysicalDevice().getFormatProperties(format).optimalTilingFeatures;
+  if (!(features & vk::FormatFeatureFlagBits::eSampledImage))
+  {
+    spdlog::error("Texture format {} can't be sampled on this device", vk::to_string(format));
+    throw std::runtime_error("Unsupported texture format");
+  }
+}
+
+void TextureSystem::CreatePlaceholder()
+{
+  const uint8_t grey[4] = { 128, 128, 128, 255 };
+
+  m_placeholder = CreateImage(1, 1, 1, vk::Format::eR8G8B8A8Unorm);
+  m_placeholderView = CreateView(*m_placeholder, vk::Format::eR8G8B8A8Unorm, 1);
+
+  UploadBatch batch(m_renderer);
+  batch.UploadImage(*m_placeholder, glm::uvec2(1), grey, sizeof(grey));
+}
+
+TextureSystem::Handle TextureSystem::AddStreamedTexture(std::function<Ktx2Texture()> source)
+{
+  int index = TakeIndex();
+  m_residency->Add(index, std::move(source));
+
+  QueueWrite(index, true);
+
+  return Handle{ index };
+}
+
+TextureSystem::Handle TextureSystem::AddStreamedTexture(const std::string& ktx2Path)
+{
+  return AddStreamedTexture([ktx2Path]() { return Ktx2Texture::Load(ktx2Path); });
+}
+
+SamplerDesc TextureSystem::DefaultSamplerDesc()
+{
+  SamplerDesc desc;
+  desc.maxAnisotropy = 16.0f;
+
+  return desc;
+}
+
+void TextureSystem::SetSampler(Handle handle, const SamplerDesc& desc)
+{
+  vk::Sampler sampler = m_renderer.getSamplerCache().Get(desc);
+  if (sampler == m_samplers[handle.index]) return;
+
+  m_samplers[handle.index] = sampler;
+  QueueWrite(handle.index, false);
+}
+
+void TextureSystem::MarkUsed(Handle handle)
+{
+  m_residency->MarkUsed(handle.index, m_frame);
+}
+
+TextureSystem::PendingTexture TextureSystem::AddTextureAsync(uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format)
+{
+  glm::uvec2 extent = glm::uvec2(width, height);
+  uint32_t levels = UploadBatch::FullMipLevels(extent);
+
+  // The transfer queue can't blit, mips come from the CPU
+  std::vector<uint8_t> mips;
+  if (m_mipGeneration != MipGeneration::None) mips = GenerateMipsCPU(m_renderer.getWorkerPool(), imageBuffer, size, extent, levels, format);
+  if (mips.empty()) levels = 1;
+
+  Handle handle = Insert(CreateImage(width, height, levels, format), format, levels);
+  Image& image = *m_images[handle.index];
+
+  StreamingUploader::Ticket ready;
+  if (levels > 1)
+  {
+    bool srgb;
+    ready = m_renderer.getUploader().UploadImageMips(image, extent, levels, TexelBlock{ 1, 1, MipChannels(format, srgb) }, mips.data(), mips.size());
+  }
+  else
+  {
+    ready = m_renderer.getUploader().UploadImage(image, extent, imageBuffer, size);
+  }
+
+  return PendingTexture{ handle, ready };
+}
+
+TextureSystem::Handle TextureSystem::AddTexture(UploadBatch& batch, uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format)
+{
+  glm::uvec2 extent = glm::uvec2(width, height);
+  uint32_t levels = UploadBatch::FullMipLevels(extent);
+
+  if (m_mipGeneration == MipGeneration::Blit && CanBlit(format))
+  {
+    Handle handle = Insert(CreateImage(width, height, levels, format), format, levels);
+    batch.UploadImageBlitMips(*m_images[handle.index], extent, levels, imageBuffer, size);
+
+    return handle;
+  }
+
+  std::vector<uint8_t> mips;
+  if (m_mipGeneration != MipGeneration::None) mips = GenerateMipsCPU(m_renderer.getWorkerPool(), imageBuffer, size, extent, levels, format);
+
+  if (mips.empty())
+  {
+    Handle handle = Insert(CreateImage(width, height, 1, format), format, 1);
+    batch.UploadImage(*m_images[handle.index], extent, imageBuffer, size);
+
+    return handle;
+  }
+
+  bool srgb;
+  Handle handle = Insert(CreateImage(width, height, levels, format), format, levels);
+  batch.UploadImageMips(*m_images[handle.index], extent, levels, TexelBlock{ 1, 1, MipChannels(format, srgb) }, mips.data(), mips.size());
+
+  return handle;
+}
+
+void TextureSystem::RemoveTexture(Handle handle)
+{
+  bool streamed = m_residency->Contains(handle.index);
+  if (handle.index < 0 || handle.index >= int(m_images.size()) || (!m_images[handle.index] && !streamed))
+  {
+    spdlog::error("Removing invalid texture handle {}", handle.index);
+    throw std::runtime_error("Invalid texture handle");
+  }
+
+  if (streamed) m_residency->Remove(handle.index);
+
+  // The table entry is left as is, partially bound arrays may hold stale descriptors that aren't sampled
+  Dispose(handle.index);
+
+  m_freedIndices.push_back({ handle.index, m_frame });
+}
+
+void TextureSystem::NewFrame(int frameIndex)
+{
+  m_frame++;
+
+  // Frame `frame` is done once `framesInFlight` more frames have begun
+  uint64_t framesInFlight = uint64_t(m_renderer.getFramesInFlight());
+  for (auto it = m_freedIndices.begin(); it != m_freedIndices.end();)
+  {
+    if (it->frame + framesInFlight <= m_frame)
+    {
+      m_freeIndices.push_back(it->index);
+      it = m_freedIndices.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  // Swaps in streamed images before this slot's set is written
+  m_residency->Update(m_frame);
+
+  if (!m_tableSets.empty())
+  {
+    int set = frameIndex % int(m_tableSets.size());
+    for (int index : m_pendingWrites[set])
+    {
+      if (m_imageViews[index] || m_residency->Contains(index)) WriteTable(m_tableSets[set], index);
+    }
+    m_pendingWrites[set].clear();
+  }
+}
+
+void TextureSystem::WriteTable(vk::DescriptorSet set, int index)
+{
+  vk::DescriptorImageInfo imageInfo;
+  imageInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+  imageInfo.imageView = m_imageViews[index] ? m_imageViews[index].get() : m_placeholderView.get();
+  imageInfo.sampler = m_samplers[index];
+
+  vk::WriteDescriptorSet write;
+  write.dstSet = set;
+  write.dstBinding = 0;
+  write.dstArrayElement = uint32_t(index);
+  write.descriptorType = vk::DescriptorType::eCombinedImageSampler;
+  write.descriptorCount = 1;
+  write.pImageInfo = &imageInfo;
+
+  m_device.updateDescriptorSets(1, &write, 0, nullptr);
+}
+
+void TextureSystem::CreateTable()
+{
+  if (!m_renderer.m_hasDescriptorIndexing)
+  {
+    spdlog::warn("No descriptor indexing, the bindless texture table is disabled");
+    return;
+  }
+
+  bool updateAfterBind = m_renderer.m_hasDescriptorUpdateAfterBind;
+  uint32_t numSets = uint32_t(m_renderer.getFramesInFlight());
+
+  vk::DescriptorSetLayoutBinding binding;
+  binding.binding = 0;
+  binding.descriptorType = vk::DescriptorType::eCombinedImageSampler;
+  binding.descriptorCount = MAX_TEXTURES;
+  binding.stageFlags = vk::ShaderStageFlagBits::eAll;
+
+  vk::DescriptorBindingFlags bindingFlags = vk::DescriptorBindingFlagBits::ePartiallyBound;
+  if (updateAfterBind) bindingFlags |= vk::DescriptorBindingFlagBits::eUpdateAfterBind | vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending;
+
+  vk::DescriptorSetLayoutBindingFlagsCreateInfo layoutFlagsInfo;
+  layoutFlagsInfo.setBindingCount(1);
+  layoutFlagsInfo.setPBindingFlags(&bindingFlags);
+
+  vk::DescriptorSetLayoutCreateInfo layoutInfo;
+  layoutInfo.setBindingCount(1);
+  layoutInfo.setPBindings(&binding);
+  layoutInfo.setPNext(&layoutFlagsInfo);
+  if (updateAfterBind) layoutInfo.setFlags(vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool);
+
+  m_tableLayout = m_device.createDescriptorSetLayoutUnique(layoutInfo);
+
+  vk::DescriptorPoolSize poolSize{ vk::DescriptorType::eCombinedImageSampler, MAX_TEXTURES * numSets };
+
+  vk::DescriptorPoolCreateInfo poolInfo;
+  poolInfo.setPoolSizes(poolSize);
+  poolInfo.maxSets = numSets;
+  if (updateAfterBind) poolInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind);
+
+  m_tablePool = m_device.createDescriptorPoolUnique(poolInfo);
+
+  std::vector<vk::DescriptorSetLayout> layouts(numSets, m_tableLayout.get());
+
+  vk::DescriptorSetAllocateInfo allocInfo;
+  allocInfo.descriptorPool = m_tablePool.get();
+  allocInfo.setSetLayouts(layouts);
+
+  m_tableSets = m_device.allocateDescriptorSets(allocInfo);
+  m_pendingWrites.resize(numSets);
+}
+
+TextureSystem::Handle TextureSystem::AddTexture(uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format)
+{
+  UploadBatch batch(m_renderer);
+
+  return AddTexture(batch, imageBuffer, width, height, size, format);
+}
+
+TextureSystem::Handle TextureSystem::AddTexture(UploadBatch& batch, const Ktx2Texture& texture)
+{
+  CheckSampleable(texture.format);
+
+  auto image = m_allocator.AllocImage2D(texture.extent, texture.levels, texture.format, vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled, vk::ImageLayout::eUndefined);
+
+  Handle handle = Insert(std::move(image), texture.format, texture.levels);
+  batch.UploadImageMips(*m_images[handle.index], texture.extent, texture.levels, texture.block, texture.data.data(), texture.data.size());
+
+  return handle;
+}
+
+TextureSystem::Handle TextureSystem::AddTexture(const Ktx2Texture& texture)
+{
+  UploadBatch batch(m_renderer);
+
+  return AddTexture(batch, texture);
+}
+
 TextureSystem::TextureSystem(vk::Device device, MemoryAllocator& allocator, Renderer& renderer)
   : m_device(device), m_allocator(allocator), m_renderer(renderer)
 {
-  vk::SamplerCreateInfo samplerInfo;
-  samplerInfo.magFilter = vk::Filter::eLinear;
-  samplerInfo.minFilter = vk::Filter::eLinear;
-  samplerInfo.addressModeU = vk::SamplerAddressMode::eRepeat;
-  samplerInfo.addressModeV = vk::SamplerAddressMode::eRepeat;
-  samplerInfo.addressModeW = vk::SamplerAddressMode::eRepeat;
-  samplerInfo.compareEnable = false;
-  samplerInfo.compareOp = vk::CompareOp::eAlways;
-  samplerInfo.mipmapMode = vk::SamplerMipmapMode::eLinear;
-  samplerInfo.mipLodBias = 0.0;
-  samplerInfo.minLod = 0.0;
-  samplerInfo.maxLod = 0.0;
-
-  m_samplerBilinear = m_device.createSamplerUnique(samplerInfo);
+  m_defaultSampler = m_renderer.getSamplerCache().Get(DefaultSamplerDesc());
+
+  CreateTable();
+  CreatePlaceholder();
+
+  m_residency = std::make_unique<TextureResidency>(*this, m_renderer);
+}
+
+TextureSystem::~TextureSystem()
+{
 }
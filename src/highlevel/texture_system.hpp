@@ -4,6 +4,10 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include <functional>
+#include <future>
+#include <unordered_map>
+
 namespace BG
 {
 
@@ -14,25 +18,147 @@ namespace BG
     MemoryAllocator& m_allocator;
     Renderer& m_renderer;
 
+    // Indexed by Handle, null for removed and evicted textures
     std::vector<std::unique_ptr<Image>> m_images;
     std::vector<vk::UniqueImageView> m_imageViews;
 
-    vk::UniqueSampler m_samplerBilinear;
+    // 1x1 grey, bound in place of evicted streamed textures
+    std::unique_ptr<Image> m_placeholder;
+    vk::UniqueImageView m_placeholderView;
+
+    std::unique_ptr<TextureResidency> m_residency;
+
+    // From the renderer's SamplerCache, per Handle. Added textures start with the default one.
+    std::vector<vk::Sampler> m_samplers;
+    vk::Sampler m_defaultSampler;
+
+    std::unordered_map<VkFormat, bool> m_canBlit;
+
+    // Bindless table, binding 0 is an array indexed by Handle::index. One set per frame slot, written when the
+    // slot is reused. With update-after-bind, indices of added textures are written to every set right away.
+    vk::UniqueDescriptorSetLayout m_tableLayout;
+    vk::UniqueDescriptorPool m_tablePool;
+    std::vector<vk::DescriptorSet> m_tableSets;
+    std::vector<std::vector<int>> m_pendingWrites; // Per set
+
+    // Removed indices, reusable once the frames that may sample them are done
+    struct FreedIndex
+    {
+      int index;
+      uint64_t frame;
+    };
+    std::vector<FreedIndex> m_freedIndices;
+    std::vector<int> m_freeIndices;
+    uint64_t m_frame = 0;
+
+    void CreateTable();
+    void WriteTable(vk::DescriptorSet set, int index);
+    // `added` indices aren't sampled by the frames in flight yet
+    void QueueWrite(int index, bool added);
+    // Drops cached descriptor sets and framebuffers using the view, then disposes of the view and image
+    void Dispose(int index);
 
   public:
+    static const uint32_t MAX_TEXTURES = 4096;
+
+    // How the mip chain of added textures is filled
+    enum class MipGeneration
+    {
+      None,
+      // Linear blits on the GPU, falls back to CPU for formats that can't be blitted or on the transfer queue
+      Blit,
+      // 2x2 box filter on the worker pool, in linear space for sRGB formats. 8 bit UNORM / SRGB formats only,
+      // others get a single level.
+      CPU,
+    };
+
     struct Handle
     {
       int index;
     };
 
+    struct PendingTexture
+    {
+      Handle handle;
+      std::shared_future<void> ready; // Don't sample before this is ready
+    };
+
+  private:
+    MipGeneration m_mipGeneration = MipGeneration::Blit;
+
+    bool CanBlit(vk::Format format);
+
+    std::unique_ptr<Image> CreateImage(int width, int height, uint32_t levels, vk::Format format);
+    vk::UniqueImageView CreateView(Image& image, vk::Format format, uint32_t levels);
+    void CreatePlaceholder();
+    int TakeIndex();
+    // Takes an index and creates the view. Call before recording the upload, so a full table throws before
+    // anything references the image.
+    Handle Insert(std::unique_ptr<Image> image, vk::Format format, uint32_t levels);
+
+    friend class TextureResidency;
+
+    void CheckSampleable(vk::Format format);
+    // Swaps the image of a streamed texture, null for the placeholder. The old one is disposed through the tracker.
+    void Replace(int index, std::unique_ptr<Image> image, vk::Format format, uint32_t levels);
+
+  public:
+    // Queues the upload on the renderer's streaming uploader, the view is created right away
+    PendingTexture AddTextureAsync(uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format = vk::Format::eR8G8B8Srgb);
+
+    // Records the upload into `batch`, don't sample before the batch is submitted
+    Handle AddTexture(UploadBatch& batch, uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format = vk::Format::eR8G8B8Srgb);
+
+    // Blocks until the texture is uploaded. Use an UploadBatch to add many at once.
     Handle AddTexture(uint8_t* imageBuffer, int width, int height, size_t size, vk::Format format = vk::Format::eR8G8B8Srgb);
 
+    // Uploads the texture's own format (e.g. BCn / ETC2 / ASTC) and mips as is. Throws if the device can't
+    // sample the format.
+    Handle AddTexture(UploadBatch& batch, const Ktx2Texture& texture);
+    Handle AddTexture(const Ktx2Texture& texture);
+
+    // Starts as the placeholder. Loaded from `source` on the worker pool once marked used, and demoted / evicted
+    // by the residency manager under memory pressure. Textures that are never marked used stay unloaded.
+    Handle AddStreamedTexture(std::function<Ktx2Texture()> source);
+    Handle AddStreamedTexture(const std::string& ktx2Path);
+
+    // Call for each streamed texture the frame being recorded samples
+    void MarkUsed(Handle handle);
+
+    inline TextureResidency& GetResidency() { return *m_residency; }
+
+    // The table entry picks up the new sampler as its frame slots come around
+    void SetSampler(Handle handle, const SamplerDesc& desc);
+    // Trilinear, repeat, 16x anisotropic where supported
+    static SamplerDesc DefaultSamplerDesc();
+
+    // The image is destroyed once the frames in flight are done, its index is reused after that
+    void RemoveTexture(Handle handle);
+
+    // The MipGeneration::CPU downsampler. All the levels packed one after the other, mip 0 first, empty if the
+    // format isn't supported.
+    static std::vector<uint8_t> GenerateMipsCPU(WorkerPool& workers, const uint8_t* data, size_t size, glm::uvec2 extent, uint32_t levels, vk::Format format);
+
+    inline void SetMipGeneration(MipGeneration mode) { m_mipGeneration = mode; }
+    inline MipGeneration GetMipGeneration() const { return m_mipGeneration; }
+
+    // Called by the renderer once the frame slot is free
+    void NewFrame(int frameIndex);
+
+    // Persistent descriptor set with every texture at its Handle::index, bind it at a set other than 0 and
+    // declare it with Pipeline::SetExternalDescSetLayout. Null without descriptor indexing.
+    inline vk::DescriptorSetLayout GetDescSetLayout() { return m_tableLayout.get(); }
+    inline vk::DescriptorSet GetDescSet(int currentFrame) { return m_tableSets.empty() ? vk::DescriptorSet() : m_tableSets[currentFrame % m_tableSets.size()]; }
+
     TextureSystem(vk::Device device, MemoryAllocator& allocator, Renderer& renderer);
+    ~TextureSystem();
 
+    // Upper bound of the handle indices in use
     inline int GetNumImageViews() { return m_imageViews.size(); }
 
-    inline vk::ImageView GetImageView(Handle id) { return m_imageViews[id.index].get(); }
-    inline vk::Sampler GetSampler() { return m_samplerBilinear.get(); }
+    inline vk::ImageView GetImageView(Handle id) { return m_imageViews[id.index] ? m_imageViews[id.index].get() : m_placeholderView.get(); }
+    inline vk::Sampler GetSampler() { return m_defaultSampler; }
+    inline vk::Sampler GetSampler(Handle id) { return m_samplers[id.index]; }
   };
 
 }
\ No newline at end of file
@@ -4,6 +4,21 @@
 #include "buffer.hpp"
 #include "texture_system.hpp"
 #include "lifetime_tracker.hpp"
+#include "frame_stats.hpp"
+#include "gpu_profiler.hpp"
+#include "worker_pool.hpp"
+#include "command_pools.hpp"
+#include "streaming_uploader.hpp"
+#include "pipeline_cache.hpp"
+#include "shader_cache.hpp"
+#include "pipeline_object_cache.hpp"
+#include "framebuffer_cache.hpp"
+#include "descriptor_cache.hpp"
+#include "descriptor_allocator.hpp"
+#include "uniform_ring.hpp"
+#include "fence_pool.hpp"
+#include "upload_batch.hpp"
+#include "sampler_cache.hpp"
 
 #include "imgui.h"
 #include "backends/imgui_impl_glfw.h"
@@ -41,12 +56,39 @@ void BG::Renderer::InitVulkan()
   CreateInstance();
   PickPhysicalDevice();
   CreateDevice();
-  CreateSurface();
-  CreateSwapChain();
+  if (m_headless)
+  {
+    CreateOffscreenTargets();
+  }
+  else
+  {
+    CreateSurface();
+    CreateSwapChain();
+  }
   CreateCmdPools();
+  if (m_headless) TransitionOffscreenTargets();
   CreateCmdBuffers();
   CreateDescriptorPools();
   CreateSemaphore();
+
+  m_gpuProfiler = std::make_unique<BG::GpuProfiler>(
+    m_physicalDevice, m_device.get(), uint32_t(m_selectedPhyDeviceQueueIndices.graphics),
+    m_framesInFlight, m_hasPipelineStatistics);
+
+  m_threadCommandPools = std::make_unique<BG::ThreadCommandPools>(
+    m_device.get(), uint32_t(m_selectedPhyDeviceQueueIndices.graphics), m_framesInFlight);
+
+  m_uploader = std::make_unique<BG::StreamingUploader>(
+    m_device.get(), *m_stagingPool, *m_fencePool,
+    m_transferQueue, uint32_t(m_selectedPhyDeviceQueueIndices.transfer),
+    m_graphcisQueue, uint32_t(m_selectedPhyDeviceQueueIndices.graphics),
+    m_framesInFlight, m_uploadBudget);
+
+  m_shaderCache = std::make_unique<BG::ShaderCache>(m_shaderCacheDir);
+  m_pipelineObjectCache = std::make_unique<BG::PipelineObjectCache>();
+  m_framebufferCache = std::make_unique<BG::FramebufferCache>(m_device.get(), *m_tracker);
+  m_descriptorCache = std::make_unique<BG::DescriptorCache>(m_device.get(), m_framesInFlight);
+  m_uniformRing = std::make_unique<BG::UniformRing>(*m_memoryAllocator, m_physicalDevice, m_framesInFlight, m_uniformRingSize);
 }
 
 #include "embed_font.cpp"
@@ -189,18 +231,19 @@ void BG::Renderer::InitImGui()
   }
 
   // Setup Platform/Renderer backends
-  ImGui_ImplGlfw_InitForVulkan(m_window, true);
+  if (!m_headless) ImGui_ImplGlfw_InitForVulkan(m_window, true);
   ImGui_ImplVulkan_InitInfo init_info = {};
   init_info.Instance = m_instance.get();
   init_info.PhysicalDevice = m_physicalDevice;
   init_info.Device = m_device.get();
   init_info.QueueFamily = m_selectedPhyDeviceQueueIndices.graphics;
   init_info.Queue = m_graphcisQueue;
-  init_info.PipelineCache = nullptr;
+  init_info.PipelineCache = m_pipelineCache->Get();
   init_info.DescriptorPool = m_ImGuiDescPool;
   init_info.Allocator = nullptr;
-  init_info.MinImageCount = uint32_t(m_swapchainImages.size());
-  init_info.ImageCount = uint32_t(m_swapchainImages.size());
+  // ImGui rotates its vertex buffers per recording, which matches the GUI slots rather than the swapchain
+  init_info.MinImageCount = NUM_GUI_SLOTS;
+  init_info.ImageCount = NUM_GUI_SLOTS;
   init_info.CheckVkResultFn = nullptr;
   ImGui_ImplVulkan_Init(&init_info, m_ImGuiRenderPass.get());
 
@@ -234,10 +277,13 @@ void BG::Renderer::CreateInstance()
   // Initialize a Vulkan instance with the validation layers enabled and extensions required by glfw.
   std::vector<const char*> glfwExtensionsVec;
 
-  uint32_t glfwExtensionCount = 0;
-  const char** glfwExtensions;
-  glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-  for (uint32_t i = 0; i < glfwExtensionCount; i++) glfwExtensionsVec.push_back(glfwExtensions[i]);
+  if (!m_headless)
+  {
+    uint32_t glfwExtensionCount = 0;
+    const char** glfwExtensions;
+    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    for (uint32_t i = 0; i < glfwExtensionCount; i++) glfwExtensionsVec.push_back(glfwExtensions[i]);
+  }
 
   std::vector<const char*> instanceLayers;
   if (m_enableValidationLayers)
@@ -312,12 +358,17 @@ void BG::Renderer::PickPhysicalDevice()
       }
 
       if (queueFamily.queueFlags & vk::QueueFlagBits::eCompute) {
-        if (computeQueue == -1) computeQueue = i;
+        // Prefer a family without graphics, so compute can run asynchronously
+        if (computeQueue == -1 || ((queueFamilies[computeQueue].queueFlags & vk::QueueFlagBits::eGraphics) && !(queueFamily.queueFlags & vk::QueueFlagBits::eGraphics)))
+          computeQueue = i;
         spdlog::info("  - Compute");
       }
 
       if (queueFamily.queueFlags & vk::QueueFlagBits::eTransfer) {
-        if (transferQueue == -1) transferQueue = i;
+        // Prefer a dedicated (DMA) family, so streaming uploads don't compete with graphics / compute
+        auto dedicated = [](vk::QueueFlags flags) { return !(flags & (vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute)); };
+        if (transferQueue == -1 || (!dedicated(queueFamilies[transferQueue].queueFlags) && dedicated(queueFamily.queueFlags)))
+          transferQueue = i;
         spdlog::info("  - Transfer");
       }
 
@@ -332,8 +383,8 @@ void BG::Renderer::PickPhysicalDevice()
       m_physicalDevice = device;
 
       m_selectedPhyDeviceQueueIndices.graphics = graphicsQueue;
-      m_selectedPhyDeviceQueueIndices.compute = computeQueue;
-      m_selectedPhyDeviceQueueIndices.transfer = transferQueue;
+      m_selectedPhyDeviceQueueIndices.compute = computeQueue == -1 ? graphicsQueue : computeQueue;
+      m_selectedPhyDeviceQueueIndices.transfer = transferQueue == -1 ? graphicsQueue : transferQueue;
     }
   }
 }
@@ -352,7 +403,8 @@ void BG::Renderer::CreateDevice()
     queueCreateInfo.push_back({ {}, uint32_t(m_selectedPhyDeviceQueueIndices.compute), 1, &computeQueuePriority });
   }
 
-  if (m_selectedPhyDeviceQueueIndices.transfer != m_selectedPhyDeviceQueueIndices.graphics)
+  if (m_selectedPhyDeviceQueueIndices.transfer != m_selectedPhyDeviceQueueIndices.graphics &&
+    m_selectedPhyDeviceQueueIndices.transfer != m_selectedPhyDeviceQueueIndices.compute)
   {
     queueCreateInfo.push_back({ {}, uint32_t(m_selectedPhyDeviceQueueIndices.transfer), 1, &transferQueuePriority });
   }
@@ -364,11 +416,13 @@ void BG::Renderer::CreateDevice()
   auto deviceExtensionCapabilities = m_physicalDevice.enumerateDeviceExtensionProperties();
   auto deviceProperties = m_physicalDevice.getProperties();
 
-  deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  if (!m_headless) deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
   bool hasDescriptorIndexing = false;
   bool hasPhysicalDeviceProperties2 = false;
   bool hasMintenance3 = false;
+  bool hasCreationFeedback = false;
+  bool hasMemoryBudget = false;
 
   for (auto& cap : deviceExtensionCapabilities)
   {
@@ -390,6 +444,21 @@ void BG::Renderer::CreateDevice()
     {
       hasMintenance3 = true;
     }
+    if (name == VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME)
+    {
+      deviceExtensions.push_back(cap.extensionName);
+      hasCreationFeedback = true;
+    }
+    if (name == VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)
+    {
+      deviceExtensions.push_back(cap.extensionName);
+      hasMemoryBudget = true;
+    }
+    if (name == VK_KHR_SWAPCHAIN_EXTENSION_NAME && m_headless)
+    {
+      // Not presenting, but keeps ePresentSrcKHR a valid layout for pipelines written against a swapchain
+      deviceExtensions.push_back(cap.extensionName);
+    }
 
     spdlog::debug(cap.extensionName);
   }
@@ -408,10 +477,31 @@ void BG::Renderer::CreateDevice()
     m_hasDescriptorIndexing = true;
   }
 
+  if (deviceProperties.apiVersion < VK_API_VERSION_1_2 ||
+    !m_physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeatures>()
+    .get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore)
+  {
+    spdlog::error("The frame scheduler requires timeline semaphores (Vulkan 1.2)");
+    throw std::runtime_error("Timeline semaphores not supported");
+  }
+
   vk::PhysicalDeviceFeatures deviceFeatures;
 
+  if (m_physicalDevice.getFeatures().pipelineStatisticsQuery)
+  {
+    deviceFeatures.pipelineStatisticsQuery = true;
+    m_hasPipelineStatistics = true;
+  }
+
+  bool hasAnisotropy = m_physicalDevice.getFeatures().samplerAnisotropy;
+  deviceFeatures.samplerAnisotropy = hasAnisotropy;
+
   vk::DeviceCreateInfo deviceCreateInfo = { {}, queueCreateInfo, deviceLayers, deviceExtensions, &deviceFeatures };
 
+  vk::PhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeature;
+  timelineSemaphoreFeature.timelineSemaphore = true;
+  deviceCreateInfo.setPNext(&timelineSemaphoreFeature);
+
   vk::PhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeature;
   if (m_hasDescriptorIndexing)
   {
@@ -420,7 +510,17 @@ void BG::Renderer::CreateDevice()
     descriptorIndexingFeature.shaderSampledImageArrayNonUniformIndexing = true;
     descriptorIndexingFeature.runtimeDescriptorArray = true;
 
-    deviceCreateInfo.setPNext(&descriptorIndexingFeature);
+    // Lets the texture table be written while it's bound
+    auto supported = m_physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceDescriptorIndexingFeatures>()
+      .get<vk::PhysicalDeviceDescriptorIndexingFeatures>();
+    if (supported.descriptorBindingSampledImageUpdateAfterBind && supported.descriptorBindingUpdateUnusedWhilePending)
+    {
+      descriptorIndexingFeature.descriptorBindingSampledImageUpdateAfterBind = true;
+      descriptorIndexingFeature.descriptorBindingUpdateUnusedWhilePending = true;
+      m_hasDescriptorUpdateAfterBind = true;
+    }
+
+    timelineSemaphoreFeature.setPNext(&descriptorIndexingFeature);
   }
 
   m_device = m_physicalDevice.createDeviceUnique(deviceCreateInfo, nullptr);
@@ -445,12 +545,17 @@ void BG::Renderer::CreateDevice()
     m_transferQueue = m_graphcisQueue;
   }
 
-  if (!glfwGetPhysicalDevicePresentationSupport(m_instance.get(), m_physicalDevice, m_selectedPhyDeviceQueueIndices.graphics))
+  if (!m_headless && !glfwGetPhysicalDevicePresentationSupport(m_instance.get(), m_physicalDevice, m_selectedPhyDeviceQueueIndices.graphics))
   {
     throw std::runtime_error("No presentation support on the graphcis queue");
   }
 
-  m_memoryAllocator = std::make_unique<BG::MemoryAllocator>(m_physicalDevice, m_device.get(), m_instance.get(), MAX_FRAMES_IN_FLIGHT);
+  m_memoryAllocator = std::make_unique<BG::MemoryAllocator>(m_physicalDevice, m_device.get(), m_instance.get(), m_framesInFlight, hasMemoryBudget);
+  m_stagingPool = std::make_unique<BG::StagingPool>(*m_memoryAllocator);
+  m_fencePool = std::make_unique<BG::FencePool>(m_device.get());
+  m_samplerCache = std::make_unique<BG::SamplerCache>(m_device.get(), hasAnisotropy ? deviceProperties.limits.maxSamplerAnisotropy : 1.0f);
+
+  m_pipelineCache = std::make_unique<BG::PipelineCache>(m_physicalDevice, m_device.get(), m_pipelineCachePath, hasCreationFeedback);
 }
 
 void BG::Renderer::CreateSurface()
@@ -547,6 +652,63 @@ void BG::Renderer::CreateSwapChain()
 
   m_swapchainFormat = surfaceFormat.format;
 
+  CreateDepthImages();
+}
+
+void BG::Renderer::CreateOffscreenTargets()
+{
+  m_swapchainFormat = vk::Format::eR8G8B8A8Unorm;
+
+  spdlog::info("Headless rendering, {} offscreen images of {}x{}", m_numOffscreenImages, m_width, m_height);
+
+  for (int i = 0; i < m_numOffscreenImages; i++)
+  {
+    auto image = m_memoryAllocator->AllocImage2D(
+      glm::uvec2(m_width, m_height), 1, m_swapchainFormat,
+      vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eSampled);
+
+    vk::ImageViewCreateInfo imageviewInfo;
+
+    imageviewInfo.setImage(image->image);
+    imageviewInfo.setViewType(vk::ImageViewType::e2D);
+    imageviewInfo.setFormat(m_swapchainFormat);
+    imageviewInfo.setComponents({ vk::ComponentSwizzle::eIdentity, vk::ComponentSwizzle::eIdentity, vk::ComponentSwizzle::eIdentity, vk::ComponentSwizzle::eIdentity });
+    imageviewInfo.setSubresourceRange({ vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 });
+
+    m_swapchainImages.push_back(image->image);
+    m_swapchainImageViews.push_back(m_device->createImageViewUnique(imageviewInfo));
+    m_offscreenImages.push_back(std::move(image));
+  }
+
+  CreateDepthImages();
+}
+
+void BG::Renderer::TransitionOffscreenTargets()
+{
+  // Swapchain images are in ePresentSrcKHR once presented, the GUI render pass loads them in that layout
+  std::vector<vk::ImageMemoryBarrier> barriers;
+  for (auto& image : m_offscreenImages)
+  {
+    vk::ImageMemoryBarrier barrier;
+    barrier.oldLayout = vk::ImageLayout::eUndefined;
+    barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image->image;
+    barrier.subresourceRange = vk::ImageSubresourceRange{ vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+    barriers.push_back(barrier);
+  }
+
+  auto cmdBuf = AllocCmdBuffer();
+  cmdBuf->begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+  cmdBuf->pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr, barriers);
+  cmdBuf->end();
+
+  SubmitCmdBufferNow(cmdBuf.get(), true);
+}
+
+void BG::Renderer::CreateDepthImages()
+{
   for (int i = 0; i < m_swapchainImages.size(); i++)
   {
     auto image = m_memoryAllocator->AllocImage2D(glm::uvec2(m_width, m_height), 1, vk::Format::eD32Sfloat, vk::ImageUsageFlagBits::eDepthStencilAttachment);
@@ -570,53 +732,51 @@ void BG::Renderer::CreateCmdPools()
 {
   m_graphicsCmdPool = m_device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, uint32_t(m_selectedPhyDeviceQueueIndices.graphics) });
   m_guiCmdPool = m_device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, uint32_t(m_selectedPhyDeviceQueueIndices.graphics) });
+  m_guiSecondaryCmdPool = m_device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, uint32_t(m_selectedPhyDeviceQueueIndices.graphics) });
+  m_computeCmdPool = m_device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, uint32_t(m_selectedPhyDeviceQueueIndices.compute) });
 }
 
 void BG::Renderer::CreateCmdBuffers()
 {
-  for (int i = 0; i < m_swapchainImages.size(); i++)
+  for (int i = 0; i < m_framesInFlight; i++)
   {
     m_cmdBuffers.push_back(AllocCmdBuffer());
     m_ImGuiCmdBuffers.push_back(std::move(m_device->allocateCommandBuffersUnique({ m_guiCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]));
+    m_computeCmdBuffers.push_back(std::move(m_device->allocateCommandBuffersUnique({ m_computeCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]));
+  }
+
+  m_computeSerials.resize(m_framesInFlight, 0);
+
+  for (auto& slot : m_guiSlots)
+  {
+    slot.cmdBuf = std::move(m_device->allocateCommandBuffersUnique({ m_guiSecondaryCmdPool.get(), vk::CommandBufferLevel::eSecondary, 1 })[0]);
   }
 }
 
 void BG::Renderer::CreateSemaphore()
 {
-  for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  vk::StructureChain<vk::SemaphoreCreateInfo, vk::SemaphoreTypeCreateInfo> timelineInfo;
+  timelineInfo.get<vk::SemaphoreTypeCreateInfo>().semaphoreType = vk::SemaphoreType::eTimeline;
+  timelineInfo.get<vk::SemaphoreTypeCreateInfo>().initialValue = 0;
+
+  m_frameTimeline = m_device->createSemaphoreUnique(timelineInfo.get<vk::SemaphoreCreateInfo>());
+  m_computeTimeline = m_device->createSemaphoreUnique(timelineInfo.get<vk::SemaphoreCreateInfo>());
+
+  for (int i = 0; i < m_framesInFlight; i++)
   {
     m_imageAvailableSemaphores.push_back(m_device->createSemaphoreUnique({}));
-    m_renderFinishedSemaphores.push_back(m_device->createSemaphoreUnique({}));
-    m_inFlightFences.push_back(m_device->createFenceUnique({}));
   }
 
-  m_imagesInFlight.resize(m_swapchainImages.size(), nullptr);
+  // Released by presentation, which is tracked per image rather than per frame
+  for (int i = 0; i < m_swapchainImages.size(); i++)
+  {
+    m_renderFinishedSemaphores.push_back(m_device->createSemaphoreUnique({}));
+  }
 }
 
 void BG::Renderer::CreateDescriptorPools()
 {
-  std::vector<vk::DescriptorPoolSize> poolSizes = {
-      { vk::DescriptorType::eSampler, 1000 },
-      { vk::DescriptorType::eCombinedImageSampler, 1000 },
-      { vk::DescriptorType::eSampledImage, 1000 },
-      { vk::DescriptorType::eStorageImage, 1000 },
-      { vk::DescriptorType::eUniformTexelBuffer, 1000 },
-      { vk::DescriptorType::eStorageTexelBuffer, 1000 },
-      { vk::DescriptorType::eUniformBuffer, 1000 },
-      { vk::DescriptorType::eStorageBuffer, 1000 },
-      { vk::DescriptorType::eUniformBufferDynamic, 1000 },
-      { vk::DescriptorType::eStorageBufferDynamic, 1000 },
-      { vk::DescriptorType::eInputAttachment, 1000 }
-  };
-
-  vk::DescriptorPoolCreateInfo info;
-  info.setPoolSizes(poolSizes);
-  info.maxSets = 256;
-
-  for (int i = 0; i < m_swapchainImages.size(); i++)
-  {
-    m_descPools.push_back(m_device->createDescriptorPoolUnique(info));
-  }
+  m_descriptorAllocator = std::make_unique<BG::DescriptorAllocator>(m_device.get(), uint32_t(m_framesInFlight));
 }
 
 void BG::Renderer::DestroySwapChain()
@@ -625,8 +785,12 @@ void BG::Renderer::DestroySwapChain()
   m_swapchainImageViews.clear();
   m_depthImages.clear();
   m_depthImageViews.clear();
-  m_device->destroySwapchainKHR(m_swapchain.get());
-  m_swapchain.release();
+  m_offscreenImages.clear();
+  if (m_swapchain)
+  {
+    m_device->destroySwapchainKHR(m_swapchain.get());
+    m_swapchain.release();
+  }
 }
 
 void BG::Renderer::DestroyCmdPools()
@@ -635,29 +799,37 @@ void BG::Renderer::DestroyCmdPools()
   m_graphicsCmdPool.release();
   m_device->destroyCommandPool(m_guiCmdPool.get());
   m_guiCmdPool.release();
+  m_device->destroyCommandPool(m_guiSecondaryCmdPool.get());
+  m_guiSecondaryCmdPool.release();
+  m_device->destroyCommandPool(m_computeCmdPool.get());
+  m_computeCmdPool.release();
 }
 
 void BG::Renderer::DestroyCmdBuffers()
 {
   m_cmdBuffers.clear();
   m_ImGuiCmdBuffers.clear();
+  m_computeCmdBuffers.clear();
+  for (auto& slot : m_guiSlots) slot.cmdBuf.reset();
 }
 
 void BG::Renderer::DestroySemaphore()
 {
   m_imageAvailableSemaphores.clear();
   m_renderFinishedSemaphores.clear();
-  m_inFlightFences.clear();
+  m_frameTimeline.reset();
+  m_computeTimeline.reset();
 }
 
 void BG::Renderer::DestroyDescriptorPools()
 {
-  m_descPools.clear();
+  m_descriptorAllocator = nullptr;
   vkDestroyDescriptorPool(m_device.get(), m_ImGuiDescPool, nullptr);
 }
 
 void BG::Renderer::DestroySurface()
 {
+  if (!m_surface) return;
   vkDestroySurfaceKHR(m_instance.get(), m_surface.get(), nullptr);
   m_surface.release();
 }
@@ -671,7 +843,7 @@ void BG::Renderer::DestroyDevice()
 void BG::Renderer::DestroyImGui()
 {
   ImGui_ImplVulkan_Shutdown();
-  ImGui_ImplGlfw_Shutdown();
+  if (!m_headless) ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
 }
 
@@ -682,10 +854,26 @@ void BG::Renderer::DestroyImGuiSwapChain()
   m_ImGuiRenderPass.release();
 }
 
+static BG::Renderer::Options WindowedOptions(bool enableValidationLayers)
+{
+  BG::Renderer::Options options;
+  options.enableValidationLayers = enableValidationLayers;
+  return options;
+}
+
 BG::Renderer::Renderer(std::string name, bool enableValidationLayers)
-  : m_name(name), m_enableValidationLayers(enableValidationLayers), m_tracker(std::make_unique<BG::Tracker>(MAX_FRAMES_IN_FLIGHT))
+  : Renderer(name, WindowedOptions(enableValidationLayers))
+{
+}
+
+BG::Renderer::Renderer(std::string name, const Options& options)
+  : m_name(name), m_enableValidationLayers(options.enableValidationLayers), m_framesInFlight(std::max(options.framesInFlight, 1)), m_tracker(std::make_unique<BG::Tracker>(m_framesInFlight)),
+  m_headless(options.headless), m_width(options.width), m_height(options.height),
+  m_numOffscreenImages(std::max(options.numOffscreenImages, 1)), m_maxFrames(options.maxFrames), m_uploadBudget(options.uploadBudgetPerFrame), m_uniformRingSize(options.uniformRingSizePerFrame),
+  m_pipelineCachePath(options.pipelineCachePath), m_shaderCacheDir(options.shaderCacheDir),
+  m_frameStats(std::make_unique<BG::FrameStats>()), m_workerPool(std::make_unique<BG::WorkerPool>())
 {
-  InitWindow();
+  if (!m_headless) InitWindow();
   InitVulkan();
   InitImGui();
 
@@ -694,6 +882,10 @@ BG::Renderer::Renderer(std::string name, bool enableValidationLayers)
 
 BG::Renderer::~Renderer()
 {
+  // Framebuffers reference the swapchain / offscreen views destroyed below
+  m_framebufferCache = nullptr;
+  m_descriptorCache = nullptr;
+
   DestroyCmdBuffers();
   DestroyCmdPools();
   DestroySemaphore();
@@ -703,15 +895,102 @@ BG::Renderer::~Renderer()
 
   DestroyImGui();
   
+  m_uploader = nullptr;
+  m_uniformRing = nullptr;
   m_textureSystem = nullptr;
+  m_samplerCache = nullptr;
+  m_gpuProfiler = nullptr;
+  m_threadCommandPools = nullptr;
+  m_pipelineCache = nullptr;
+  m_shaderCache = nullptr;
+  m_pipelineObjectCache = nullptr;
   m_tracker = nullptr;
+  m_fencePool = nullptr;
+  m_stagingPool = nullptr;
   m_memoryAllocator = nullptr;
 
   DestroySurface();
   DestroyDevice();
 
-  glfwDestroyWindow(m_window);
-  glfwTerminate();
+  if (!m_headless)
+  {
+    glfwDestroyWindow(m_window);
+    glfwTerminate();
+  }
+}
+
+void BG::Renderer::UpdateGuiSlots(uint64_t lastSubmittedSerial, uint64_t completedSerial)
+{
+  int newest = -1;
+
+  for (int i = 0; i < NUM_GUI_SLOTS; i++)
+  {
+    auto& slot = m_guiSlots[i];
+    auto state = slot.state.load(std::memory_order_acquire);
+
+    if (state == GuiSlotState::Retired && slot.retireSerial <= completedSerial)
+    {
+      slot.state.store(GuiSlotState::Free, std::memory_order_release);
+    }
+    else if (state == GuiSlotState::Ready && (newest < 0 || slot.sequence > m_guiSlots[newest].sequence))
+    {
+      newest = i;
+    }
+  }
+
+  if (newest < 0) return;
+
+  // Stale ready slots have never been submitted, they can be reused right away
+  for (int i = 0; i < NUM_GUI_SLOTS; i++)
+  {
+    if (i != newest && m_guiSlots[i].state.load(std::memory_order_acquire) == GuiSlotState::Ready)
+    {
+      m_guiSlots[i].state.store(GuiSlotState::Free, std::memory_order_release);
+    }
+  }
+
+  if (m_currentGuiSlot >= 0)
+  {
+    auto& current = m_guiSlots[m_currentGuiSlot];
+    current.retireSerial = lastSubmittedSerial;
+    current.state.store(GuiSlotState::Retired, std::memory_order_release);
+  }
+
+  m_currentGuiSlot = newest;
+  m_guiSlots[newest].state.store(GuiSlotState::Current, std::memory_order_release);
+}
+
+void BG::Renderer::RecordGuiCmdBuffer(int frameIndex, int imageIndex)
+{
+  auto cmdBuf = m_ImGuiCmdBuffers[frameIndex].get();
+
+  cmdBuf.begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+
+  vk::ClearValue clearValue{};
+
+  vk::RenderPassBeginInfo info = {};
+  info.renderPass = m_ImGuiRenderPass.get();
+  info.framebuffer = m_ImGuiFramebuffer[imageIndex].get();
+  info.renderArea.extent.width = m_width;
+  info.renderArea.extent.height = m_height;
+  info.clearValueCount = 1;
+  info.pClearValues = &clearValue;
+
+  cmdBuf.beginRenderPass(info, vk::SubpassContents::eSecondaryCommandBuffers);
+
+  // Until the first GUI frame is ready the pass only keeps the image layout consistent
+  if (m_currentGuiSlot >= 0)
+  {
+    cmdBuf.executeCommands(m_guiSlots[m_currentGuiSlot].cmdBuf.get());
+  }
+
+  cmdBuf.endRenderPass();
+  cmdBuf.end();
+}
+
+void BG::Renderer::Stop()
+{
+  m_stopRequested = true;
 }
 
 void BG::Renderer::Run(std::function<void()> init, std::function<void(Context&)> render, std::function<void()> renderGUI, std::function<void()> cleanup)
@@ -719,169 +998,289 @@ void BG::Renderer::Run(std::function<void()> init, std::function<void(Context&)>
   init();
 
   int imageIndex = 0;
-  size_t currentFrame = 0;
 
-  std::mutex m;
-  std::condition_variable cv;
-  bool ready = false;
-  bool processed = false;
+  std::mutex guiWakeMutex;
+  std::condition_variable guiWake;
 
   std::thread guiThread([&] {
+    uint64_t sequence = 0;
+
     while (m_isRunning)
     {
-      // Wait until main thread starts new frame
-      std::unique_lock<std::mutex> lk(m);
-      cv.wait(lk, [&] { return ready; });
-      ready = false;
+      // Slots are used round-robin, so ImGui's own per-frame vertex buffers rotate with them
+      GuiSlot& slot = m_guiSlots[sequence % NUM_GUI_SLOTS];
+
+      // Sleep until there's new input and the slot has been recycled. The main thread notifies
+      // without taking the lock, a missed wakeup only costs one timeout.
+      {
+        std::unique_lock<std::mutex> lk(guiWakeMutex);
+        bool woken = guiWake.wait_for(lk, std::chrono::milliseconds(1), [&] {
+          return !m_isRunning ||
+            (m_guiBusy.load(std::memory_order_acquire) && slot.state.load(std::memory_order_acquire) == GuiSlotState::Free);
+          });
+
+        if (!woken) continue;
+      }
 
       if (!m_isRunning) break;
 
+      slot.state.store(GuiSlotState::Recording, std::memory_order_relaxed);
+
       ImGui_ImplVulkan_NewFrame();
       
       ImGui::NewFrame();
 
       renderGUI();
 
-      ImGui::Text("Last 100 frames took %fms", m_timeSpentLast100Frames * 1000.0);
-      ImGui::Text("FPS = %f", 100.0 / m_timeSpentLast100Frames);
+      ImGui::Begin("Frame Stats");
+      m_frameStats->RenderGUI();
+      ImGui::End();
+
+      ImGui::Begin("GPU Profiler");
+      m_gpuProfiler->RenderGUI();
+      ImGui::End();
+
+      ImGui::Begin("Memory");
+      m_memoryAllocator->RenderGUI();
+      ImGui::End();
 
       ImGui::Render();
       ImDrawData* draw_data = ImGui::GetDrawData();
 
       {
-        auto cmdBuf = m_ImGuiCmdBuffers[imageIndex].get();
-
-        cmdBuf.begin(vk::CommandBufferBeginInfo{ {}, nullptr });
+        auto cmdBuf = slot.cmdBuf.get();
 
-        vk::ClearValue clearValue{};
+        // Executed inside the main thread's ImGui render pass, possibly by several frames in flight
+        vk::CommandBufferInheritanceInfo inheritance;
+        inheritance.renderPass = m_ImGuiRenderPass.get();
+        inheritance.subpass = 0;
 
-        vk::RenderPassBeginInfo info = {};
-        info.renderPass = m_ImGuiRenderPass.get();
-        info.framebuffer = m_ImGuiFramebuffer[imageIndex].get();
-        info.renderArea.extent.width = m_width;
-        info.renderArea.extent.height = m_height;
-        info.clearValueCount = 1;
-        info.pClearValues = &clearValue;
-
-        cmdBuf.beginRenderPass(info, vk::SubpassContents::eInline);
+        cmdBuf.begin(vk::CommandBufferBeginInfo{
+          vk::CommandBufferUsageFlagBits::eRenderPassContinue | vk::CommandBufferUsageFlagBits::eSimultaneousUse,
+          &inheritance });
 
         ImGui_ImplVulkan_RenderDrawData(draw_data, cmdBuf);
 
-        cmdBuf.endRenderPass();
         cmdBuf.end();
       }
 
-      // GUI finished processing
-      processed = true;
-      lk.unlock();
-      cv.notify_one();
+      slot.sequence = ++sequence;
+      slot.state.store(GuiSlotState::Ready, std::memory_order_release);
+
+      // ImGui input belongs to the main thread again
+      m_guiBusy.store(false, std::memory_order_release);
     }
     });
 
   size_t frameCount = 0;
-  auto startTime = std::chrono::high_resolution_clock::now();
+  FrameStats::Timer frameTimer(*m_frameStats);
 
   auto startTimeSteady = std::chrono::steady_clock::now();
 
-  while (!glfwWindowShouldClose(m_window))
+  auto lastFrameTimeSteady = startTimeSteady;
+
+  while (!m_stopRequested && (m_headless || !glfwWindowShouldClose(m_window)))
   {
-    auto acquireNextImageResult = m_device->acquireNextImageKHR(m_swapchain.get(), UINT64_MAX, m_imageAvailableSemaphores[currentFrame].get(), nullptr);
+    int frameIndex = int(frameCount % m_framesInFlight);
+    uint64_t frameSerial = frameCount + 1;
 
-    if (acquireNextImageResult.result != vk::Result::eSuccess)
+    // Wait until the GPU is done with the last frame that used this slot, on both lanes
+    if (frameSerial > uint64_t(m_framesInFlight))
     {
-      spdlog::warn("Acquire next image failed!");
+      std::vector<vk::Semaphore> timelines = { m_frameTimeline.get() };
+      std::vector<uint64_t> waitValues = { frameSerial - m_framesInFlight };
+
+      if (m_computeSerials[frameIndex] > 0)
+      {
+        timelines.push_back(m_computeTimeline.get());
+        waitValues.push_back(m_computeSerials[frameIndex]);
+      }
+
+      vk::SemaphoreWaitInfo waitInfo;
+      waitInfo.setSemaphores(timelines);
+      waitInfo.setValues(waitValues);
+      if (m_device->waitSemaphores(waitInfo, UINT64_MAX) != vk::Result::eSuccess) throw std::runtime_error("Wait for frame timeline failed");
     }
 
-    imageIndex = acquireNextImageResult.value;
+    frameTimer.Lap(FrameStats::FrameWait);
 
-    if (m_imagesInFlight[imageIndex] != nullptr)
+    if (m_headless)
     {
-      if (m_device->waitForFences(1, &m_imagesInFlight[imageIndex]->get(), true, UINT64_MAX) != vk::Result::eSuccess) throw std::runtime_error("Wait for fence failed");
+      // Offscreen images are used round-robin, there is nothing to acquire
+      imageIndex = int(frameCount % m_swapchainImages.size());
     }
-    else if (std::find(m_imagesInFlight.begin(), m_imagesInFlight.end(), &m_inFlightFences[currentFrame]) != m_imagesInFlight.end())
+    else
     {
-      // This happens when there are more images than the in-flight limit
-      if (m_device->waitForFences(1, &m_inFlightFences[currentFrame].get(), true, UINT64_MAX) != vk::Result::eSuccess) throw std::runtime_error("Wait for fence failed");
+      auto acquireNextImageResult = m_device->acquireNextImageKHR(m_swapchain.get(), UINT64_MAX, m_imageAvailableSemaphores[frameIndex].get(), nullptr);
+
+      if (acquireNextImageResult.result != vk::Result::eSuccess)
+      {
+        spdlog::warn("Acquire next image failed!");
+      }
+
+      imageIndex = acquireNextImageResult.value;
     }
 
-    m_imagesInFlight[imageIndex] = &m_inFlightFences[currentFrame];
+    frameTimer.Lap(FrameStats::Acquire);
+
+    m_gpuProfiler->NewFrame(frameIndex);
+    m_threadCommandPools->NewFrame(frameIndex);
 
-    // Check for window messages to process.
-    glfwPollEvents();
+    uint64_t completedSerial = m_device->getSemaphoreCounterValue(m_frameTimeline.get());
 
-    // Trigger GUI thread (GLFW is single threaded, therefore glfw related setup must be on main thread)
-    ImGui_ImplGlfw_NewFrame();
+    UpdateGuiSlots(frameCount, completedSerial);
+
+    // ImGui input is only touched while the GUI thread is idle, otherwise the events stay queued for the next frame
+    if (!m_guiBusy.load(std::memory_order_acquire))
     {
-      std::lock_guard<std::mutex> lk(m);
-      ready = true;
+      if (m_headless)
+      {
+        auto now = std::chrono::steady_clock::now();
+        ImGuiIO& io = ImGui::GetIO();
+        io.DisplaySize = ImVec2(float(m_width), float(m_height));
+        io.DeltaTime = std::max(float((now - lastFrameTimeSteady).count() * 1e-9), 1e-6f);
+        lastFrameTimeSteady = now;
+      }
+      else
+      {
+        // Check for window messages to process.
+        glfwPollEvents();
+
+        // GLFW is single threaded, therefore glfw related setup must be on main thread
+        ImGui_ImplGlfw_NewFrame();
+      }
+
+      // Kick the GUI thread, it records while this frame is rendered and submitted
+      m_guiBusy.store(true, std::memory_order_release);
+      guiWake.notify_one();
     }
-    cv.notify_one();
+
+    frameTimer.Lap(FrameStats::PollEvents);
+
+    RecordGuiCmdBuffer(frameIndex, imageIndex);
+
+    frameTimer.Lap(FrameStats::GuiWait);
 
     // Begin new frame on main thread
-    m_device->resetDescriptorPool(m_descPools[imageIndex].get());
-    m_memoryAllocator->NewFrame();
-    m_tracker->NewFrame();
+    m_descriptorAllocator->NewFrame(frameIndex);
+    m_memoryAllocator->NewFrame(frameIndex);
+    m_uniformRing->NewFrame(frameIndex);
+    m_tracker->NewFrame(frameIndex);
+    m_framebufferCache->NewFrame();
+    m_descriptorCache->NewFrame();
+    m_textureSystem->NewFrame(frameIndex);
+
+    // Hands finished uploads to this frame's graphics submit, and kicks off the next batch
+    auto uploadSync = m_uploader->NewFrame(frameIndex);
 
     float time = float((std::chrono::steady_clock::now() - startTimeSteady).count() * 1e-9);
-    CommandBuffer bgCmdBuf(m_device.get(), m_cmdBuffers[imageIndex].get(), *m_tracker);
+    CommandBuffer bgCmdBuf(*this, m_cmdBuffers[frameIndex].get());
+    // No profiler, its queries are reset on the graphics queue
+    CommandBuffer computeCmdBuf(m_device.get(), m_computeCmdBuffers[frameIndex].get(), *m_tracker);
     Context ctx{
       bgCmdBuf,
-      m_descPools[imageIndex].get(),
+      computeCmdBuf,
+      *m_descriptorAllocator,
       m_swapchainImageViews[imageIndex].get(), m_depthImageViews[imageIndex].get(),
       m_swapchainImages[imageIndex],
-      imageIndex, int(currentFrame), time };
+      imageIndex, frameIndex, time };
 
     render(ctx);
 
-    vk::SubmitInfo submitInfo;
+    m_uniformRing->Flush();
 
-    std::vector<vk::PipelineStageFlags> waitStages = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
+    frameTimer.Lap(FrameStats::Render);
 
-    std::vector<vk::CommandBuffer> submitBuffers = { m_cmdBuffers[imageIndex].get(), m_ImGuiCmdBuffers[imageIndex].get() };
+    bool hasCompute = computeCmdBuf.HasBegun();
 
-    submitInfo.setWaitSemaphores(m_imageAvailableSemaphores[ctx.currentFrame].get());
-    submitInfo.setWaitDstStageMask(waitStages);
-    submitInfo.setCommandBuffers(submitBuffers);
-    submitInfo.setSignalSemaphores(m_renderFinishedSemaphores[ctx.currentFrame].get());
+    if (hasCompute)
+    {
+      vk::Semaphore computeTimeline = m_computeTimeline.get();
+      vk::CommandBuffer computeBuf = m_computeCmdBuffers[frameIndex].get();
 
-    auto result = m_device->resetFences(1, &m_imagesInFlight[imageIndex]->get());
+      vk::TimelineSemaphoreSubmitInfo computeTimelineInfo;
+      computeTimelineInfo.setSignalSemaphoreValues(frameSerial);
 
-    // wait for the GUI thread
+      vk::SubmitInfo computeSubmitInfo;
+      computeSubmitInfo.setCommandBuffers(computeBuf);
+      computeSubmitInfo.setSignalSemaphores(computeTimeline);
+      computeSubmitInfo.setPNext(&computeTimelineInfo);
+
+      if (m_computeQueue.submit(1, &computeSubmitInfo, nullptr) != vk::Result::eSuccess) throw std::runtime_error("Compute submit failed");
+
+      m_computeSerials[frameIndex] = frameSerial;
+    }
+
+    vk::SubmitInfo submitInfo;
+
+    std::vector<vk::CommandBuffer> submitBuffers = { m_cmdBuffers[frameIndex].get(), m_ImGuiCmdBuffers[frameIndex].get() };
+    if (uploadSync.acquireCmdBuf) submitBuffers.insert(submitBuffers.begin(), uploadSync.acquireCmdBuf);
+
+    std::vector<vk::Semaphore> waitSemaphores;
+    std::vector<vk::PipelineStageFlags> waitStages;
+    std::vector<uint64_t> waitValues;
+    std::vector<vk::Semaphore> signalSemaphores = { m_frameTimeline.get() };
+    std::vector<uint64_t> signalValues = { frameSerial };
+
+    if (hasCompute && ctx.computeWaitStage)
+    {
+      waitSemaphores.push_back(m_computeTimeline.get());
+      waitStages.push_back(ctx.computeWaitStage);
+      waitValues.push_back(frameSerial);
+    }
+
+    if (uploadSync.waitValue > 0)
     {
-      std::unique_lock<std::mutex> lk(m);
-      cv.wait(lk, [&] { return processed; });
+      waitSemaphores.push_back(m_uploader->GetTimeline());
+      waitStages.push_back(uploadSync.waitStage);
+      waitValues.push_back(uploadSync.waitValue);
     }
-    processed = false;
 
-    result = m_graphcisQueue.submit(1, &submitInfo, m_inFlightFences[ctx.currentFrame].get());
+    if (!m_headless)
+    {
+      waitSemaphores.push_back(m_imageAvailableSemaphores[frameIndex].get());
+      waitStages.push_back(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+      waitValues.push_back(0); // Binary semaphore, ignored
+      signalSemaphores.push_back(m_renderFinishedSemaphores[imageIndex].get());
+      signalValues.push_back(0);
+    }
 
-    uint32_t imageIndexU32 = imageIndex;
+    vk::TimelineSemaphoreSubmitInfo timelineInfo;
+    timelineInfo.setWaitSemaphoreValues(waitValues);
+    timelineInfo.setSignalSemaphoreValues(signalValues);
 
-    vk::PresentInfoKHR presentInfo;
-    presentInfo.setWaitSemaphores(m_renderFinishedSemaphores[ctx.currentFrame].get());
-    presentInfo.setSwapchains(m_swapchain.get());
-    presentInfo.pImageIndices = &imageIndexU32;
+    submitInfo.setCommandBuffers(submitBuffers);
+    submitInfo.setWaitSemaphores(waitSemaphores);
+    submitInfo.setWaitDstStageMask(waitStages);
+    submitInfo.setSignalSemaphores(signalSemaphores);
+    submitInfo.setPNext(&timelineInfo);
 
-    result = m_graphcisQueue.presentKHR(presentInfo);
+    auto result = m_graphcisQueue.submit(1, &submitInfo, nullptr);
 
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    frameTimer.Lap(FrameStats::Submit);
 
-    frameCount++;
-    if (frameCount % 100 == 99)
+    if (!m_headless)
     {
-      auto now = std::chrono::high_resolution_clock::now();
-      m_timeSpentLast100Frames = (now - startTime).count() * 1e-9;
-      startTime = now;
+      uint32_t imageIndexU32 = imageIndex;
+
+      vk::PresentInfoKHR presentInfo;
+      presentInfo.setWaitSemaphores(m_renderFinishedSemaphores[imageIndex].get());
+      presentInfo.setSwapchains(m_swapchain.get());
+      presentInfo.pImageIndices = &imageIndexU32;
+
+      result = m_graphcisQueue.presentKHR(presentInfo);
     }
-  }
 
-  m_isRunning = false;
+    frameTimer.Lap(FrameStats::Present);
 
-  {
-    std::lock_guard<std::mutex> lk(m);
-    ready = true;
+    frameCount++;
+    frameTimer.Commit();
+
+    if (m_maxFrames != 0 && frameCount >= m_maxFrames) break;
   }
-  cv.notify_one();
+
+  m_isRunning = false;
+  guiWake.notify_one();
 
   guiThread.join();
 
@@ -907,6 +1306,8 @@ int Renderer::getHeight()
 
 glm::vec2 BG::Renderer::getCursorPos()
 {
+  if (m_headless) return glm::vec2(0.0);
+
   double x, y;
   glfwGetCursorPos(m_window, &x, &y);
   //float xscale, yscale;
@@ -916,6 +1317,8 @@ glm::vec2 BG::Renderer::getCursorPos()
 
 glm::bvec2 BG::Renderer::getMouseButtonState()
 {
+    if (m_headless) return glm::bvec2(false);
+
     return glm::bvec2(
       glfwGetMouseButton(m_window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS,
       glfwGetMouseButton(m_window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS
@@ -956,23 +1359,34 @@ vk::UniqueCommandBuffer BG::Renderer::AllocCmdBuffer()
   return std::move(m_device->allocateCommandBuffersUnique({ m_graphicsCmdPool.get(), vk::CommandBufferLevel::ePrimary, 1 })[0]);
 }
 
-void BG::Renderer::SubmitCmdBufferNow(vk::CommandBuffer buf, bool wait)
+void BG::Renderer::SubmitCmdBuffer(vk::CommandBuffer buf, vk::Fence fence)
 {
-  vk::Fence fence;
   vk::SubmitInfo submitInfo;
+  submitInfo.setCommandBuffers(buf);
 
-  if (wait)
+  if (m_graphcisQueue.submit(1, &submitInfo, fence) != vk::Result::eSuccess)
   {
-    fence = m_device->createFence({});
+    spdlog::error("Graphics queue submit failed");
+    throw std::runtime_error("Submit failed");
   }
+}
 
-  submitInfo.setCommandBuffers(buf);
+void BG::Renderer::SubmitCmdBufferNow(vk::CommandBuffer buf, bool wait)
+{
+  if (!wait)
+  {
+    SubmitCmdBuffer(buf, nullptr);
+    return;
+  }
 
-  auto result = m_graphcisQueue.submit(1, &submitInfo, fence);
+  auto fence = m_fencePool->Acquire();
 
-  if (wait)
+  SubmitCmdBuffer(buf, fence.get());
+  if (m_device->waitForFences(fence.get(), true, UINT64_MAX) != vk::Result::eSuccess)
   {
-    result = m_device->waitForFences(1, &fence, true, UINT64_MAX);
-    m_device->destroyFence(fence);
+    spdlog::error("Waiting for an immediate submit failed");
+    throw std::runtime_error("Command buffer wait failed");
   }
+
+  m_fencePool->Release(std::move(fence));
 }
@@ -6,6 +6,8 @@
 #include <vulkan/vulkan.hpp>
 
 #include <functional>
+#include <atomic>
+#include <array>
 
 namespace BG
 {
@@ -17,15 +19,14 @@ namespace BG
   class Renderer
   {
   private:
-    GLFWwindow* m_window;
+    GLFWwindow* m_window = nullptr;
 
-    bool m_isRunning = true;
-    const int MAX_FRAMES_IN_FLIGHT = 2;
+    std::atomic<bool> m_isRunning{ true };
+    std::atomic<bool> m_stopRequested{ false };
+    int m_framesInFlight = 2;
 
     int m_width = 1280, m_height = 720;
 
-    double m_timeSpentLast100Frames = 1.0;
-
     // Vulkan member stuff
     vk::UniqueInstance                 m_instance;
     vk::DispatchLoaderDynamic          m_dispatcher;
@@ -42,30 +43,74 @@ namespace BG
 
     vk::UniqueCommandPool              m_graphicsCmdPool;
     vk::UniqueCommandPool              m_guiCmdPool;
+    vk::UniqueCommandPool              m_guiSecondaryCmdPool; // GUI thread only
+    vk::UniqueCommandPool              m_computeCmdPool;
 
     VkDescriptorPool                   m_ImGuiDescPool;
     vk::UniqueRenderPass               m_ImGuiRenderPass;
 
-    // Vulkan per-frame stuff
+    // Frame N signals N on the timeline, the resources of frame slot N % m_framesInFlight are reused
+    // once the timeline reaches N + 1 - m_framesInFlight
+    vk::UniqueSemaphore                   m_frameTimeline;
+    // Signaled with the frame serial by the frames that submitted compute work
+    vk::UniqueSemaphore                   m_computeTimeline;
+
+    // Vulkan per-frame stuff, indexed by frame slot
     std::vector<vk::UniqueSemaphore>      m_imageAvailableSemaphores;
-    std::vector<vk::UniqueSemaphore>      m_renderFinishedSemaphores;
-    std::vector<vk::UniqueFence>          m_inFlightFences;
-    std::vector<vk::UniqueFence*>         m_imagesInFlight;
     std::vector<vk::UniqueCommandBuffer>  m_cmdBuffers;
     std::vector<vk::UniqueCommandBuffer>  m_ImGuiCmdBuffers;
+    std::vector<vk::UniqueCommandBuffer>  m_computeCmdBuffers;
+    std::vector<uint64_t>                 m_computeSerials;
+
+    // Per swapchain image stuff
+    std::vector<vk::UniqueSemaphore>      m_renderFinishedSemaphores;
     std::vector<vk::UniqueFramebuffer>    m_ImGuiFramebuffer;
-    std::vector<vk::UniqueDescriptorPool> m_descPools;
+
+    // The GUI thread records its secondary command buffers one frame ahead, and hands them over through
+    // these slots without locking. Free -> Recording -> Ready is done by the GUI thread,
+    // Ready -> Current -> Retired -> Free by the main thread.
+    enum class GuiSlotState : int { Free, Recording, Ready, Current, Retired };
+
+    struct GuiSlot
+    {
+      std::atomic<GuiSlotState> state{ GuiSlotState::Free };
+      vk::UniqueCommandBuffer   cmdBuf;
+      uint64_t sequence = 0;     // Set by the GUI thread before publishing
+      uint64_t retireSerial = 0; // Last frame executing this slot
+    };
+
+    static const int NUM_GUI_SLOTS = 3;
+    std::array<GuiSlot, NUM_GUI_SLOTS> m_guiSlots;
+    int m_currentGuiSlot = -1;
+    // Set by the main thread once ImGui input is prepared, cleared by the GUI thread after recording
+    std::atomic<bool> m_guiBusy{ false };
 
     // Images & image views
     std::vector<vk::Image>                  m_swapchainImages;
     std::vector<vk::UniqueImageView>        m_swapchainImageViews;
     std::vector<std::unique_ptr<BG::Image>> m_depthImages;
     std::vector<vk::UniqueImageView>        m_depthImageViews;
+    std::vector<std::unique_ptr<BG::Image>> m_offscreenImages;
 
     // Misc components from BG
     std::unique_ptr<MemoryAllocator> m_memoryAllocator;
     std::unique_ptr<TextureSystem>   m_textureSystem;
     std::unique_ptr<Tracker>         m_tracker;
+    std::unique_ptr<FrameStats>      m_frameStats;
+    std::unique_ptr<GpuProfiler>     m_gpuProfiler;
+    std::unique_ptr<WorkerPool>      m_workerPool;
+    std::unique_ptr<ThreadCommandPools> m_threadCommandPools;
+    std::unique_ptr<StreamingUploader>  m_uploader;
+    std::unique_ptr<PipelineCache>      m_pipelineCache;
+    std::unique_ptr<ShaderCache>        m_shaderCache;
+    std::unique_ptr<PipelineObjectCache> m_pipelineObjectCache;
+    std::unique_ptr<FramebufferCache>   m_framebufferCache;
+    std::unique_ptr<DescriptorCache>    m_descriptorCache;
+    std::unique_ptr<DescriptorAllocator> m_descriptorAllocator;
+    std::unique_ptr<UniformRing>        m_uniformRing;
+    std::unique_ptr<StagingPool>        m_stagingPool;
+    std::unique_ptr<FencePool>          m_fencePool;
+    std::unique_ptr<SamplerCache>       m_samplerCache;
 
     struct {
       int graphics = -1, compute = -1, transfer = -1;
@@ -73,6 +118,13 @@ namespace BG
 
     std::string m_name;
     bool m_enableValidationLayers = false;
+    bool m_headless = false;
+    int m_numOffscreenImages = 3;
+    size_t m_maxFrames = 0;
+    size_t m_uploadBudget = 32 << 20;
+    size_t m_uniformRingSize = 4 << 20;
+    std::string m_pipelineCachePath;
+    std::string m_shaderCacheDir;
 
     void InitWindow();
     void InitVulkan();
@@ -84,6 +136,10 @@ namespace BG
     void CreateDevice();
     void CreateSurface();
     void CreateSwapChain();
+    void CreateOffscreenTargets();
+    // Puts the offscreen images in the layout the GUI render pass expects, needs the command pools
+    void TransitionOffscreenTargets();
+    void CreateDepthImages();
     void CreateCmdPools();
     void CreateCmdBuffers();
     void CreateSemaphore();
@@ -100,20 +156,57 @@ namespace BG
 
     void DestroyImGuiSwapChain();
 
+    void UpdateGuiSlots(uint64_t lastSubmittedSerial, uint64_t completedSerial);
+    void RecordGuiCmdBuffer(int frameIndex, int imageIndex);
+
   public:
 
     bool m_hasDescriptorIndexing = false;
+    bool m_hasDescriptorUpdateAfterBind = false;
+    bool m_hasPipelineStatistics = false;
+
+    struct Options
+    {
+      // Render into a ring of offscreen images, without creating a GLFW window or a swapchain
+      bool headless = false;
+      int width = 1280, height = 720;
+      int numOffscreenImages = 3;
+      // Stop the Run() loop after this many frames (0 = run until the window closes / Stop() is called)
+      size_t maxFrames = 0;
+      // Frames the CPU may record ahead of the GPU, lower for latency, higher for throughput
+      int framesInFlight = 2;
+      // Bytes the streaming uploader submits to the transfer queue per frame
+      size_t uploadBudgetPerFrame = 32 << 20;
+      // Bytes of per-frame constants the UniformRing can hold per frame
+      size_t uniformRingSizePerFrame = 4 << 20;
+      // Pipeline cache file, loaded at startup & saved on exit (empty = in memory only)
+      std::string pipelineCachePath = "pipeline_cache.bin";
+      // Compiled SPIR-V & reflection, keyed by source hash (empty = in memory only)
+      std::string shaderCacheDir = "shader_cache";
+#ifdef _DEBUG
+      bool enableValidationLayers = true;
+#else
+      bool enableValidationLayers = false;
+#endif
+    };
 
     struct Context
     {
       CommandBuffer& cmdBuffer;
-      vk::DescriptorPool descPool;
+      // Compute lane, submitted to the compute queue before `cmdBuffer`. Falls back to the graphics queue when
+      // there is no separate compute family. Nothing is submitted if it's never begun.
+      CommandBuffer& computeCmdBuffer;
+      // Sets allocated from it are valid until this frame slot is reused
+      DescriptorAllocator& descAllocator;
       vk::ImageView imageView;
       vk::ImageView depthImageView;
       vk::Image image;
-      int imageIndex;
-      int currentFrame;
+      int imageIndex;   // Swapchain / offscreen image
+      int currentFrame; // Frame slot, in [0, getFramesInFlight())
       float time;
+      // Stages of `cmdBuffer` that wait for this frame's compute work. Narrow it to let the graphics work
+      // before the first consumer overlap, or clear it if the results are only read by later frames.
+      vk::PipelineStageFlags computeWaitStage = vk::PipelineStageFlagBits::eAllCommands;
     };
 
 #ifdef _DEBUG
@@ -121,6 +214,7 @@ namespace BG
 #else
     Renderer(std::string name, bool enableValidationLayers = false);
 #endif
+    Renderer(std::string name, const Options& options);
     ~Renderer();
 
     std::unique_ptr<Pipeline> CreatePipeline();
@@ -131,15 +225,37 @@ namespace BG
     glm::vec2 getCursorPos();
     glm::bvec2 getMouseButtonState();
 
+    inline bool isHeadless() const { return m_headless; }
+    inline int getFramesInFlight() const { return m_framesInFlight; }
+    inline bool hasAsyncCompute() const { return m_selectedPhyDeviceQueueIndices.compute != m_selectedPhyDeviceQueueIndices.graphics; }
+    inline uint32_t getGraphicsQueueFamily() const { return uint32_t(m_selectedPhyDeviceQueueIndices.graphics); }
+    inline uint32_t getComputeQueueFamily() const { return uint32_t(m_selectedPhyDeviceQueueIndices.compute); }
+
     inline BG::MemoryAllocator& getMemoryAllocator() { return *m_memoryAllocator; };
     inline BG::TextureSystem& getTextureSystem() { return *m_textureSystem; };
     inline BG::Tracker& getTracker() { return *m_tracker; }
+    inline BG::FrameStats& getFrameStats() { return *m_frameStats; }
+    inline BG::GpuProfiler& getGpuProfiler() { return *m_gpuProfiler; }
+    inline BG::WorkerPool& getWorkerPool() { return *m_workerPool; }
+    inline BG::ThreadCommandPools& getThreadCommandPools() { return *m_threadCommandPools; }
+    inline BG::StreamingUploader& getUploader() { return *m_uploader; }
+    inline BG::PipelineCache& getPipelineCache() { return *m_pipelineCache; }
+    inline BG::ShaderCache& getShaderCache() { return *m_shaderCache; }
+    inline BG::PipelineObjectCache& getPipelineObjectCache() { return *m_pipelineObjectCache; }
+    inline BG::FramebufferCache& getFramebufferCache() { return *m_framebufferCache; }
+    inline BG::DescriptorCache& getDescriptorCache() { return *m_descriptorCache; }
+    inline BG::DescriptorAllocator& getDescriptorAllocator() { return *m_descriptorAllocator; }
+    inline BG::UniformRing& getUniformRing() { return *m_uniformRing; }
+    inline BG::StagingPool& getStagingPool() { return *m_stagingPool; }
+    inline BG::FencePool& getFencePool() { return *m_fencePool; }
+    inline BG::SamplerCache& getSamplerCache() { return *m_samplerCache; }
 
     inline std::vector<vk::Image>& getSwapchainImages() { return m_swapchainImages; };
     inline std::vector<vk::UniqueImageView>& getSwapchainImageViews() { return m_swapchainImageViews; };
     inline std::vector<vk::UniqueImageView>& getDepthImageViews() { return m_depthImageViews; };
 
     inline vk::Device getDevice() { return m_device.get(); }
+    inline vk::PhysicalDevice getPhysicalDevice() { return m_physicalDevice; }
 
     vk::Format getSwapChainFormat();
 
@@ -148,8 +264,13 @@ namespace BG
 
     vk::UniqueCommandBuffer AllocCmdBuffer();
 
+    // Graphics queue, main thread only. Prefer an UploadBatch for uploads.
+    void SubmitCmdBuffer(vk::CommandBuffer buf, vk::Fence fence);
     void SubmitCmdBufferNow(vk::CommandBuffer buf, bool wait = true);
 
+    // Request the Run() loop to exit after the current frame
+    void Stop();
+
     void Run(std::function<void()> init, std::function<void(Context&)> render, std::function<void()> renderGUI, std::function<void()> cleanup);
   };
 }
\ No newline at end of file
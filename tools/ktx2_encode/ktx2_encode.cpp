@@ -0,0 +1,139 @@
+#include "berkeley_gfx.hpp"
+#include "ktx2.hpp"
+#include "texture_system.hpp"
+#include "upload_batch.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <stb/stb_image.h>
+
+#define STB_DXT_IMPLEMENTATION
+#include <stb/stb_dxt.h>
+
+using namespace BG;
+
+// Offline encoder: PNG / JPEG (anything stb_image reads) to a KTX2 file with a full mip chain, for
+// TextureSystem::AddTexture(const Ktx2Texture&). BC1 is 8x smaller than RGBA8, BC3 4x.
+//
+//   Ktx2Encode <input> <output.ktx2> [bc1 | bc3 | rgba8] [--linear]
+//
+// The format defaults to BC3 for images with alpha, BC1 otherwise. Colors are sRGB unless --linear is given.
+
+static const char* USAGE = "Usage: Ktx2Encode <input> <output.ktx2> [bc1 | bc3 | rgba8] [--linear]";
+
+// Every 4x4 block of one level, rows of blocks spread across the workers
+static void CompressLevel(WorkerPool& workers, const uint8_t* rgba, glm::uvec2 extent, bool alpha, uint8_t* out)
+{
+  uint32_t blocksX = (extent.x + 3) / 4;
+  uint32_t blocksY = (extent.y + 3) / 4;
+  uint32_t blockBytes = alpha ? 16 : 8;
+
+  workers.ParallelFor(blocksY, [&](uint32_t by) {
+    uint8_t block[16 * 4];
+
+    for (uint32_t bx = 0; bx < blocksX; bx++)
+    {
+      // Edge blocks repeat the last row / column
+      for (uint32_t y = 0; y < 4; y++)
+      {
+        for (uint32_t x = 0; x < 4; x++)
+        {
+          uint32_t sx = std::min(bx * 4 + x, extent.x - 1);
+          uint32_t sy = std::min(by * 4 + y, extent.y - 1);
+          std::memcpy(block + (y * 4 + x) * 4, rgba + (size_t(sy) * extent.x + sx) * 4, 4);
+        }
+      }
+
+      stb_compress_dxt_block(out + (size_t(by) * blocksX + bx) * blockBytes, block, alpha ? 1 : 0, STB_DXT_HIGHQUAL);
+    }
+  });
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    spdlog::error(USAGE);
+    return 1;
+  }
+
+  std::string input = argv[1];
+  std::string output = argv[2];
+  std::string formatName;
+  bool linear = false;
+
+  for (int i = 3; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--linear") linear = true;
+    else if (arg == "bc1" || arg == "bc3" || arg == "rgba8") formatName = arg;
+    else
+    {
+      spdlog::error("Unknown argument {}. {}", arg, USAGE);
+      return 1;
+    }
+  }
+
+  int width, height, channels;
+  uint8_t* pixels = stbi_load(input.c_str(), &width, &height, &channels, 4);
+  if (!pixels)
+  {
+    spdlog::error("Can't read {}: {}", input, stbi_failure_reason());
+    return 1;
+  }
+
+  if (formatName.empty()) formatName = channels == 4 ? "bc3" : "bc1";
+
+  glm::uvec2 extent = glm::uvec2(width, height);
+  uint32_t levels = UploadBatch::FullMipLevels(extent);
+  size_t size = size_t(width) * height * 4;
+
+  WorkerPool workers;
+
+  // Mips are filtered before compression, in linear space for sRGB
+  vk::Format rgbaFormat = linear ? vk::Format::eR8G8B8A8Unorm : vk::Format::eR8G8B8A8Srgb;
+  std::vector<uint8_t> mips = TextureSystem::GenerateMipsCPU(workers, pixels, size, extent, levels, rgbaFormat);
+  stbi_image_free(pixels);
+
+  Ktx2Texture texture;
+  texture.extent = extent;
+  texture.levels = levels;
+
+  if (formatName == "rgba8")
+  {
+    texture.format = rgbaFormat;
+    texture.block = TexelBlock{ 1, 1, 4 };
+    texture.data = std::move(mips);
+  }
+  else
+  {
+    bool alpha = formatName == "bc3";
+
+    if (alpha) texture.format = linear ? vk::Format::eBc3UnormBlock : vk::Format::eBc3SrgbBlock;
+    else texture.format = linear ? vk::Format::eBc1RgbUnormBlock : vk::Format::eBc1RgbSrgbBlock;
+    texture.block = TexelBlock{ 4, 4, alpha ? 16u : 8u };
+
+    TexelBlock rgba = TexelBlock{ 1, 1, 4 };
+    size_t srcOffset = 0;
+
+    for (uint32_t level = 0; level < levels; level++)
+    {
+      glm::uvec2 levelExtent = glm::max(extent >> level, glm::uvec2(1));
+
+      size_t dstOffset = texture.data.size();
+      texture.data.resize(dstOffset + texture.block.ImageSize(levelExtent));
+
+      CompressLevel(workers, mips.data() + srcOffset, levelExtent, alpha, texture.data.data() + dstOffset);
+
+      srcOffset += rgba.ImageSize(levelExtent);
+    }
+  }
+
+  texture.Save(output);
+
+  spdlog::info("{}: {}x{}, {} mips, {}, {} bytes", output, width, height, levels, vk::to_string(texture.format), texture.data.size());
+
+  return 0;
+}